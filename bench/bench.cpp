@@ -0,0 +1,626 @@
+#include <benchmark/benchmark.h>
+#include <client.h>
+#include <daemon.h>
+#include <fstream>
+#include <journal.h>
+#include <libusb-1.0/libusb.h>
+#include <metrics.h>
+#include <periodparser.h>
+#include <scheduler.h>
+#include <sstream>
+#include <thread>
+#include <timerwheel.h>
+#include <tools.h>
+#include <usbtracker.h>
+
+static const std::string periods_value{
+    "00:00-04:30, 06:15-07:30, 08:39-09:00, 12:00-13:00, 20:00-24:00"
+};
+
+#define BENCH_CONFIG_PATH "/tmp/boredomlock-bench.ini"
+
+/// @brief Build a configuration with sections devices.
+static simpleini::SimpleINI
+make_config(std::size_t sections)
+{
+    simpleini::SimpleINI config;
+    for (std::size_t i = 0; i < sections; ++i) {
+        const usb_id id{ static_cast<uint16_t>(0x1000 + i / 0x10000),
+                         static_cast<uint16_t>(i) };
+        const auto name = "Device" + std::to_string(i);
+        config.add_section(
+          name,
+          simpleini::INISection{ name,
+                                 { { "usb_id", id.to_string() },
+                                   { "weekdays", "00:00-06:00, 20:00-24:00" },
+                                   { "weekend", "00:00-24:00" } } });
+    }
+    return config;
+}
+
+/// @brief Write a configuration file with sections devices.
+/// @param change_first give the first device other weekdays.
+static void
+write_config(std::size_t sections, bool change_first = false)
+{
+    std::ofstream file(BENCH_CONFIG_PATH);
+    for (std::size_t i = 0; i < sections; ++i) {
+        const usb_id id{ static_cast<uint16_t>(0x1000 + i / 0x10000),
+                         static_cast<uint16_t>(i) };
+        const auto* weekdays = i == 0 && change_first
+                                 ? "00:00-24:00"
+                                 : "00:00-06:00, 20:00-24:00";
+        file << "[Device" << i << "]\nusb_id = " << id.to_string()
+             << "\nweekdays = " << weekdays << "\nweekend = 00:00-24:00\n";
+    }
+}
+
+/// @brief The stringstream based period parser the library used to have,
+/// kept as a baseline for the parser benchmarks.
+static std::vector<std::pair<int, int>>
+stringstream_parse_periods(std::string_view view)
+{
+    auto minutes = [](std::string_view time) {
+        short hour = 0;
+        short min = 0;
+        std::stringstream ss;
+        auto delimiter = time.find(':');
+        ss << time.substr(0, delimiter);
+        ss >> hour;
+        if (delimiter != std::string::npos) {
+            ss.clear();
+            ss << time.substr(delimiter + 1);
+            ss >> min;
+        }
+        return hour * 60 + min;
+    };
+
+    std::vector<std::pair<int, int>> periods;
+    size_t delimiter = 0;
+    size_t prev = 0;
+    while (delimiter < std::string::npos) {
+        delimiter = view.find(',', prev);
+        auto period = view.substr(prev, delimiter - prev);
+        auto dash = period.find('-');
+        periods.emplace_back(minutes(period.substr(0, dash)),
+                             minutes(period.substr(dash + 1)));
+        prev = delimiter + 1;
+    }
+    return periods;
+}
+
+static void
+BM_parse_periods_stringstream(benchmark::State& state)
+{
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(stringstream_parse_periods(periods_value));
+    }
+}
+BENCHMARK(BM_parse_periods_stringstream);
+
+static void
+BM_parse_spans(benchmark::State& state)
+{
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_spans(periods_value));
+    }
+}
+BENCHMARK(BM_parse_spans);
+
+static void
+BM_for_each_span(benchmark::State& state)
+{
+    for (auto _ : state) {
+        WeekMask mask;
+        for_each_span(periods_value, [&mask](MinuteSpan span) {
+            add_spans(mask, 1, &span, 1);
+        });
+        benchmark::DoNotOptimize(mask);
+    }
+}
+BENCHMARK(BM_for_each_span);
+
+static void
+BM_parse_bored_periods(benchmark::State& state)
+{
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_bored_periods(periods_value));
+    }
+}
+BENCHMARK(BM_parse_bored_periods);
+
+static void
+BM_usb_id_from_string(benchmark::State& state)
+{
+    const std::string id{ "dead:beef" };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(usb_id_from_string(id));
+    }
+}
+BENCHMARK(BM_usb_id_from_string);
+
+static void
+BM_list_usb_sysfs(benchmark::State& state)
+{
+    for (auto _ : state) {
+        std::vector<usb_id> devices;
+        list_usb_sysfs(SYSFS_USB_DEVICES, devices);
+        benchmark::DoNotOptimize(devices);
+    }
+}
+BENCHMARK(BM_list_usb_sysfs);
+
+static void
+BM_list_usb_libusb(benchmark::State& state)
+{
+    libusb_context* ctx = nullptr;
+    if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+        state.SkipWithError("libusb_init failed");
+        return;
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(list_usb_libusb(ctx));
+    }
+    libusb_exit(ctx);
+}
+BENCHMARK(BM_list_usb_libusb);
+
+static void
+BM_tracker_startup(benchmark::State& state)
+{
+    for (auto _ : state) {
+        USBTracker tracker(static_cast<USBBackend>(state.range(0)));
+        tracker.start_tracking();
+        tracker.stop_tracking();
+    }
+}
+BENCHMARK(BM_tracker_startup)
+  ->Arg(LIBUSB_BACKEND)
+  ->Arg(UDEV_BACKEND)
+  ->Unit(benchmark::kMillisecond);
+
+/// @brief Report the statistics of a tracker as counters.
+static void
+report_stats(benchmark::State& state, const USBTrackerStats& stats)
+{
+    state.counters["wakeups_per_second"] = stats.wakeups_per_second();
+    state.counters["events"] = static_cast<double>(stats.events);
+    state.counters["mean_latency_ns"] =
+      static_cast<double>(stats.mean_latency().count());
+    state.counters["max_latency_ns"] =
+      static_cast<double>(stats.max_latency.count());
+}
+
+static void
+BM_backend_idle_wakeups(benchmark::State& state)
+{
+    USBTracker tracker(static_cast<USBBackend>(state.range(0)));
+    tracker.set_measure(true);
+    tracker.start_tracking();
+    for (auto _ : state) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    report_stats(state, tracker.stats());
+    tracker.stop_tracking();
+}
+BENCHMARK(BM_backend_idle_wakeups)
+  ->Arg(LIBUSB_BACKEND)
+  ->Arg(UDEV_BACKEND)
+  ->Iterations(5)
+  ->Unit(benchmark::kMillisecond);
+
+/// @brief Re-announce the device named by $BENCH_UEVENT_DEVICE, e.g. 1-1,
+/// with synthetic add uevents like udevadm trigger -c add. Needs write
+/// access to the uevent file of the device.
+/// @details The latency runs from just before the uevent file is written to
+/// the subscriber callback, through the kernel, netlink and the backend.
+static void
+BM_backend_uevents(benchmark::State& state)
+{
+    const char* device = getenv("BENCH_UEVENT_DEVICE");
+    if (!device) {
+        state.SkipWithError("Set BENCH_UEVENT_DEVICE to a USB device");
+        return;
+    }
+    const auto path = SYSFS_USB_DEVICES / device;
+    usb_id id{};
+    std::ifstream(path / "idVendor") >> std::hex >> id.vid;
+    std::ifstream(path / "idProduct") >> std::hex >> id.pid;
+
+    using clock = std::chrono::steady_clock;
+    std::atomic<clock::rep> sent{ 0 };
+    std::atomic<int64_t> events{ 0 };
+    std::atomic<int64_t> total_ns{ 0 };
+    std::atomic<int64_t> max_ns{ 0 };
+
+    USBTracker tracker(static_cast<USBBackend>(state.range(0)));
+    tracker.set_match_any(true);
+    tracker.set_measure(true);
+    const auto subscription =
+      tracker.subscribe({ id }, [&](const USBEvent&) {
+          // Only the first event of each write is timed.
+          const auto start = sent.exchange(0);
+          if (start == 0) {
+              return;
+          }
+          const auto elapsed =
+            clock::now() - clock::time_point(clock::duration(start));
+          const int64_t ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count();
+          events++;
+          total_ns += ns;
+          max_ns = std::max(max_ns.load(), ns);
+      });
+    tracker.start_tracking();
+    for (auto _ : state) {
+        sent = clock::now().time_since_epoch().count();
+        if (!(std::ofstream(path / "uevent") << "add")) {
+            state.SkipWithError("Can't write the uevent file");
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    tracker.stop_tracking();
+    tracker.unsubscribe(subscription);
+
+    report_stats(state, tracker.stats());
+    state.counters["events"] = static_cast<double>(events);
+    state.counters["mean_latency_ns"] =
+      events ? static_cast<double>(total_ns) / static_cast<double>(events)
+             : 0.0;
+    state.counters["max_latency_ns"] = static_cast<double>(max_ns);
+}
+BENCHMARK(BM_backend_uevents)
+  ->Arg(LIBUSB_BACKEND)
+  ->Arg(UDEV_BACKEND)
+  ->Iterations(50)
+  ->Unit(benchmark::kMillisecond);
+
+static void
+BM_parse_from_iniconf(benchmark::State& state)
+{
+    const auto config = make_config(state.range(0));
+    const auto now = std::chrono::system_clock::now();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parse_from_iniconf(config, now));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_parse_from_iniconf)->Arg(1)->Arg(100)->Arg(10000);
+
+static void
+BM_compile_schedule(benchmark::State& state)
+{
+    const auto config = make_config(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(compile_schedule(config));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_compile_schedule)->Arg(1)->Arg(100)->Arg(10000);
+
+static void
+BM_reload_one_section(benchmark::State& state)
+{
+    // The file is read and fingerprinted again, only the changed section is
+    // compiled and indexed.
+    write_config(state.range(0));
+    BoredomScheduler sched{ BENCH_CONFIG_PATH };
+    sched.init();
+    bool changed = false;
+    for (auto _ : state) {
+        state.PauseTiming();
+        changed = !changed;
+        write_config(state.range(0), changed);
+        state.ResumeTiming();
+        sched.reload_config();
+    }
+}
+BENCHMARK(BM_reload_one_section)->Arg(100)->Arg(10000);
+
+static void
+BM_required_masks(benchmark::State& state)
+{
+    write_config(state.range(0));
+    const auto schedule =
+      compile_schedule(simpleini::SimpleINI(BENCH_CONFIG_PATH));
+    std::vector<uint64_t> bitmap((schedule.size() + 63) / 64);
+    std::size_t minute = 0;
+    for (auto _ : state) {
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+        for (std::size_t i = 0; i < schedule.size(); ++i) {
+            bitmap[i / 64] |= uint64_t{ schedule[i].mask.test(minute) }
+                              << (i % 64);
+        }
+        benchmark::DoNotOptimize(bitmap.data());
+        minute = (minute + 97) % MINUTES_PER_WEEK;
+    }
+}
+BENCHMARK(BM_required_masks)->Arg(100)->Arg(10000);
+
+static void
+BM_required_bitmap(benchmark::State& state)
+{
+    write_config(state.range(0));
+    const TransitionIndex index(
+      compile_schedule(simpleini::SimpleINI(BENCH_CONFIG_PATH)));
+    std::vector<uint64_t> bitmap;
+    std::size_t minute = 0;
+    for (auto _ : state) {
+        index.required_bitmap(minute, bitmap);
+        benchmark::DoNotOptimize(bitmap.data());
+        minute = (minute + 97) % MINUTES_PER_WEEK;
+    }
+}
+BENCHMARK(BM_required_bitmap)->Arg(100)->Arg(10000);
+
+static void
+BM_is_alarm(benchmark::State& state)
+{
+    write_config(state.range(0));
+    BoredomScheduler sched{ BENCH_CONFIG_PATH };
+    sched.init();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sched.is_alarm());
+    }
+}
+BENCHMARK(BM_is_alarm)->Arg(1)->Arg(100)->Arg(10000);
+
+static void
+BM_is_alarm_metrics(benchmark::State& state)
+{
+    write_config(state.range(0));
+    BoredomScheduler sched{ BENCH_CONFIG_PATH };
+    sched.init();
+    Metrics::set_enabled(true);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sched.is_alarm());
+    }
+    Metrics::set_enabled(false);
+    const auto evaluation = Metrics::snapshot().histograms[EVALUATION_TIME];
+    state.counters["p99_ns"] =
+      static_cast<double>(evaluation.percentile(0.99).count());
+}
+BENCHMARK(BM_is_alarm_metrics)->Arg(1)->Arg(10000);
+
+static void
+BM_list_unconnected_devices(benchmark::State& state)
+{
+    write_config(state.range(0));
+    BoredomScheduler sched{ BENCH_CONFIG_PATH };
+    sched.init();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sched.list_unconnected_devices());
+    }
+}
+BENCHMARK(BM_list_unconnected_devices)->Arg(1)->Arg(100)->Arg(10000);
+
+static void
+BM_unconnected_changes(benchmark::State& state)
+{
+    write_config(state.range(0));
+    BoredomScheduler sched{ BENCH_CONFIG_PATH };
+    sched.init();
+    auto generation = sched.unconnected_changes(0).generation;
+    for (auto _ : state) {
+        const auto changes = sched.unconnected_changes(generation);
+        generation = changes.generation;
+        benchmark::DoNotOptimize(changes);
+    }
+}
+BENCHMARK(BM_unconnected_changes)->Arg(1)->Arg(100)->Arg(10000);
+
+static void
+BM_timer_wheel(benchmark::State& state)
+{
+    // Snoozes of seconds to hours, one replaced and the wheel advanced by a
+    // millisecond each iteration.
+    TimerWheel wheel(std::chrono::system_clock::time_point{});
+    std::vector<TimerId> timers(state.range(0));
+    uint64_t seed = 1;
+    const auto delay = [&seed] {
+        seed = seed * 6364136223846793005 + 1442695040888963407;
+        return std::chrono::milliseconds(1000 + (seed >> 33) % 3600000);
+    };
+    for (auto& timer : timers) {
+        timer = wheel.add(wheel.now() + delay(), 0);
+    }
+    std::vector<uint64_t> expired;
+    std::size_t i = 0;
+    for (auto _ : state) {
+        auto& timer = timers[i++ % timers.size()];
+        wheel.cancel(timer);
+        timer = wheel.add(wheel.now() + delay(), 0);
+        expired.clear();
+        wheel.advance(wheel.now() + std::chrono::milliseconds(1), expired);
+        benchmark::DoNotOptimize(wheel.next_expiry());
+    }
+}
+BENCHMARK(BM_timer_wheel)->Arg(64)->Arg(10000);
+
+#define BENCH_SOCKET_PATH "/tmp/boredomlock-bench.sock"
+
+static void
+BM_client_is_alarm(benchmark::State& state)
+{
+    write_config(state.range(0));
+    BoredomScheduler sched{ BENCH_CONFIG_PATH };
+    sched.init();
+    BoredomDaemon daemon(sched, BENCH_SOCKET_PATH);
+    if (!daemon.listen()) {
+        state.SkipWithError("Can't listen on the benchmark socket");
+        return;
+    }
+    std::thread server(&BoredomDaemon::run, &daemon);
+
+    BoredomClient client(BENCH_SOCKET_PATH);
+    client.init();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(client.is_alarm());
+    }
+    daemon.stop();
+    server.join();
+}
+BENCHMARK(BM_client_is_alarm)->Arg(1)->Arg(10000)->UseRealTime();
+
+static void
+BM_usb_id_is_connected(benchmark::State& state)
+{
+    // Thread 0 plays the hotplug thread while the other threads query.
+    static USBTracker tracker;
+    const usb_id plugged{ 0xdead, 0xbeef };
+    const usb_id queried{ 0xbabe, 0xcafe };
+
+    if (state.thread_index() == 0) {
+        tracker.handle_device_add_event(queried);
+    }
+    for (auto _ : state) {
+        if (state.thread_index() == 0 && state.threads() > 1) {
+            tracker.handle_device_add_event(plugged);
+            tracker.handle_device_remove_event(plugged);
+        } else {
+            benchmark::DoNotOptimize(tracker.usb_id_is_connected(queried));
+        }
+    }
+    // The event queue has a single consumer.
+    if (state.thread_index() == 0) {
+        std::vector<USBEvent> events;
+        tracker.drain_events(events);
+    }
+}
+BENCHMARK(BM_usb_id_is_connected)->ThreadRange(1, 8)->UseRealTime();
+
+static void
+BM_handle_device_events(benchmark::State& state)
+{
+    USBTracker tracker;
+    std::vector<USBEvent> events;
+    const usb_id id{ 0xdead, 0xbeef };
+
+    for (auto _ : state) {
+        tracker.handle_device_add_event(id);
+        tracker.handle_device_remove_event(id);
+        if (events.size() > USBTracker::EVENT_QUEUE_SIZE / 2) {
+            events.clear();
+        }
+        tracker.drain_events(events);
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_handle_device_events);
+
+static void
+BM_synthetic_source(benchmark::State& state)
+{
+    const std::vector<usb_id> pool{ { 0xdead, 0xbeef }, { 0xbabe, 0xcafe } };
+    const auto count = static_cast<uint64_t>(state.range(0));
+
+    for (auto _ : state) {
+        USBTracker tracker(std::make_unique<SyntheticSource>(pool, count));
+        auto sub = tracker.subscribe(pool, [](const USBEvent&) {});
+        tracker.set_measure(true);
+        tracker.start_tracking();
+        tracker.join_thread();
+        tracker.stop_tracking();
+        tracker.unsubscribe(sub);
+
+        const auto stats = tracker.stats();
+        state.counters["mean_latency_ns"] =
+          static_cast<double>(stats.mean_latency().count());
+        state.counters["max_latency_ns"] =
+          static_cast<double>(stats.max_latency.count());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_synthetic_source)
+  ->Arg(1 << 20)
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+#define BENCH_JOURNAL_PATH "/tmp/boredomlock-bench.journal"
+
+static void
+BM_journal_record_device(benchmark::State& state)
+{
+    std::filesystem::remove(BENCH_JOURNAL_PATH);
+    Journal journal;
+    journal.open(BENCH_JOURNAL_PATH);
+    const usb_id id{ 0xdead, 0xbeef };
+    auto now = std::chrono::system_clock::now();
+    bool connected = false;
+    for (auto _ : state) {
+        journal.record_device(id, connected, now);
+        connected = !connected;
+        now += std::chrono::seconds(1);
+        if (journal.size() == Journal::INITIAL_CAPACITY) {
+            state.PauseTiming();
+            journal.compact(now);
+            state.ResumeTiming();
+        }
+    }
+    std::filesystem::remove(BENCH_JOURNAL_PATH);
+}
+BENCHMARK(BM_journal_record_device);
+
+static void
+BM_journal_disconnected_time(benchmark::State& state)
+{
+    std::filesystem::remove(BENCH_JOURNAL_PATH);
+    Journal journal;
+    journal.open(BENCH_JOURNAL_PATH);
+    // A month of a device plugged in and out every few minutes, and another
+    // device that never changes.
+    const usb_id id{ 0xdead, 0xbeef };
+    const usb_id quiet{ 0xbabe, 0xcafe };
+    const std::chrono::system_clock::time_point start{};
+    journal.record_device(quiet, false, start);
+    const auto month = std::chrono::days(30);
+    std::size_t i = 0;
+    for (auto t = start; t < start + month; t += std::chrono::minutes(2)) {
+        journal.record_device(id, ++i % 2, t);
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+          journal.disconnected_time(quiet, start + month / 2, start + month));
+    }
+    std::filesystem::remove(BENCH_JOURNAL_PATH);
+}
+BENCHMARK(BM_journal_disconnected_time)->Unit(benchmark::kMicrosecond);
+
+/// @brief disconnected_time of one of 100 devices over a window of
+/// range(1) days ending in the middle of a month of range(0) records.
+static void
+BM_journal_device_time(benchmark::State& state)
+{
+    std::filesystem::remove(BENCH_JOURNAL_PATH);
+    Journal journal;
+    journal.open(BENCH_JOURNAL_PATH);
+    const std::chrono::system_clock::time_point start{};
+    const auto month = std::chrono::days(30);
+    const auto records = state.range(0);
+    std::size_t capacity = Journal::INITIAL_CAPACITY;
+    for (int64_t i = 0; i < records; ++i) {
+        const usb_id id{ 0x1000, static_cast<uint16_t>(i % 100) };
+        journal.record_device(id, i / 100 % 2, start + month * i / records);
+        if (journal.size() == capacity) {
+            // Grow the file, nothing is old enough to be folded.
+            journal.compact(start);
+            capacity = 2 * journal.size();
+        }
+    }
+
+    const usb_id id{ 0x1000, 42 };
+    const auto end = start + month / 2;
+    const auto from = end - std::chrono::days(state.range(1));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(journal.disconnected_time(id, from, end));
+    }
+    std::filesystem::remove(BENCH_JOURNAL_PATH);
+}
+BENCHMARK(BM_journal_device_time)
+  ->Args({ 100000, 1 })
+  ->Args({ 1000000, 1 })
+  ->Args({ 1000000, 15 })
+  ->Unit(benchmark::kMicrosecond);
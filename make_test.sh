@@ -1,4 +1,4 @@
-clang-format -i -style="{BasedOnStyle: Mozilla, IndentWidth: 4}" src/*.cpp src/include/*.h test/*.cpp
+clang-format -i -style="{BasedOnStyle: Mozilla, IndentWidth: 4}" src/*.cpp src/include/*.h test/*.cpp bench/*.cpp
 
 if [ ! -d build ]; then
     mkdir build
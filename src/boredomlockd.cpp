@@ -0,0 +1,49 @@
+#include "daemon.h"
+#include "scheduler.h"
+#include <csignal>
+#include <iostream>
+#include <string_view>
+
+static BoredomDaemon* running_daemon = nullptr;
+
+static void
+stop_daemon(int)
+{
+    if (running_daemon) {
+        running_daemon->stop();
+    }
+}
+
+int
+main(int argc, char** argv)
+{
+    const std::filesystem::path config =
+      argc > 1 ? argv[1] : "/opt/boredom-lock/config.ini";
+    const std::filesystem::path socket =
+      argc > 2 ? argv[2] : protocol::default_socket_path();
+
+    if (const char* backend = getenv("BOREDOMLOCKD_BACKEND");
+        backend && std::string_view(backend) == "udev") {
+        USBTracker::set_default_backend(UDEV_BACKEND);
+    }
+
+    BoredomScheduler scheduler(config);
+    scheduler.init();
+    scheduler.open_journal();
+
+    BoredomDaemon daemon(scheduler, socket);
+    if (const char* metrics = getenv("BOREDOMLOCKD_METRICS");
+        metrics && *metrics) {
+        daemon.set_metrics_file(metrics, std::chrono::seconds(10));
+    }
+    if (!daemon.listen()) {
+        return 1;
+    }
+
+    running_daemon = &daemon;
+    std::signal(SIGINT, stop_daemon);
+    std::signal(SIGTERM, stop_daemon);
+    daemon.run();
+    running_daemon = nullptr;
+    return 0;
+}
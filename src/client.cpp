@@ -0,0 +1,232 @@
+#include "client.h"
+
+#include <iostream>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+BoredomClient::BoredomClient(const std::filesystem::path& socket)
+  : m_socket(socket)
+{
+    m_request.reserve(protocol::MAX_MESSAGE);
+    m_reply.resize(protocol::MAX_MESSAGE);
+}
+
+BoredomClient::~BoredomClient()
+{
+    for (auto fd : { m_socket_fd, m_wake_fd, m_epoll_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+bool
+BoredomClient::init()
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (m_socket.native().size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error, socket path " << m_socket << " is too long\n";
+        return false;
+    }
+    m_socket.native().copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+    m_socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (m_socket_fd < 0 ||
+        connect(m_socket_fd,
+                reinterpret_cast<const sockaddr*>(&address),
+                sizeof(address)) != 0) {
+        std::cerr << "Error connecting to boredomlockd at " << m_socket
+                  << "\n";
+        if (m_socket_fd >= 0) {
+            close(m_socket_fd);
+            m_socket_fd = -1;
+        }
+        return false;
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (auto fd : { m_socket_fd, m_wake_fd }) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+    return true;
+}
+
+protocol::Writer
+BoredomClient::m_begin(protocol::MessageType type) const
+{
+    return protocol::Writer(m_request, type, ++m_sequence);
+}
+
+std::optional<protocol::Reader>
+BoredomClient::m_call() const
+{
+    if (m_socket_fd < 0) {
+        std::cerr << "Error, not connected to boredomlockd\n";
+        return std::nullopt;
+    }
+    if (send(m_socket_fd, m_request.data(), m_request.size(), MSG_NOSIGNAL) <
+        0) {
+        std::cerr << "Error sending a request to boredomlockd\n";
+        return std::nullopt;
+    }
+
+    while (true) {
+        const auto size = recv(m_socket_fd, m_reply.data(), m_reply.size(), 0);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            std::cerr << "Error, boredomlockd closed the connection\n";
+            return std::nullopt;
+        }
+
+        protocol::Reader reply({ m_reply.data(), static_cast<size_t>(size) });
+        if (!reply.ok()) {
+            std::cerr << "Error, malformed reply from boredomlockd\n";
+            return std::nullopt;
+        }
+        if (reply.header().type == protocol::STATE_CHANGED) {
+            // Keep it for handle_events, fd() stays readable until then.
+            m_changes.push_back(reply.u8());
+            const uint64_t one = 1;
+            (void)!write(m_wake_fd, &one, sizeof(one));
+            continue;
+        }
+        if (reply.header().sequence != m_sequence) {
+            continue;
+        }
+        if (reply.header().type == protocol::ERROR_REPLY) {
+            std::cerr << "Error from boredomlockd: " << reply.string() << "\n";
+            return std::nullopt;
+        }
+        return reply;
+    }
+}
+
+bool
+BoredomClient::is_alarm() const
+{
+    m_begin(protocol::IS_ALARM);
+    auto reply = m_call();
+    return reply && reply->u8();
+}
+
+void
+BoredomClient::snooze(std::chrono::seconds seconds)
+{
+    m_begin(protocol::SNOOZE).i64(seconds.count());
+    m_call();
+}
+
+void
+BoredomClient::snooze(const usb_id& id, std::chrono::seconds seconds)
+{
+    m_begin(protocol::SNOOZE_DEVICE).u16(id.vid).u16(id.pid).i64(
+      seconds.count());
+    m_call();
+}
+
+void
+BoredomClient::disable()
+{
+    m_begin(protocol::DISABLE);
+    m_call();
+}
+
+void
+BoredomClient::enable()
+{
+    m_begin(protocol::ENABLE);
+    m_call();
+}
+
+int
+BoredomClient::fd() const
+{
+    return m_epoll_fd;
+}
+
+void
+BoredomClient::handle_events()
+{
+    uint64_t value;
+    (void)!read(m_wake_fd, &value, sizeof(value));
+
+    while (true) {
+        const auto size =
+          recv(m_socket_fd, m_reply.data(), m_reply.size(), MSG_DONTWAIT);
+        if (size <= 0) {
+            break;
+        }
+        protocol::Reader message(
+          { m_reply.data(), static_cast<size_t>(size) });
+        if (message.ok() &&
+            message.header().type == protocol::STATE_CHANGED) {
+            m_changes.push_back(message.u8());
+        }
+    }
+
+    const auto changes = std::move(m_changes);
+    m_changes.clear();
+    if (m_state_callback) {
+        for (const auto alarm : changes) {
+            m_state_callback(alarm);
+        }
+    }
+}
+
+void
+BoredomClient::set_state_change_cb(std::function<void(bool)> callback)
+{
+    m_begin(callback ? protocol::SUBSCRIBE : protocol::UNSUBSCRIBE);
+    m_call();
+    m_state_callback = std::move(callback);
+}
+
+std::chrono::system_clock::time_point
+BoredomClient::next_change() const
+{
+    m_begin(protocol::NEXT_CHANGE);
+    auto reply = m_call();
+    if (!reply) {
+        return std::chrono::system_clock::time_point::max();
+    }
+    return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::nanoseconds(reply->i64())));
+}
+
+std::vector<USBDevice>
+BoredomClient::list_unconnected_devices()
+{
+    m_begin(protocol::LIST_UNCONNECTED);
+    auto reply = m_call();
+    std::vector<USBDevice> devices;
+    if (!reply) {
+        return devices;
+    }
+
+    const auto count = reply->u16();
+    devices.reserve(count);
+    for (uint16_t i = 0; i < count && reply->ok(); ++i) {
+        USBDevice device;
+        device.id.vid = reply->u16();
+        device.id.pid = reply->u16();
+        device.name = reply->string();
+        devices.push_back(std::move(device));
+    }
+    if (!reply->ok()) {
+        std::cerr << "Error, malformed device list from boredomlockd\n";
+        devices.clear();
+    }
+    return devices;
+}
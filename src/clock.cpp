@@ -0,0 +1,121 @@
+#include "clock.h"
+
+#include <ctime>
+
+static int64_t
+local_offset(int64_t seconds)
+{
+    const time_t time = static_cast<time_t>(seconds);
+    std::tm local_tm{};
+    localtime_r(&time, &local_tm);
+    return local_tm.tm_gmtoff;
+}
+
+static int64_t
+to_seconds(std::chrono::system_clock::time_point now)
+{
+    return std::chrono::floor<std::chrono::seconds>(now)
+      .time_since_epoch()
+      .count();
+}
+
+std::size_t
+LocalTimeCache::minute_of_week(std::chrono::system_clock::time_point now)
+{
+    const auto seconds = to_seconds(now);
+    const auto day = m_lookup(seconds);
+    return static_cast<std::size_t>(day.weekday * 24 * 60 +
+                                    (seconds - day.midnight) / 60);
+}
+
+bool
+LocalTimeCache::is_weekend(std::chrono::system_clock::time_point now)
+{
+    const auto weekday = m_lookup(to_seconds(now)).weekday;
+    return weekday == std::chrono::Saturday.c_encoding() ||
+           weekday == std::chrono::Sunday.c_encoding();
+}
+
+std::chrono::seconds
+LocalTimeCache::utc_offset(std::chrono::system_clock::time_point now)
+{
+    return std::chrono::seconds(m_lookup(to_seconds(now)).utc_offset);
+}
+
+std::chrono::system_clock::time_point
+LocalTimeCache::valid_until(std::chrono::system_clock::time_point now)
+{
+    return std::chrono::system_clock::time_point(
+      std::chrono::seconds(m_lookup(to_seconds(now)).valid_until));
+}
+
+LocalTimeCache::Day
+LocalTimeCache::m_lookup(int64_t seconds)
+{
+    const auto before = m_sequence.load(std::memory_order_acquire);
+    if ((before & 1) == 0) {
+        Day day{ m_valid_from.load(std::memory_order_relaxed),
+                 m_valid_until.load(std::memory_order_relaxed),
+                 m_midnight.load(std::memory_order_relaxed),
+                 m_utc_offset.load(std::memory_order_relaxed),
+                 m_weekday.load(std::memory_order_relaxed) };
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (m_sequence.load(std::memory_order_relaxed) == before &&
+            day.valid_from <= seconds && seconds < day.valid_until) {
+            return day;
+        }
+    }
+
+    const auto day = m_compute(seconds);
+
+    // Another thread refreshing the cache already has a valid result, so
+    // there is no need to wait for it.
+    std::unique_lock lock(m_refresh_mtx, std::try_to_lock);
+    if (lock.owns_lock()) {
+        m_sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_valid_from.store(day.valid_from, std::memory_order_relaxed);
+        m_valid_until.store(day.valid_until, std::memory_order_relaxed);
+        m_midnight.store(day.midnight, std::memory_order_relaxed);
+        m_utc_offset.store(day.utc_offset, std::memory_order_relaxed);
+        m_weekday.store(day.weekday, std::memory_order_relaxed);
+        m_sequence.fetch_add(1, std::memory_order_release);
+    }
+    return day;
+}
+
+LocalTimeCache::Day
+LocalTimeCache::m_compute(int64_t seconds)
+{
+    const time_t time = static_cast<time_t>(seconds);
+    std::tm local_tm{};
+    localtime_r(&time, &local_tm);
+
+    const int64_t since_midnight =
+      local_tm.tm_hour * 3600 + local_tm.tm_min * 60 + local_tm.tm_sec;
+
+    Day day{};
+    day.valid_from = seconds;
+    day.midnight = seconds - since_midnight;
+    day.utc_offset = local_tm.tm_gmtoff;
+    day.weekday = local_tm.tm_wday;
+    day.valid_until = day.midnight + 24 * 3600;
+
+    // Find the first second with a different offset before the next
+    // midnight. Offsets change at most once a day.
+    if (local_offset(day.valid_until - 1) != day.utc_offset) {
+        int64_t same = seconds;
+        int64_t different = day.valid_until - 1;
+        while (different - same > 1) {
+            const auto middle = same + (different - same) / 2;
+            if (local_offset(middle) == day.utc_offset) {
+                same = middle;
+            } else {
+                different = middle;
+            }
+        }
+        day.valid_until = different;
+    }
+    return day;
+}
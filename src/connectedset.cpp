@@ -0,0 +1,211 @@
+#include "connectedset.h"
+
+#include <bit>
+
+static uint32_t
+slot_key(uint64_t value)
+{
+    return static_cast<uint32_t>(value);
+}
+
+static uint32_t
+slot_count(uint64_t value)
+{
+    return static_cast<uint32_t>(value >> 32);
+}
+
+static uint64_t
+make_slot(uint32_t key, uint32_t count)
+{
+    return (static_cast<uint64_t>(count) << 32) | key;
+}
+
+bool
+ConnectedSet::insert(const usb_id& id)
+{
+    m_begin_write();
+    const auto added = m_add(id.packed(), 1);
+    m_end_write();
+    return added;
+}
+
+void
+ConnectedSet::erase(const usb_id& id)
+{
+    m_begin_write();
+    const auto slot = m_find(id.packed());
+    if (slot != SLOTS) {
+        const auto value = m_slots[slot].load(std::memory_order_relaxed);
+        if (slot_count(value) > 1) {
+            const auto remaining = slot_count(value) - 1;
+            m_slots[slot].store(make_slot(slot_key(value), remaining),
+                                std::memory_order_relaxed);
+        } else {
+            m_remove_slot(slot);
+        }
+    }
+    m_end_write();
+}
+
+void
+ConnectedSet::erase_all(const usb_id& id)
+{
+    m_begin_write();
+    const auto slot = m_find(id.packed());
+    if (slot != SLOTS) {
+        m_remove_slot(slot);
+    }
+    m_end_write();
+}
+
+void
+ConnectedSet::assign(const std::vector<usb_id>& ids)
+{
+    m_begin_write();
+    for (auto& slot : m_slots) {
+        slot.store(0, std::memory_order_relaxed);
+    }
+    m_size = 0;
+    for (const auto& id : ids) {
+        m_add(id.packed(), 1);
+    }
+    m_end_write();
+}
+
+uint32_t
+ConnectedSet::count(const usb_id& id) const
+{
+    const auto key = id.packed();
+
+    while (true) {
+        const auto before = m_sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+
+        uint32_t result = 0;
+        const auto slot = m_find(key);
+        if (slot != SLOTS) {
+            result = slot_count(m_slots[slot].load(std::memory_order_relaxed));
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == before) {
+            return result;
+        }
+    }
+}
+
+std::vector<usb_id>
+ConnectedSet::list() const
+{
+    std::vector<usb_id> result;
+
+    while (true) {
+        result.clear();
+        const auto before = m_sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+
+        for (const auto& slot : m_slots) {
+            const auto value = slot.load(std::memory_order_relaxed);
+            const auto key = slot_key(value);
+            for (uint32_t i = 0; i < slot_count(value); ++i) {
+                result.push_back(usb_id{ static_cast<uint16_t>(key >> 16),
+                                         static_cast<uint16_t>(key) });
+            }
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == before) {
+            return result;
+        }
+    }
+}
+
+std::size_t
+ConnectedSet::m_home(uint32_t key)
+{
+    constexpr auto shift = 32 - (std::bit_width(SLOTS) - 1);
+    return (key * 0x9E3779B1u) >> shift;
+}
+
+std::size_t
+ConnectedSet::m_find(uint32_t key) const
+{
+    auto slot = m_home(key);
+    for (std::size_t probe = 0; probe < SLOTS; ++probe) {
+        const auto value = m_slots[slot].load(std::memory_order_relaxed);
+        if (value == 0) {
+            return SLOTS;
+        }
+        if (slot_key(value) == key) {
+            return slot;
+        }
+        slot = (slot + 1) & (SLOTS - 1);
+    }
+    return SLOTS;
+}
+
+void
+ConnectedSet::m_begin_write()
+{
+    m_sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+void
+ConnectedSet::m_end_write()
+{
+    m_sequence.fetch_add(1, std::memory_order_release);
+}
+
+void
+ConnectedSet::m_remove_slot(std::size_t slot)
+{
+    // Backward shift deletion keeps probe sequences intact without
+    // tombstones.
+    auto next = slot;
+    while (true) {
+        next = (next + 1) & (SLOTS - 1);
+        const auto value = m_slots[next].load(std::memory_order_relaxed);
+        if (value == 0) {
+            break;
+        }
+
+        const auto home = m_home(slot_key(value));
+        const auto stays = (slot <= next) ? (slot < home && home <= next)
+                                          : (slot < home || home <= next);
+        if (!stays) {
+            m_slots[slot].store(value, std::memory_order_relaxed);
+            slot = next;
+        }
+    }
+    m_slots[slot].store(0, std::memory_order_relaxed);
+    m_size--;
+}
+
+bool
+ConnectedSet::m_add(uint32_t key, uint32_t instances)
+{
+    auto slot = m_home(key);
+    while (true) {
+        const auto value = m_slots[slot].load(std::memory_order_relaxed);
+        if (value == 0) {
+            if (m_size >= CAPACITY) {
+                return false;
+            }
+            m_slots[slot].store(make_slot(key, instances),
+                                std::memory_order_relaxed);
+            m_size++;
+            return true;
+        }
+        if (slot_key(value) == key) {
+            m_slots[slot].store(make_slot(key, slot_count(value) + instances),
+                                std::memory_order_relaxed);
+            return true;
+        }
+        slot = (slot + 1) & (SLOTS - 1);
+    }
+}
@@ -0,0 +1,345 @@
+#include "daemon.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool
+socket_address(const std::filesystem::path& path, sockaddr_un& address)
+{
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    if (path.native().size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    path.native().copy(address.sun_path, sizeof(address.sun_path) - 1);
+    return true;
+}
+
+BoredomDaemon::BoredomDaemon(BoredomScheduler& scheduler,
+                             const std::filesystem::path& socket)
+  : m_scheduler(scheduler)
+  , m_socket(socket)
+{
+    m_reply.reserve(protocol::MAX_MESSAGE);
+}
+
+BoredomDaemon::~BoredomDaemon()
+{
+    m_scheduler.set_state_change_cb(nullptr);
+    for (const auto& [fd, client] : m_clients) {
+        close(fd);
+    }
+    for (auto fd : { m_listen_fd, m_stop_fd, m_metrics_fd, m_epoll_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (m_listen_fd >= 0) {
+        unlink(m_socket.c_str());
+    }
+}
+
+bool
+BoredomDaemon::listen()
+{
+    sockaddr_un address;
+    if (!socket_address(m_socket, address)) {
+        std::cerr << "Error, socket path " << m_socket << " is too long\n";
+        return false;
+    }
+
+    m_listen_fd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0) {
+        std::cerr << "Error creating socket\n";
+        return false;
+    }
+
+    if (bind(m_listen_fd,
+             reinterpret_cast<const sockaddr*>(&address),
+             sizeof(address)) != 0) {
+        // Only replace the socket if nobody answers on it.
+        const int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        const bool taken =
+          connect(probe,
+                  reinterpret_cast<const sockaddr*>(&address),
+                  sizeof(address)) == 0;
+        close(probe);
+        if (taken || unlink(m_socket.c_str()) != 0 ||
+            bind(m_listen_fd,
+                 reinterpret_cast<const sockaddr*>(&address),
+                 sizeof(address)) != 0) {
+            std::cerr << "Error binding socket " << m_socket << "\n";
+            close(m_listen_fd);
+            m_listen_fd = -1;
+            return false;
+        }
+    }
+    chmod(m_socket.c_str(), S_IRUSR | S_IWUSR);
+
+    if (::listen(m_listen_fd, SOMAXCONN) != 0) {
+        std::cerr << "Error listening on socket " << m_socket << "\n";
+        return false;
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (auto fd : { m_listen_fd, m_stop_fd, m_scheduler.fd() }) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    if (!m_metrics_file.empty()) {
+        m_metrics_fd =
+          timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        itimerspec period{};
+        period.it_interval.tv_sec = m_metrics_interval.count();
+        period.it_value.tv_sec = m_metrics_interval.count();
+        timerfd_settime(m_metrics_fd, 0, &period, nullptr);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = m_metrics_fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_metrics_fd, &event);
+    }
+
+    m_scheduler.set_state_change_cb(
+      [this](bool alarm) { m_broadcast(alarm); });
+    return true;
+}
+
+void
+BoredomDaemon::set_metrics_file(const std::filesystem::path& path,
+                                std::chrono::seconds interval)
+{
+    m_metrics_file = path;
+    m_metrics_interval = std::max(interval, std::chrono::seconds(1));
+    Metrics::set_enabled(true);
+}
+
+void
+BoredomDaemon::run()
+{
+    constexpr int max_events = 16;
+    epoll_event events[max_events];
+
+    while (true) {
+        const int count = epoll_wait(m_epoll_fd, events, max_events, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error waiting for daemon events\n";
+            return;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            const auto fd = events[i].data.fd;
+            if (fd == m_stop_fd) {
+                uint64_t value;
+                (void)!read(m_stop_fd, &value, sizeof(value));
+                return;
+            } else if (fd == m_listen_fd) {
+                m_accept();
+            } else if (fd == m_scheduler.fd()) {
+                m_scheduler.handle_events();
+            } else if (fd == m_metrics_fd) {
+                uint64_t expirations;
+                (void)!read(m_metrics_fd, &expirations, sizeof(expirations));
+                if (!Metrics::write_prometheus(m_metrics_file)) {
+                    std::cerr << "Error writing metrics to " << m_metrics_file
+                              << "\n";
+                }
+            } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                m_drop(fd);
+            } else {
+                m_receive(fd);
+            }
+        }
+    }
+}
+
+void
+BoredomDaemon::stop()
+{
+    const uint64_t one = 1;
+    (void)!write(m_stop_fd, &one, sizeof(one));
+}
+
+void
+BoredomDaemon::m_accept()
+{
+    while (true) {
+        const int fd =
+          accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        m_clients[fd] = Client{};
+    }
+}
+
+void
+BoredomDaemon::m_receive(int fd)
+{
+    uint8_t message[protocol::MAX_MESSAGE];
+
+    while (true) {
+        const auto size = recv(fd, message, sizeof(message), 0);
+        if (size == 0 || (size < 0 && errno != EAGAIN)) {
+            m_drop(fd);
+            return;
+        }
+        if (size < 0) {
+            return;
+        }
+        if (!m_dispatch(fd, { message, static_cast<std::size_t>(size) })) {
+            m_drop(fd);
+        }
+        if (!m_clients.contains(fd)) {
+            return;
+        }
+    }
+}
+
+bool
+BoredomDaemon::m_dispatch(int fd, std::span<const uint8_t> message)
+{
+    using namespace protocol;
+
+    Reader request(message);
+    if (!request.ok()) {
+        Writer(m_reply, ERROR_REPLY, request.header().sequence)
+          .string("Unsupported protocol version");
+        m_send(fd);
+        return false;
+    }
+
+    Writer reply(m_reply, REPLY, request.header().sequence);
+    switch (request.header().type) {
+        case IS_ALARM:
+            reply.u8(m_scheduler.is_alarm());
+            break;
+        case LIST_UNCONNECTED: {
+            const auto devices = m_scheduler.list_unconnected_devices();
+            // Devices that don't fit in a message are left out.
+            std::size_t count = 0;
+            std::size_t size = sizeof(uint16_t);
+            for (const auto& device : devices) {
+                const auto entry = 3 * sizeof(uint16_t) + device.name.size();
+                if (!reply.fits(size + entry)) {
+                    break;
+                }
+                size += entry;
+                count++;
+            }
+            reply.u16(static_cast<uint16_t>(count));
+            for (std::size_t i = 0; i < count; ++i) {
+                reply.u16(devices[i].id.vid).u16(devices[i].id.pid);
+                reply.string(devices[i].name);
+            }
+            break;
+        }
+        case SNOOZE: {
+            const auto seconds = request.i64();
+            if (seconds < 0 || seconds > MAX_SNOOZE_SECONDS) {
+                request.fail();
+            }
+            if (request.ok()) {
+                m_scheduler.snooze(std::chrono::seconds(seconds));
+            }
+            break;
+        }
+        case SNOOZE_DEVICE: {
+            const usb_id id{ request.u16(), request.u16() };
+            const auto seconds = request.i64();
+            if (seconds < 0 || seconds > MAX_SNOOZE_SECONDS) {
+                request.fail();
+            }
+            if (request.ok()) {
+                m_scheduler.snooze(id, std::chrono::seconds(seconds));
+            }
+            break;
+        }
+        case ENABLE:
+            m_scheduler.enable();
+            break;
+        case DISABLE:
+            m_scheduler.disable();
+            break;
+        case SUBSCRIBE:
+            m_clients[fd].subscribed = true;
+            reply.u8(m_scheduler.is_alarm());
+            break;
+        case UNSUBSCRIBE:
+            m_clients[fd].subscribed = false;
+            break;
+        case NEXT_CHANGE:
+            reply.i64(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        m_scheduler.next_change().time_since_epoch())
+                        .count());
+            break;
+        default:
+            Writer(m_reply, ERROR_REPLY, request.header().sequence)
+              .string("Unknown request");
+            break;
+    }
+
+    if (!request.ok()) {
+        Writer(m_reply, ERROR_REPLY, request.header().sequence)
+          .string("Malformed request");
+    }
+    m_send(fd);
+    return true;
+}
+
+void
+BoredomDaemon::m_send(int fd)
+{
+    // Replies are small and clients wait for them, a client that doesn't
+    // read its notifications is dropped instead of blocking the daemon.
+    if (send(fd, m_reply.data(), m_reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL) <
+        0) {
+        m_drop(fd);
+    }
+}
+
+void
+BoredomDaemon::m_broadcast(bool alarm)
+{
+    protocol::Writer(m_reply, protocol::STATE_CHANGED, 0).u8(alarm);
+
+    std::vector<int> subscribers;
+    for (const auto& [fd, client] : m_clients) {
+        if (client.subscribed) {
+            subscribers.push_back(fd);
+        }
+    }
+    for (const auto fd : subscribers) {
+        m_send(fd);
+    }
+}
+
+void
+BoredomDaemon::m_drop(int fd)
+{
+    if (m_clients.erase(fd) == 0) {
+        return;
+    }
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+}
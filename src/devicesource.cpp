@@ -0,0 +1,232 @@
+#include "devicesource.h"
+#include "periodparser.h"
+#include "usbtracker.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+SyntheticSource::SyntheticSource(std::vector<usb_id> pool,
+                                 uint64_t count,
+                                 double rate)
+  : m_pool(std::move(pool))
+  , m_count(count)
+  , m_rate(rate)
+{
+}
+
+SyntheticSource::~SyntheticSource()
+{
+    stop();
+}
+
+std::vector<usb_id>
+SyntheticSource::enumerate()
+{
+    return {};
+}
+
+bool
+SyntheticSource::start(USBTracker& tracker)
+{
+    if (m_pool.empty()) {
+        std::cerr << "Error starting a synthetic source without devices\n";
+        return false;
+    }
+    m_running = true;
+    m_thread =
+      std::thread(&SyntheticSource::m_generate, this, std::ref(tracker));
+    return true;
+}
+
+void
+SyntheticSource::stop()
+{
+    {
+        std::lock_guard lock(m_mtx);
+        m_running = false;
+    }
+    m_stop_cv.notify_all();
+    join();
+}
+
+void
+SyntheticSource::join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void
+SyntheticSource::m_generate(USBTracker& tracker)
+{
+    std::vector<bool> connected(m_pool.size(), false);
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < m_count && m_running; ++i) {
+        if (m_rate > 0) {
+            const auto due =
+              start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::duration<double>(i / m_rate));
+            std::unique_lock lock(m_mtx);
+            if (m_stop_cv.wait_until(
+                  lock, due, [this] { return !m_running; })) {
+                break;
+            }
+        }
+
+        const auto index = i % m_pool.size();
+        tracker.note_wakeup();
+        if (connected[index]) {
+            tracker.handle_device_remove_event(m_pool[index]);
+        } else {
+            tracker.handle_device_add_event(m_pool[index]);
+        }
+        connected[index] = !connected[index];
+    }
+}
+
+TraceReplaySource::TraceReplaySource(const std::filesystem::path& trace,
+                                     Timing timing)
+  : m_trace(trace)
+  , m_timing(timing)
+{
+}
+
+TraceReplaySource::~TraceReplaySource()
+{
+    stop();
+}
+
+std::vector<usb_id>
+TraceReplaySource::enumerate()
+{
+    return {};
+}
+
+bool
+TraceReplaySource::start(USBTracker& tracker)
+{
+    std::vector<TraceEvent> events;
+    if (!m_load(events)) {
+        return false;
+    }
+    m_running = true;
+    m_thread = std::thread(
+      &TraceReplaySource::m_replay, this, std::ref(tracker), std::move(events));
+    return true;
+}
+
+void
+TraceReplaySource::stop()
+{
+    {
+        std::lock_guard lock(m_mtx);
+        m_running = false;
+    }
+    m_stop_cv.notify_all();
+    join();
+}
+
+void
+TraceReplaySource::join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+bool
+TraceReplaySource::m_load(std::vector<TraceEvent>& events) const
+{
+    std::ifstream file(m_trace);
+    if (!file) {
+        std::cerr << "Error opening trace " << m_trace << "\n";
+        return false;
+    }
+
+    std::string line;
+    for (std::size_t number = 1; std::getline(file, line); ++number) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        long long offset;
+        char type;
+        char id[10];
+        if (std::sscanf(line.c_str(), "%lld %c %9s", &offset, &type, id) !=
+              3 ||
+            offset < 0 || (type != '+' && type != '-')) {
+            std::cerr << "Error in trace " << m_trace << " line " << number
+                      << "\n";
+            return false;
+        }
+        const auto parsed = parse_usb_id(id);
+        if (!parsed) {
+            std::cerr << "Error in trace " << m_trace << " line " << number
+                      << ": " << parsed.error().message << "\n";
+            return false;
+        }
+        events.push_back(TraceEvent{
+          std::chrono::microseconds(offset),
+          *parsed,
+          type == '+' ? DEVICE_ARRIVED : DEVICE_LEFT,
+        });
+    }
+    return true;
+}
+
+void
+TraceReplaySource::m_replay(USBTracker& tracker,
+                            std::vector<TraceEvent> events)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    for (const auto& event : events) {
+        if (!m_running) {
+            break;
+        }
+        if (m_timing == ORIGINAL) {
+            std::unique_lock lock(m_mtx);
+            if (m_stop_cv.wait_until(
+                  lock, start + event.offset, [this] { return !m_running; })) {
+                break;
+            }
+        }
+
+        tracker.note_wakeup();
+        if (event.type == DEVICE_ARRIVED) {
+            tracker.handle_device_add_event(event.id);
+        } else {
+            tracker.handle_device_remove_event(event.id);
+        }
+    }
+}
+
+bool
+TraceReplaySource::write_trace(const std::filesystem::path& trace,
+                               const std::vector<USBEvent>& events)
+{
+    std::ofstream file(trace);
+    if (!file) {
+        std::cerr << "Error creating trace " << trace << "\n";
+        return false;
+    }
+
+    const auto first = events.empty() ? std::chrono::steady_clock::time_point{}
+                                      : events.front().timestamp;
+    for (const auto& event : events) {
+        const auto offset =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            event.timestamp - first);
+        char line[48];
+        std::snprintf(line,
+                      sizeof(line),
+                      "%lld %c %04x:%04x\n",
+                      static_cast<long long>(offset.count()),
+                      event.type == DEVICE_ARRIVED ? '+' : '-',
+                      event.id.vid,
+                      event.id.pid);
+        file << line;
+    }
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,127 @@
+#ifndef AWAITABLE_H_
+#define AWAITABLE_H_
+
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/// @brief Resumes a suspended coroutine, e.g. by posting handle.resume() to
+/// an event loop. Called on the thread the awaited event happens on, so it
+/// must be thread-safe. An empty executor resumes the coroutine right away on
+/// that thread.
+using Executor = std::function<void(std::coroutine_handle<>)>;
+
+/// @brief Coroutine return type for coroutines nobody waits for.
+/// @details The coroutine starts running when called and frees itself when
+/// it finishes. Exceptions escaping the coroutine terminate the program.
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/// @brief Coroutines waiting for a value, resumed when it is notified.
+/// @details Waiters are registered when they suspend and removed when they
+/// are resumed or destroyed, so notifying without waiters only takes an
+/// uncontended lock. The list must outlive the coroutines waiting on it.
+/// @tparam T type of the awaited value.
+template<typename T>
+class WaitList
+{
+  public:
+    /// @brief Filter a waiter applies to notified values, empty to accept
+    /// every value.
+    using Filter = std::function<bool(const T&)>;
+
+    /// @brief Awaitable returned to co_await, resuming with the first
+    /// accepted value notified after the coroutine suspends.
+    class Awaiter
+    {
+      public:
+        Awaiter(WaitList& list, Executor executor, Filter filter = {})
+          : m_list(list)
+          , m_executor(std::move(executor))
+          , m_filter(std::move(filter))
+        {
+        }
+        ~Awaiter() { m_list.m_remove(this); }
+        Awaiter(const Awaiter&) = delete;
+        Awaiter& operator=(const Awaiter&) = delete;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            m_handle = handle;
+            m_list.m_add(this);
+        }
+
+        T await_resume() { return std::move(*m_value); }
+
+      private:
+        friend class WaitList;
+
+        WaitList& m_list;
+        Executor m_executor;
+        Filter m_filter;
+        std::coroutine_handle<> m_handle;
+        std::optional<T> m_value;
+    };
+
+    /// @brief Resume the waiters accepting a value. Safe to call from any
+    /// thread.
+    void notify(const T& value)
+    {
+        std::vector<std::pair<std::coroutine_handle<>, Executor>> ready;
+        {
+            std::lock_guard lock(m_mtx);
+            std::erase_if(m_waiters, [&](Awaiter* waiter) {
+                if (waiter->m_filter && !waiter->m_filter(value)) {
+                    return false;
+                }
+                waiter->m_value = value;
+                ready.emplace_back(waiter->m_handle,
+                                   std::move(waiter->m_executor));
+                return true;
+            });
+        }
+        // A resumed coroutine destroys its awaiter, nothing of it is used
+        // after resuming.
+        for (auto& [handle, executor] : ready) {
+            if (executor) {
+                executor(handle);
+            } else {
+                handle.resume();
+            }
+        }
+    }
+
+  private:
+    std::mutex m_mtx;
+    std::vector<Awaiter*> m_waiters;
+
+    void m_add(Awaiter* waiter)
+    {
+        std::lock_guard lock(m_mtx);
+        m_waiters.push_back(waiter);
+    }
+
+    void m_remove(Awaiter* waiter)
+    {
+        std::lock_guard lock(m_mtx);
+        std::erase(m_waiters, waiter);
+    }
+};
+
+#endif // AWAITABLE_H_
@@ -0,0 +1,100 @@
+#ifndef CLIENT_H_
+#define CLIENT_H_
+
+#include "protocol.h"
+#include "tools.h"
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <vector>
+
+/// @brief Talks to a BoredomScheduler served by boredomlockd.
+/// @details Mirrors the query and control functions of BoredomScheduler, so
+/// a consumer can switch to the daemon without embedding its own scheduler
+/// and USB tracker. Every call is a blocking round trip to the daemon. If
+/// the daemon can't be reached the error is printed and the functions
+/// return no alarm and no devices.
+class BoredomClient
+{
+  public:
+    /// @param socket path of the socket boredomlockd listens on.
+    explicit BoredomClient(const std::filesystem::path& socket =
+                             protocol::default_socket_path());
+    ~BoredomClient();
+    BoredomClient(const BoredomClient&) = delete;
+    BoredomClient& operator=(const BoredomClient&) = delete;
+
+    /// @brief Connect to the daemon.
+    /// @return false if the daemon isn't listening on the socket.
+    bool init();
+
+    /// @brief Check if alarm needs to be set.
+    /// @return true if a device that should be plugged in is not.
+    bool is_alarm() const;
+
+    /// @brief Set the alarm off for a time period.
+    /// @param seconds Number of seconds to snooze.
+    void snooze(std::chrono::seconds seconds);
+    void snooze(int seconds) { snooze(std::chrono::seconds(seconds)); };
+
+    /// @brief Set the alarm off for a single device for a time period.
+    /// @param id vid:pid of the device.
+    /// @param seconds Number of seconds to snooze.
+    void snooze(const usb_id& id, std::chrono::seconds seconds);
+
+    /// @brief Disables the alarms until enabled.
+    void disable();
+    /// @brief Enables the alarms.
+    void enable();
+
+    /// @brief Get a file descriptor that becomes readable when the daemon
+    /// reported a state change.
+    /// @details Poll the descriptor and call handle_events when it is
+    /// readable. Valid after init.
+    /// @return pollable file descriptor.
+    int fd() const;
+
+    /// @brief Call the state change callback for the changes the daemon
+    /// reported.
+    void handle_events();
+
+    /// @brief Set a callback called from handle_events when the alarm state
+    /// changes.
+    /// @details Subscribes to the state changes of the daemon, or
+    /// unsubscribes if callback is empty.
+    /// @param callback called with the new is_alarm value.
+    void set_state_change_cb(std::function<void(bool)> callback);
+
+    /// @brief Get the next instant the alarm state can change without a
+    /// hotplug event, i.e. the next period boundary or snooze expiry.
+    /// @return time point of the next possible change.
+    std::chrono::system_clock::time_point next_change() const;
+
+    /// @brief List devices that should be connected but aren't.
+    /// @return list of unconnected devices.
+    std::vector<USBDevice> list_unconnected_devices();
+
+  private:
+    std::filesystem::path m_socket;
+    int m_socket_fd{ -1 };
+    /// @brief epoll set of m_socket_fd and m_wake_fd returned by fd().
+    int m_epoll_fd{ -1 };
+    /// @brief eventfd signaled when state changes are queued in m_changes.
+    int m_wake_fd{ -1 };
+    std::function<void(bool)> m_state_callback;
+    /// @brief State changes received while waiting for a reply.
+    mutable std::vector<bool> m_changes;
+    mutable uint32_t m_sequence{ 0 };
+    mutable std::vector<uint8_t> m_request;
+    mutable std::vector<uint8_t> m_reply;
+
+    /// @brief Send the request in m_request and wait for its reply.
+    /// @return reader over m_reply, or nothing if the request failed.
+    std::optional<protocol::Reader> m_call() const;
+    /// @brief Start a request of a type in m_request.
+    protocol::Writer m_begin(protocol::MessageType type) const;
+};
+
+#endif // CLIENT_H_
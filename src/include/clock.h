@@ -0,0 +1,107 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/// @brief Source of the current wall clock time.
+class Clock
+{
+  public:
+    virtual ~Clock() = default;
+    virtual std::chrono::system_clock::time_point now() const = 0;
+};
+
+/// @brief Clock reading std::chrono::system_clock.
+class SystemClock : public Clock
+{
+  public:
+    std::chrono::system_clock::time_point now() const override
+    {
+        return std::chrono::system_clock::now();
+    }
+};
+
+/// @brief Clock that only moves when told to, for tests and benchmarks.
+class ManualClock : public Clock
+{
+  public:
+    explicit ManualClock(std::chrono::system_clock::time_point start =
+                           std::chrono::system_clock::now())
+      : m_now(start.time_since_epoch().count())
+    {
+    }
+
+    std::chrono::system_clock::time_point now() const override
+    {
+        return std::chrono::system_clock::time_point(
+          std::chrono::system_clock::duration(m_now.load()));
+    }
+
+    void set(std::chrono::system_clock::time_point now)
+    {
+        m_now = now.time_since_epoch().count();
+    }
+
+    void advance(std::chrono::system_clock::duration duration)
+    {
+        m_now += duration.count();
+    }
+
+  private:
+    std::atomic<std::chrono::system_clock::rep> m_now;
+};
+
+/// @brief Converts time points to local time, caching the current local day.
+/// @details The local day and UTC offset are looked up with localtime_r only
+/// when a time point falls outside the cached range, which ends at the next
+/// local midnight or UTC offset change (e.g. DST). Within the range local
+/// time is plain arithmetic. Readers never block; concurrent refreshes are
+/// detected with a sequence counter.
+class LocalTimeCache
+{
+  public:
+    /// @brief Get the minute of the week in local time.
+    /// @return minutes since Sunday 00:00 local time.
+    std::size_t minute_of_week(std::chrono::system_clock::time_point now);
+
+    /// @brief Check if a time point is on a Saturday or Sunday in local time.
+    bool is_weekend(std::chrono::system_clock::time_point now);
+
+    /// @brief Get the offset of local time from UTC.
+    std::chrono::seconds utc_offset(std::chrono::system_clock::time_point now);
+
+    /// @brief Get the end of the range the local day and UTC offset of a time
+    /// point are valid for, i.e. the next local midnight or offset change.
+    std::chrono::system_clock::time_point valid_until(
+      std::chrono::system_clock::time_point now);
+
+  private:
+    struct Day
+    {
+        /// @brief Range of seconds since epoch the day is valid for.
+        int64_t valid_from;
+        int64_t valid_until;
+        /// @brief Seconds since epoch of local midnight.
+        int64_t midnight;
+        int64_t utc_offset;
+        int64_t weekday;
+    };
+
+    std::atomic<uint64_t> m_sequence{ 0 };
+    std::atomic<int64_t> m_valid_from{ 0 };
+    std::atomic<int64_t> m_valid_until{ 0 };
+    std::atomic<int64_t> m_midnight{ 0 };
+    std::atomic<int64_t> m_utc_offset{ 0 };
+    std::atomic<int64_t> m_weekday{ 0 };
+    /// @brief Serializes refreshes of the cache.
+    std::mutex m_refresh_mtx;
+
+    Day m_lookup(int64_t seconds);
+    static Day m_compute(int64_t seconds);
+};
+
+#endif /* CLOCK_H */
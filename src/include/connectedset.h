@@ -0,0 +1,64 @@
+#ifndef CONNECTEDSET_H_
+#define CONNECTEDSET_H_
+
+#include "tools.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// @brief Set of connected USB devices keyed by packed vid:pid, counting
+/// the connected instances of each id.
+/// @details A single writer modifies the set while any number of readers
+/// query it without locking. Readers use a sequence counter to detect
+/// concurrent modification and retry, so a query never blocks on the writer.
+/// Writers must be serialized by the caller.
+class ConnectedSet
+{
+  public:
+    /// @brief Maximum number of distinct vid:pid ids in the set.
+    static constexpr std::size_t CAPACITY = 768;
+
+    /// @brief Add one instance of a device.
+    /// @return false if the set is full.
+    bool insert(const usb_id& id);
+
+    /// @brief Remove one instance of a device.
+    void erase(const usb_id& id);
+
+    /// @brief Remove every instance of a device.
+    void erase_all(const usb_id& id);
+
+    /// @brief Replace the contents of the set.
+    void assign(const std::vector<usb_id>& ids);
+
+    /// @brief Check if at least one instance of a device is connected.
+    bool contains(const usb_id& id) const { return count(id) > 0; }
+
+    /// @brief Get the number of connected instances of a device.
+    uint32_t count(const usb_id& id) const;
+
+    /// @brief List the connected ids, once per instance.
+    std::vector<usb_id> list() const;
+
+  private:
+    /// @brief Power of two table size, kept at most 75% full.
+    static constexpr std::size_t SLOTS = 1024;
+
+    /// @brief Slots hold the packed id in the low and the instance count in
+    /// the high 32 bits. Zero marks an empty slot.
+    std::array<std::atomic<uint64_t>, SLOTS> m_slots{};
+    std::atomic<uint64_t> m_sequence{ 0 };
+    std::size_t m_size{ 0 };
+
+    static std::size_t m_home(uint32_t key);
+    std::size_t m_find(uint32_t key) const;
+    void m_begin_write();
+    void m_end_write();
+    void m_remove_slot(std::size_t slot);
+    bool m_add(uint32_t key, uint32_t instances);
+};
+
+#endif // CONNECTEDSET_H_
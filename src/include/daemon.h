@@ -0,0 +1,77 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include "protocol.h"
+#include "scheduler.h"
+
+#include <chrono>
+#include <filesystem>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+/// @brief Serves one BoredomScheduler to BoredomClients over a Unix domain
+/// socket.
+/// @details Everything runs on the thread calling run: an epoll loop over
+/// the listening socket, the clients and the scheduler fd. Clients
+/// subscribed to state changes get a STATE_CHANGED message whenever the
+/// scheduler reports one.
+class BoredomDaemon
+{
+  public:
+    /// @param scheduler initialized scheduler to serve.
+    /// @param socket path of the socket to listen on.
+    BoredomDaemon(BoredomScheduler& scheduler,
+                  const std::filesystem::path& socket =
+                    protocol::default_socket_path());
+    ~BoredomDaemon();
+    BoredomDaemon(const BoredomDaemon&) = delete;
+    BoredomDaemon& operator=(const BoredomDaemon&) = delete;
+
+    /// @brief Create the socket.
+    /// @details A stale socket left by a crashed daemon is replaced, a
+    /// socket another daemon still listens on is not.
+    /// @return false if the socket could not be created.
+    bool listen();
+
+    /// @brief Enable the library metrics and write them to a file in the
+    /// Prometheus text format while run is serving. Call before listen.
+    /// @param path file the metrics are written to.
+    /// @param interval time between writes.
+    void set_metrics_file(const std::filesystem::path& path,
+                          std::chrono::seconds interval);
+
+    /// @brief Serve clients until stop is called.
+    void run();
+
+    /// @brief Make run return. Safe to call from any thread.
+    void stop();
+
+  private:
+    struct Client
+    {
+        bool subscribed{ false };
+    };
+
+    BoredomScheduler& m_scheduler;
+    std::filesystem::path m_socket;
+    int m_listen_fd{ -1 };
+    int m_epoll_fd{ -1 };
+    /// @brief eventfd signaled by stop.
+    int m_stop_fd{ -1 };
+    std::filesystem::path m_metrics_file;
+    std::chrono::seconds m_metrics_interval{ 0 };
+    /// @brief timerfd firing every m_metrics_interval.
+    int m_metrics_fd{ -1 };
+    std::unordered_map<int, Client> m_clients;
+    std::vector<uint8_t> m_reply;
+
+    void m_accept();
+    void m_receive(int fd);
+    bool m_dispatch(int fd, std::span<const uint8_t> message);
+    void m_send(int fd);
+    void m_broadcast(bool alarm);
+    void m_drop(int fd);
+};
+
+#endif // DAEMON_H_
@@ -0,0 +1,144 @@
+#ifndef DEVICESOURCE_H_
+#define DEVICESOURCE_H_
+
+#include "eventqueue.h"
+#include "tools.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class USBTracker;
+
+/// @brief Backend that tells a USBTracker which devices are connected and
+/// delivers their hotplug events.
+/// @details A source runs its own thread between start and stop and calls
+/// USBTracker::handle_device_add_event and handle_device_remove_event from
+/// it, with the port of the device when the source knows it.
+class DeviceSource
+{
+  public:
+    virtual ~DeviceSource() = default;
+
+    /// @brief List the devices connected before the source is started.
+    virtual std::vector<usb_id> enumerate() = 0;
+
+    /// @brief List the devices connected before the source is started, with
+    /// their ports and serial numbers if the source knows them.
+    virtual std::vector<USBDeviceInstance> enumerate_instances()
+    {
+        std::vector<USBDeviceInstance> devices;
+        for (const auto& id : enumerate()) {
+            devices.push_back(USBDeviceInstance{ id });
+        }
+        return devices;
+    }
+
+    /// @brief Start delivering hotplug events to tracker.
+    /// @return false if the source could not be started.
+    virtual bool start(USBTracker& tracker) = 0;
+
+    /// @brief Stop delivering events and wait for the source thread.
+    virtual void stop() = 0;
+
+    /// @brief Wait until the source thread finishes on its own.
+    virtual void join() = 0;
+
+    /// @brief Restrict the events delivered to a set of devices.
+    /// @details Sources that can't filter deliver every event, the tracker
+    /// handles unwanted events just the same.
+    /// @param wanted packed vid:pid ids the tracker has subscribers for.
+    /// @param match_any true to deliver events of every device.
+    virtual void set_filter(const std::vector<uint32_t>& wanted
+                            [[maybe_unused]],
+                            bool match_any [[maybe_unused]])
+    {
+    }
+};
+
+/// @brief Generates arrive and leave events without any USB hardware.
+/// @details Event i toggles the device pool[i % pool.size()], so a device
+/// arrives, then leaves the next time it comes up. The sequence is the same
+/// on every run.
+class SyntheticSource : public DeviceSource
+{
+  public:
+    /// @param pool the devices to generate events for.
+    /// @param count number of events to generate.
+    /// @param rate events per second, 0 generates them as fast as possible.
+    SyntheticSource(std::vector<usb_id> pool, uint64_t count, double rate = 0);
+    ~SyntheticSource() override;
+
+    std::vector<usb_id> enumerate() override;
+    bool start(USBTracker& tracker) override;
+    void stop() override;
+    void join() override;
+
+  private:
+    std::vector<usb_id> m_pool;
+    uint64_t m_count;
+    double m_rate;
+    std::thread m_thread;
+    std::atomic<bool> m_running{ false };
+    std::mutex m_mtx;
+    std::condition_variable m_stop_cv;
+
+    void m_generate(USBTracker& tracker);
+};
+
+/// @brief Replays hotplug events recorded in a trace file.
+/// @details Every line of a trace holds the microseconds since the first
+/// event, + for an arrival or - for a removal and the vid:pid of the device,
+/// e.g. "1500 + 046d:c52b". Empty lines and lines starting with # are
+/// skipped.
+class TraceReplaySource : public DeviceSource
+{
+  public:
+    enum Timing
+    {
+        ORIGINAL,
+        FAST
+    };
+
+    /// @param trace path of the trace file.
+    /// @param timing ORIGINAL to keep the recorded gaps between events, FAST
+    /// to replay them back to back.
+    TraceReplaySource(const std::filesystem::path& trace,
+                      Timing timing = ORIGINAL);
+    ~TraceReplaySource() override;
+
+    std::vector<usb_id> enumerate() override;
+    bool start(USBTracker& tracker) override;
+    void stop() override;
+    void join() override;
+
+    /// @brief Write events to a trace file that can be replayed.
+    /// @param trace path of the trace file.
+    /// @param events events to write, oldest first.
+    /// @return false if the file could not be written.
+    static bool write_trace(const std::filesystem::path& trace,
+                            const std::vector<USBEvent>& events);
+
+  private:
+    struct TraceEvent
+    {
+        std::chrono::microseconds offset;
+        usb_id id;
+        USBEventType type;
+    };
+
+    std::filesystem::path m_trace;
+    Timing m_timing;
+    std::thread m_thread;
+    std::atomic<bool> m_running{ false };
+    std::mutex m_mtx;
+    std::condition_variable m_stop_cv;
+
+    bool m_load(std::vector<TraceEvent>& events) const;
+    void m_replay(USBTracker& tracker, std::vector<TraceEvent> events);
+};
+
+#endif // DEVICESOURCE_H_
@@ -0,0 +1,136 @@
+#ifndef EMBEDDED_H
+#define EMBEDDED_H
+
+#include "periodparser.h"
+#include "tools.h"
+#include "weekschedule.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+/// @brief String literal usable as a template argument.
+template<std::size_t N>
+struct FixedString
+{
+    char value[N];
+
+    consteval FixedString(const char (&str)[N]) { std::copy_n(str, N, value); }
+
+    constexpr std::string_view view() const
+    {
+        return std::string_view(value, N - 1);
+    }
+};
+
+/// @brief Periods of a day compiled from a _bored literal.
+template<std::size_t N>
+using PeriodList = std::array<MinuteSpan, N>;
+
+/// @brief Reports a malformed literal. Never defined: calling it from a
+/// consteval function turns the malformed literal into a compile error.
+void
+embedded_schedule_parse_error(std::size_t column, const char* message);
+
+namespace embedded {
+
+consteval std::size_t
+count_spans(std::string_view view)
+{
+    std::size_t count = 0;
+    const auto error = for_each_span(view, [&count](MinuteSpan) { ++count; });
+    if (error) {
+        embedded_schedule_parse_error(error->column, error->message);
+    }
+    return count;
+}
+
+} // namespace embedded
+
+/// @brief Compile a list of periods at compile time, e.g.
+/// "00:00-06:00, 20:00-24:00"_bored. A malformed list fails to compile.
+template<FixedString S>
+consteval auto
+operator""_bored()
+{
+    PeriodList<embedded::count_spans(S.view())> spans{};
+    std::size_t index = 0;
+    for_each_span(S.view(),
+                  [&spans, &index](MinuteSpan span) { spans[index++] = span; });
+    return spans;
+}
+
+/// @brief Parse a USB id at compile time, e.g. "dead:beef"_usb. A malformed
+/// id fails to compile.
+template<FixedString S>
+consteval usb_id
+operator""_usb()
+{
+    const auto id = parse_usb_id(S.view());
+    if (!id) {
+        embedded_schedule_parse_error(id.error().column, id.error().message);
+    }
+    return *id;
+}
+
+/// @brief Compile weekday and weekend periods into a WeekMask at compile
+/// time.
+/// @param weekdays periods of Monday to Friday.
+/// @param weekend periods of Saturday and Sunday.
+template<std::size_t W, std::size_t E>
+consteval WeekMask
+week_mask(const PeriodList<W>& weekdays, const PeriodList<E>& weekend)
+{
+    WeekMask mask;
+    for (unsigned day = 0; day < 7; ++day) {
+        const bool is_weekend = day == 0 || day == 6;
+        if (is_weekend) {
+            add_spans(mask, day, weekend.data(), weekend.size());
+        } else {
+            add_spans(mask, day, weekdays.data(), weekdays.size());
+        }
+    }
+    return mask;
+}
+
+/// @brief Compile periods of each day, starting from Sunday, into a WeekMask
+/// at compile time.
+template<std::size_t Su,
+         std::size_t Mo,
+         std::size_t Tu,
+         std::size_t We,
+         std::size_t Th,
+         std::size_t Fr,
+         std::size_t Sa>
+consteval WeekMask
+week_mask(const PeriodList<Su>& sunday,
+          const PeriodList<Mo>& monday,
+          const PeriodList<Tu>& tuesday,
+          const PeriodList<We>& wednesday,
+          const PeriodList<Th>& thursday,
+          const PeriodList<Fr>& friday,
+          const PeriodList<Sa>& saturday)
+{
+    WeekMask mask;
+    add_spans(mask, 0, sunday.data(), sunday.size());
+    add_spans(mask, 1, monday.data(), monday.size());
+    add_spans(mask, 2, tuesday.data(), tuesday.size());
+    add_spans(mask, 3, wednesday.data(), wednesday.size());
+    add_spans(mask, 4, thursday.data(), thursday.size());
+    add_spans(mask, 5, friday.data(), friday.size());
+    add_spans(mask, 6, saturday.data(), saturday.size());
+    return mask;
+}
+
+/// @brief Device with a schedule fixed at build time, e.g.
+/// constexpr EmbeddedDevice phone{ "Phone", "dead:beef"_usb,
+/// week_mask("20:00-24:00"_bored, "00:00-24:00"_bored) };
+struct EmbeddedDevice
+{
+    const char* name;
+    usb_id id;
+    WeekMask mask;
+};
+
+#endif /* EMBEDDED_H */
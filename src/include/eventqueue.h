@@ -0,0 +1,115 @@
+#ifndef EVENTQUEUE_H_
+#define EVENTQUEUE_H_
+
+#include "tools.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+enum USBEventType
+{
+    DEVICE_ARRIVED = 0,
+    DEVICE_LEFT = 1,
+};
+
+/// @brief Hotplug event of a single device.
+struct USBEvent
+{
+    usb_id id;
+    USBEventType type;
+    /// @brief Time the tracker received the event.
+    std::chrono::steady_clock::time_point timestamp;
+};
+
+/// @brief Bounded lock-free queue with many producers and a single consumer.
+/// @details push never blocks: when the queue is full the item is dropped
+/// and counted. Each slot carries a sequence number telling producers and
+/// the consumer whose turn it is to use the slot.
+/// @tparam T item type.
+/// @tparam Capacity maximum number of queued items, a power of two.
+template<typename T, std::size_t Capacity>
+class EventQueue
+{
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "EventQueue capacity must be a power of two");
+
+  public:
+    EventQueue()
+    {
+        for (std::size_t i = 0; i < Capacity; ++i) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /// @brief Add an item to the queue. Safe to call from any thread.
+    /// @return false if the queue was full and the item was dropped.
+    bool push(const T& item)
+    {
+        auto pos = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = m_slots[pos & (Capacity - 1)];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto diff =
+              static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(
+                      pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.item = item;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// @brief Remove up to max_items items, oldest first. Must only be called
+    /// from a single consumer thread at a time.
+    /// @param consumer called with each removed item.
+    /// @param max_items maximum number of items to remove.
+    /// @return number of removed items.
+    template<typename Consumer>
+    std::size_t drain(Consumer&& consumer, std::size_t max_items = Capacity)
+    {
+        std::size_t count = 0;
+        while (count < max_items) {
+            auto& slot = m_slots[m_head & (Capacity - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != m_head + 1) {
+                break;
+            }
+            consumer(slot.item);
+            slot.sequence.store(m_head + Capacity, std::memory_order_release);
+            ++m_head;
+            ++count;
+        }
+        return count;
+    }
+
+    /// @brief Number of items dropped because the queue was full.
+    uint64_t dropped() const
+    {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+  private:
+    struct Slot
+    {
+        std::atomic<std::size_t> sequence;
+        T item;
+    };
+
+    std::array<Slot, Capacity> m_slots;
+    alignas(64) std::atomic<std::size_t> m_tail{ 0 };
+    alignas(64) std::size_t m_head{ 0 };
+    std::atomic<uint64_t> m_dropped{ 0 };
+};
+
+#endif // EVENTQUEUE_H_
@@ -0,0 +1,194 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include "eventqueue.h"
+#include "tools.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+enum JournalEvent : uint8_t
+{
+    JOURNAL_CONNECTED = 0,
+    JOURNAL_DISCONNECTED = 1,
+    JOURNAL_ALARM_ON = 2,
+    JOURNAL_ALARM_OFF = 3,
+};
+
+/// @brief A single journal entry as stored in the file.
+struct JournalRecord
+{
+    /// @brief Nanoseconds since the system clock epoch.
+    int64_t time;
+    /// @brief Packed vid:pid of the device, 0 for alarm edges.
+    uint32_t key;
+    JournalEvent event;
+    uint8_t reserved[3];
+
+    std::chrono::system_clock::time_point time_point() const;
+};
+
+struct JournalHeader;
+
+/// @brief Append-only memory-mapped journal of hotplug transitions and alarm
+/// edges.
+/// @details Records are kept sorted by time, so range queries binary search
+/// the mapping instead of scanning it. An index in memory links every record
+/// to the previous record of its device, with checkpoints of the last record
+/// of every device, so state queries only visit the records of their device.
+/// Writers hand records to a lock-free
+/// queue and write them to the mapping only if no other thread is writing,
+/// so recording never blocks, allocates or makes a system call. Records a
+/// writer couldn't write are written by the next writer or query. The file
+/// never grows on the write path: when it is full records are dropped and
+/// counted, and maintain grows it ahead of time.
+class Journal
+{
+  public:
+    using time_point = std::chrono::system_clock::time_point;
+
+    /// @brief Records the file has room for when it is created.
+    static constexpr std::size_t INITIAL_CAPACITY = 65536;
+    /// @brief Records queued before they are dropped.
+    static constexpr std::size_t QUEUE_SIZE = 256;
+    /// @brief Slots of the per-device index, devices beyond 3/4 of them are
+    /// queried by scanning.
+    static constexpr std::size_t INDEX_SLOTS = 1024;
+    /// @brief Records between checkpoints of the per-device index.
+    static constexpr std::size_t CHECKPOINT_INTERVAL = 4096;
+
+    Journal() = default;
+    ~Journal();
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    /// @brief Map a journal file, creating it if needed.
+    /// @details The file is locked, a journal another process has open is
+    /// not opened. A file with another version is started over.
+    /// @param path path of the journal file.
+    /// @return false if the file couldn't be opened.
+    bool open(const std::filesystem::path& path);
+
+    bool is_open() const { return m_open; }
+
+    /// @brief Record a device connecting or disconnecting. Safe to call from
+    /// any thread.
+    void record_device(const usb_id& id, bool connected, const time_point& at);
+
+    /// @brief Record the alarm turning on or off. Safe to call from any
+    /// thread.
+    void record_alarm(bool alarm, const time_point& at);
+
+    /// @brief Write the queued records to the mapping.
+    void flush();
+
+    /// @brief List the records in a time range.
+    /// @param from start of the range, inclusive.
+    /// @param to end of the range, exclusive.
+    std::vector<JournalRecord> range(const time_point& from,
+                                     const time_point& to);
+
+    /// @brief Get the time a device was disconnected during a time range.
+    /// @details The device counts as connected until its first record.
+    std::chrono::nanoseconds disconnected_time(const usb_id& id,
+                                               const time_point& from,
+                                               const time_point& to);
+
+    /// @brief Get the time the alarm was on during a time range.
+    std::chrono::nanoseconds alarm_time(const time_point& from,
+                                        const time_point& to);
+
+    /// @brief Fold the records before a time into the last record of each
+    /// device and of the alarm, and make room for at least as many records
+    /// as are kept.
+    /// @details Queries of the state before the time still give the final
+    /// state, but not the transitions leading to it. Blocks writers until
+    /// done, they queue their records meanwhile.
+    /// @param before records older than this are folded.
+    /// @return false if the compacted file couldn't be written.
+    bool compact(const time_point& before);
+
+    /// @brief Compact if the last compaction is older than interval or the
+    /// file is more than half full. Call from one thread only.
+    /// @param now the current time.
+    /// @param retention age of the records that are kept as they are.
+    /// @param interval time between compactions.
+    void maintain(const time_point& now,
+                  std::chrono::seconds retention,
+                  std::chrono::seconds interval);
+
+    /// @brief Number of records in the file.
+    std::size_t size() const;
+
+    /// @brief Number of records dropped because the queue or file was full.
+    uint64_t dropped() const;
+
+  private:
+    JournalHeader* m_header{ nullptr };
+    JournalRecord* m_records{ nullptr };
+    std::size_t m_capacity{ 0 };
+    int m_fd{ -1 };
+    std::atomic<bool> m_open{ false };
+    std::filesystem::path m_path;
+    EventQueue<JournalRecord, QUEUE_SIZE> m_queue;
+    /// @brief Held while writing to the mapping, serializes the consumer of
+    /// m_queue.
+    std::mutex m_write_mtx;
+    /// @brief Held exclusively while the file is replaced by compact.
+    mutable std::shared_mutex m_map_mtx;
+    std::chrono::steady_clock::time_point m_last_compaction;
+
+    /// @brief Last record of each key, the key in the low and the record
+    /// index + 1 in the high 32 bits. Written by the writer of the mapping,
+    /// the slot of a key never moves. Zero marks an empty slot.
+    std::array<std::atomic<uint64_t>, INDEX_SLOTS> m_last{};
+    std::size_t m_indexed_keys{ 0 };
+    /// @brief A key didn't fit in m_last.
+    std::atomic<bool> m_index_full{ false };
+    /// @brief Index + 1 of the previous record of the same key for every
+    /// record, 0 if none.
+    std::vector<uint32_t> m_previous;
+    /// @brief Record index + 1 of every m_last slot before every
+    /// CHECKPOINT_INTERVAL-th record.
+    std::vector<uint32_t> m_checkpoints;
+
+    void m_push(const JournalRecord& record);
+    void m_write_queued();
+    bool m_map(int fd, std::size_t capacity);
+    void m_unmap();
+    std::size_t m_lower_bound(int64_t time, std::size_t count) const;
+    /// @brief Index the records of the mapping, when it is mapped.
+    void m_reindex();
+    /// @brief Index the record written at index before it is counted.
+    void m_index(std::size_t index);
+    /// @return the m_last slot of key, or the empty slot it would take.
+    std::size_t m_find_slot(uint32_t key) const;
+    /// @brief Get the last record of a key before a record.
+    /// @return index + 1 of the record, 0 if none.
+    uint32_t m_last_before(std::size_t slot,
+                           std::size_t index,
+                           std::size_t count) const;
+    /// @brief Get the time a device or the alarm spent in the state set by
+    /// the on event during a range.
+    std::chrono::nanoseconds m_time_in(uint32_t key,
+                                       JournalEvent on,
+                                       const time_point& from,
+                                       const time_point& to);
+    /// @brief m_time_in for keys missing from the index, scanning every
+    /// record in the range.
+    std::chrono::nanoseconds m_scan_time_in(uint32_t key,
+                                            JournalEvent on,
+                                            int64_t start,
+                                            int64_t end,
+                                            std::size_t first,
+                                            std::size_t count) const;
+};
+
+#endif // JOURNAL_H_
@@ -0,0 +1,63 @@
+#ifndef LIBUSBSOURCE_H_
+#define LIBUSBSOURCE_H_
+
+#include "devicesource.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct libusb_context;
+
+/// @brief Device source backed by libusb hotplug callbacks.
+class LibusbSource : public DeviceSource
+{
+  public:
+    LibusbSource() = default;
+    ~LibusbSource() override;
+
+    /// @brief Initialize libusb and list the connected devices.
+    std::vector<usb_id> enumerate() override;
+    /// @brief List the connected devices with their ports from sysfs,
+    /// falling back to enumerate without ports.
+    std::vector<USBDeviceInstance> enumerate_instances() override;
+    bool start(USBTracker& tracker) override;
+    void stop() override;
+    void join() override;
+
+    /// @brief Register libusb hotplug callbacks for the wanted vid:pid ids
+    /// only. libusb's monitor still wakes the event thread for every uevent,
+    /// only the callbacks of other devices are skipped.
+    void set_filter(const std::vector<uint32_t>& wanted,
+                    bool match_any) override;
+
+    /// @brief Tracker events are delivered to, set while started.
+    USBTracker* tracker() const;
+
+  private:
+    std::thread m_thread;
+    std::atomic<bool> m_running{ false };
+    std::atomic<USBTracker*> m_tracker{ nullptr };
+
+    /// @brief Guards m_ctx and the registered hotplug callbacks.
+    std::mutex m_hotplug_mtx;
+    libusb_context* m_ctx{ nullptr };
+    bool m_match_any{ false };
+    std::vector<uint32_t> m_wanted;
+    int m_match_any_handle{ -1 };
+    /// @brief Hotplug callback handles by packed vid:pid.
+    std::unordered_map<uint32_t, int> m_hotplug_handles;
+    /// @brief epoll set of libusb pollfds and m_stop_fd.
+    int m_epoll_fd{ -1 };
+    /// @brief eventfd signaled by stop.
+    int m_stop_fd{ -1 };
+
+    void m_event_loop();
+    void m_sync_hotplug_callbacks();
+    void m_exit();
+    static void m_pollfd_added(int fd, short events, void* user_data);
+    static void m_pollfd_removed(int fd, void* user_data);
+};
+
+#endif // LIBUSBSOURCE_H_
@@ -0,0 +1,178 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+/// @brief Counters kept by the library.
+enum MetricCounter
+{
+    /// @brief Hotplug events handled by USBTracker.
+    HOTPLUG_EVENTS = 0,
+    /// @brief Evaluations of the schedule, is_alarm and list_unconnected.
+    ALARM_EVALUATIONS = 1,
+    /// @brief Configuration files read and compiled.
+    CONFIG_RELOADS = 2,
+    METRIC_COUNTERS
+};
+
+/// @brief Latency histograms kept by the library.
+enum MetricHistogram
+{
+    /// @brief Tracker thread wakeup to the handling of a hotplug event.
+    EVENT_LATENCY = 0,
+    /// @brief Time the hotplug callbacks block the tracker thread.
+    CALLBACK_TIME = 1,
+    /// @brief Duration of is_alarm and list_unconnected_devices.
+    EVALUATION_TIME = 2,
+    /// @brief Duration of reading and compiling the configuration file.
+    RELOAD_TIME = 3,
+    /// @brief Time USBTracker waits for its connected device mutex.
+    LOCK_WAIT = 4,
+    METRIC_HISTOGRAMS
+};
+
+/// @brief Number of histogram buckets. Values below 4 ns get a bucket each,
+/// every power of two above is split into 4 buckets.
+inline constexpr std::size_t HISTOGRAM_BUCKETS = 252;
+
+/// @brief Get the histogram bucket of a value.
+constexpr std::size_t
+histogram_bucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < 4) {
+        return nanoseconds;
+    }
+    const auto exponent = std::bit_width(nanoseconds) - 1;
+    return (exponent - 1) * 4 + ((nanoseconds >> (exponent - 2)) & 3);
+}
+
+/// @brief Get the smallest value in a histogram bucket.
+constexpr uint64_t
+histogram_bucket_start(std::size_t bucket)
+{
+    if (bucket < 4) {
+        return bucket;
+    }
+    return (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+/// @brief Get the largest value in a histogram bucket.
+constexpr uint64_t
+histogram_bucket_end(std::size_t bucket)
+{
+    if (bucket + 1 == HISTOGRAM_BUCKETS) {
+        return UINT64_MAX;
+    }
+    return histogram_bucket_start(bucket + 1) - 1;
+}
+
+struct HistogramSnapshot
+{
+    std::array<uint64_t, HISTOGRAM_BUCKETS> buckets{};
+    uint64_t count{ 0 };
+    /// @brief Sum of the recorded values in nanoseconds.
+    uint64_t sum{ 0 };
+
+    /// @brief Get a quantile of the recorded values.
+    /// @param quantile the quantile between 0 and 1, e.g. 0.99.
+    /// @return the upper bound of the bucket the quantile falls into, 0 if
+    /// nothing was recorded.
+    std::chrono::nanoseconds percentile(double quantile) const;
+};
+
+struct MetricsSnapshot
+{
+    std::array<uint64_t, METRIC_COUNTERS> counters{};
+    std::array<HistogramSnapshot, METRIC_HISTOGRAMS> histograms{};
+};
+
+/// @brief Process-wide registry of the library metrics.
+/// @details Every thread records into its own shard, so recording never
+/// contends with other threads. A snapshot sums the shards. Recording is
+/// disabled by default and then costs one relaxed load.
+class Metrics
+{
+  public:
+    static void set_enabled(bool enabled);
+    static bool enabled()
+    {
+        return m_enabled.load(std::memory_order_relaxed);
+    }
+
+    /// @brief Add to a counter.
+    static void add(MetricCounter counter, uint64_t value = 1)
+    {
+        if (enabled()) {
+            m_add(counter, value);
+        }
+    }
+
+    /// @brief Record a value in a histogram.
+    static void record(MetricHistogram histogram,
+                       std::chrono::nanoseconds value)
+    {
+        if (enabled()) {
+            m_record(histogram, value);
+        }
+    }
+
+    /// @brief Sum the metrics recorded by every thread.
+    static MetricsSnapshot snapshot();
+
+    /// @brief Zero every counter and histogram.
+    /// @details Values recorded concurrently may or may not be kept.
+    static void reset();
+
+    /// @brief Format a snapshot in the Prometheus text exposition format.
+    static std::string prometheus(const MetricsSnapshot& snapshot);
+
+    /// @brief Write the current metrics in the Prometheus text format.
+    /// @details The file is replaced atomically, so a scraper never reads a
+    /// partial dump.
+    /// @return false if the file could not be written.
+    static bool write_prometheus(const std::filesystem::path& path);
+
+  private:
+    static std::atomic<bool> m_enabled;
+
+    static void m_add(MetricCounter counter, uint64_t value);
+    static void m_record(MetricHistogram histogram,
+                         std::chrono::nanoseconds value);
+};
+
+/// @brief Records the lifetime of the object in a histogram.
+class MetricTimer
+{
+  public:
+    explicit MetricTimer(MetricHistogram histogram)
+      : m_histogram(histogram)
+    {
+        if (Metrics::enabled()) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~MetricTimer()
+    {
+        if (m_start != std::chrono::steady_clock::time_point{}) {
+            Metrics::record(m_histogram,
+                            std::chrono::steady_clock::now() - m_start);
+        }
+    }
+
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer& operator=(const MetricTimer&) = delete;
+
+  private:
+    MetricHistogram m_histogram;
+    std::chrono::steady_clock::time_point m_start{};
+};
+
+#endif // METRICS_H_
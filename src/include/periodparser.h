@@ -0,0 +1,279 @@
+#ifndef PERIODPARSER_H
+#define PERIODPARSER_H
+
+#include "tools.h"
+#include "weekschedule.h"
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/// @brief Error found while parsing a configuration value.
+struct ParseError
+{
+    /// @brief Offset of the offending character from the start of the value.
+    std::size_t column;
+    const char* message;
+};
+
+template<typename T>
+using ParseResult = std::expected<T, ParseError>;
+
+namespace period_parser {
+
+constexpr bool
+is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+constexpr int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/// @brief Single pass cursor over a configuration value.
+class Cursor
+{
+  public:
+    constexpr explicit Cursor(std::string_view view)
+      : m_view(view)
+    {
+    }
+
+    constexpr std::size_t column() const { return m_pos; }
+    constexpr bool done() const { return m_pos >= m_view.size(); }
+    constexpr char peek() const { return done() ? '\0' : m_view[m_pos]; }
+
+    constexpr void skip_space()
+    {
+        while (!done() && is_space(m_view[m_pos])) {
+            ++m_pos;
+        }
+    }
+
+    constexpr bool consume(char c)
+    {
+        if (peek() != c) {
+            return false;
+        }
+        ++m_pos;
+        return true;
+    }
+
+    /// @brief Parse an unsigned number of at most max_digits digits.
+    constexpr std::optional<unsigned> number(int base, std::size_t max_digits)
+    {
+        const auto rest = m_view.substr(m_pos, max_digits);
+        unsigned value = 0;
+        std::size_t length = 0;
+
+        if (std::is_constant_evaluated()) {
+            while (length < rest.size() && hex_digit(rest[length]) >= 0 &&
+                   hex_digit(rest[length]) < base) {
+                value = value * base + hex_digit(rest[length]);
+                ++length;
+            }
+        } else {
+            const auto result = std::from_chars(
+              rest.data(), rest.data() + rest.size(), value, base);
+            if (result.ec != std::errc{}) {
+                return std::nullopt;
+            }
+            length = result.ptr - rest.data();
+        }
+
+        if (length == 0) {
+            return std::nullopt;
+        }
+        m_pos += length;
+        return value;
+    }
+
+  private:
+    std::string_view m_view;
+    std::size_t m_pos{ 0 };
+};
+
+constexpr ParseResult<uint16_t>
+time_of_day(Cursor& cursor)
+{
+    cursor.skip_space();
+    const auto hour_column = cursor.column();
+    const auto hour = cursor.number(10, 2);
+    if (!hour) {
+        return std::unexpected(ParseError{ hour_column, "expected hour" });
+    }
+    if (*hour > 24) {
+        return std::unexpected(
+          ParseError{ hour_column, "hour must be between 0 and 24" });
+    }
+
+    unsigned minute = 0;
+    if (cursor.consume(':')) {
+        const auto minute_column = cursor.column();
+        const auto parsed = cursor.number(10, 2);
+        if (!parsed) {
+            return std::unexpected(
+              ParseError{ minute_column, "expected minutes" });
+        }
+        if (*parsed > 59 || (*hour == 24 && *parsed != 0)) {
+            return std::unexpected(
+              ParseError{ minute_column, "minutes out of range" });
+        }
+        minute = *parsed;
+    }
+    return static_cast<uint16_t>(*hour * 60 + minute);
+}
+
+constexpr ParseResult<MinuteSpan>
+span(Cursor& cursor)
+{
+    const auto start = time_of_day(cursor);
+    if (!start) {
+        return std::unexpected(start.error());
+    }
+
+    cursor.skip_space();
+    if (!cursor.consume('-')) {
+        return std::unexpected(ParseError{ cursor.column(), "expected '-'" });
+    }
+
+    const auto end = time_of_day(cursor);
+    if (!end) {
+        return std::unexpected(end.error());
+    }
+    cursor.skip_space();
+    return MinuteSpan{ *start, *end };
+}
+
+} // namespace period_parser
+
+/// @brief Parse a time of day, e.g. 20:30 or 20.
+/// @param view string containing hh:mm or hh, 24:00 at most.
+/// @return minutes since midnight or the error.
+constexpr ParseResult<uint16_t>
+parse_time_of_day(std::string_view view)
+{
+    period_parser::Cursor cursor(view);
+    const auto minutes = period_parser::time_of_day(cursor);
+    if (minutes) {
+        cursor.skip_space();
+        if (!cursor.done()) {
+            return std::unexpected(
+              ParseError{ cursor.column(), "unexpected character" });
+        }
+    }
+    return minutes;
+}
+
+/// @brief Parse a single period, e.g. 20:00-24:00.
+/// @param view string containing the period.
+/// @return the period or the error.
+constexpr ParseResult<MinuteSpan>
+parse_span(std::string_view view)
+{
+    period_parser::Cursor cursor(view);
+    const auto result = period_parser::span(cursor);
+    if (result && !cursor.done()) {
+        return std::unexpected(
+          ParseError{ cursor.column(), "unexpected character" });
+    }
+    return result;
+}
+
+/// @brief Parse comma separated periods, e.g. 00:00-06:00, 20:00-24:00,
+/// calling consumer with each period.
+/// @details Usable in constant expressions. An empty or blank value contains
+/// no periods.
+/// @param view string containing the periods.
+/// @param consumer called with each parsed MinuteSpan, in order.
+/// @return the first error, if any.
+template<typename Consumer>
+constexpr std::optional<ParseError>
+for_each_span(std::string_view view, Consumer&& consumer)
+{
+    period_parser::Cursor cursor(view);
+    cursor.skip_space();
+    if (cursor.done()) {
+        return std::nullopt;
+    }
+
+    while (true) {
+        const auto result = period_parser::span(cursor);
+        if (!result) {
+            return result.error();
+        }
+        consumer(*result);
+
+        if (cursor.done()) {
+            return std::nullopt;
+        }
+        if (!cursor.consume(',')) {
+            return ParseError{ cursor.column(), "expected ','" };
+        }
+    }
+}
+
+/// @brief Parse comma separated periods, e.g. 00:00-06:00, 20:00-24:00.
+/// @param view string containing the periods.
+/// @return the periods or the first error.
+inline ParseResult<std::vector<MinuteSpan>>
+parse_spans(std::string_view view)
+{
+    std::vector<MinuteSpan> spans;
+    const auto error =
+      for_each_span(view, [&spans](MinuteSpan span) { spans.push_back(span); });
+    if (error) {
+        return std::unexpected(*error);
+    }
+    return spans;
+}
+
+/// @brief Parse a USB id, e.g. dead:beef.
+/// @param view string containing hexadecimal VID:PID.
+/// @return the id or the error.
+constexpr ParseResult<usb_id>
+parse_usb_id(std::string_view view)
+{
+    period_parser::Cursor cursor(view);
+    cursor.skip_space();
+
+    const auto vid_column = cursor.column();
+    const auto vid = cursor.number(16, 4);
+    if (!vid) {
+        return std::unexpected(ParseError{ vid_column, "expected vendor id" });
+    }
+    if (!cursor.consume(':')) {
+        return std::unexpected(ParseError{ cursor.column(), "expected ':'" });
+    }
+
+    const auto pid_column = cursor.column();
+    const auto pid = cursor.number(16, 4);
+    if (!pid) {
+        return std::unexpected(ParseError{ pid_column, "expected product id" });
+    }
+    cursor.skip_space();
+    if (!cursor.done()) {
+        return std::unexpected(
+          ParseError{ cursor.column(), "unexpected character" });
+    }
+    return usb_id{ static_cast<uint16_t>(*vid), static_cast<uint16_t>(*pid) };
+}
+
+#endif /* PERIODPARSER_H */
@@ -0,0 +1,186 @@
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+/// @brief Binary protocol spoken between boredomlockd and its clients.
+/// @details Messages travel over a SOCK_SEQPACKET Unix domain socket, so
+/// every message is a single packet: a Header followed by the payload of the
+/// message type. Integers are in host byte order, both ends run on the same
+/// machine. A reply carries the sequence number of its request, STATE_CHANGED
+/// notifications carry sequence number 0.
+namespace protocol {
+
+inline constexpr uint8_t VERSION = 1;
+
+/// @brief Largest message either end sends.
+inline constexpr std::size_t MAX_MESSAGE = 65536;
+
+/// @brief Longest snooze accepted, requests outside 0..MAX_SNOOZE_SECONDS
+/// are malformed.
+inline constexpr int64_t MAX_SNOOZE_SECONDS = 366 * 24 * 60 * 60;
+
+enum MessageType : uint8_t
+{
+    /// @brief Reply: u8 alarm.
+    IS_ALARM = 1,
+    /// @brief Reply: u16 count, then count times u16 vid, u16 pid, string
+    /// name.
+    LIST_UNCONNECTED = 2,
+    /// @brief Payload: i64 seconds, at most MAX_SNOOZE_SECONDS.
+    SNOOZE = 3,
+    /// @brief Payload: u16 vid, u16 pid, i64 seconds, at most
+    /// MAX_SNOOZE_SECONDS.
+    SNOOZE_DEVICE = 4,
+    ENABLE = 5,
+    DISABLE = 6,
+    /// @brief Reply: u8 alarm. STATE_CHANGED is sent on every change after.
+    SUBSCRIBE = 7,
+    UNSUBSCRIBE = 8,
+    /// @brief Reply: i64 nanoseconds since the system clock epoch.
+    NEXT_CHANGE = 9,
+
+    REPLY = 0x80,
+    /// @brief Payload: string message.
+    ERROR_REPLY = 0x81,
+    /// @brief Payload: u8 alarm.
+    STATE_CHANGED = 0x82,
+};
+
+struct Header
+{
+    uint8_t type;
+    uint8_t version;
+    uint16_t reserved;
+    uint32_t sequence;
+};
+
+/// @brief Appends a message to a buffer.
+class Writer
+{
+  public:
+    Writer(std::vector<uint8_t>& buffer, MessageType type, uint32_t sequence)
+      : m_buffer(buffer)
+    {
+        m_buffer.clear();
+        put(Header{ type, VERSION, 0, sequence });
+    }
+
+    Writer& u8(uint8_t value) { return put(value); }
+    Writer& u16(uint16_t value) { return put(value); }
+    Writer& i64(int64_t value) { return put(value); }
+
+    /// @brief Append a string prefixed with its u16 length.
+    Writer& string(std::string_view value)
+    {
+        u16(static_cast<uint16_t>(value.size()));
+        m_buffer.insert(m_buffer.end(), value.begin(), value.end());
+        return *this;
+    }
+
+    /// @brief Check if more bytes still fit in the message.
+    bool fits(std::size_t bytes) const
+    {
+        return m_buffer.size() + bytes <= MAX_MESSAGE;
+    }
+
+  private:
+    std::vector<uint8_t>& m_buffer;
+
+    template<typename T>
+    Writer& put(const T& value)
+    {
+        const auto size = m_buffer.size();
+        m_buffer.resize(size + sizeof(T));
+        std::memcpy(m_buffer.data() + size, &value, sizeof(T));
+        return *this;
+    }
+};
+
+/// @brief Reads a message from a buffer. Reading past the end sets the
+/// reader to failed and returns zeros.
+class Reader
+{
+  public:
+    explicit Reader(std::span<const uint8_t> message)
+      : m_message(message)
+    {
+        m_ok = get(m_header) && m_header.version == VERSION;
+    }
+
+    const Header& header() const { return m_header; }
+    bool ok() const { return m_ok; }
+    /// @brief Set the reader to failed, e.g. for a value out of range.
+    void fail() { m_ok = false; }
+
+    uint8_t u8() { return value<uint8_t>(); }
+    uint16_t u16() { return value<uint16_t>(); }
+    int64_t i64() { return value<int64_t>(); }
+
+    std::string string()
+    {
+        const auto size = u16();
+        if (!m_ok || m_message.size() - m_offset < size) {
+            m_ok = false;
+            return {};
+        }
+        std::string value(
+          reinterpret_cast<const char*>(m_message.data() + m_offset), size);
+        m_offset += size;
+        return value;
+    }
+
+  private:
+    std::span<const uint8_t> m_message;
+    std::size_t m_offset{ 0 };
+    Header m_header{};
+    bool m_ok{ false };
+
+    template<typename T>
+    bool get(T& value)
+    {
+        if (m_message.size() - m_offset < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, m_message.data() + m_offset, sizeof(T));
+        m_offset += sizeof(T);
+        return true;
+    }
+
+    template<typename T>
+    T value()
+    {
+        T value{};
+        if (!m_ok || !get(value)) {
+            m_ok = false;
+            return T{};
+        }
+        return value;
+    }
+};
+
+/// @brief Get the socket boredomlockd listens on by default,
+/// $XDG_RUNTIME_DIR/boredomlockd.sock or /tmp/boredomlockd-<uid>.sock.
+inline std::filesystem::path
+default_socket_path()
+{
+    if (const char* runtime = getenv("XDG_RUNTIME_DIR"); runtime && *runtime) {
+        return std::filesystem::path(runtime) / "boredomlockd.sock";
+    }
+    return std::filesystem::path("/tmp") /
+           ("boredomlockd-" + std::to_string(getuid()) + ".sock");
+}
+
+} // namespace protocol
+
+#endif // PROTOCOL_H_
@@ -1,28 +1,34 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include "awaitable.h"
+#include "clock.h"
+#include "embedded.h"
+#include "journal.h"
+#include "periodparser.h"
+#include "statefile.h"
+#include "timerwheel.h"
 #include "tools.h"
+#include "transitionindex.h"
 #include "usbtracker.h"
+#include "weekschedule.h"
 
 #include <chrono>
+#include <deque>
 #include <filesystem>
 #include <functional>
+#include <map>
+#include <memory>
 #include <simpleini.h>
+#include <span>
 #include <string>
+#include <unordered_map>
 
 /// @brief Period of time that user should spend without the configured device.
 /// e.g. 20:00 - 24:00
 using BoredPeriod = std::pair<std::chrono::hh_mm_ss<std::chrono::seconds>,
                               std::chrono::hh_mm_ss<std::chrono::seconds>>;
 
-/// @brief USB device with usb_id and name
-struct USBDevice
-{
-    usb_id id;
-    std::string name;
-    bool operator==(const USBDevice& rhs) const { return this->id == rhs.id; }
-};
-
 enum BSchedulerStatus
 {
     ENABLED = 0,
@@ -31,20 +37,23 @@ enum BSchedulerStatus
 
 /// @brief Create a chrono object from a string.
 /// @param view a string containing hh:mm value.
-/// @return the string converted to chrono object.
+/// @return the string converted to chrono object, 00:00 if view is malformed.
+/// See parse_time_of_day for error reporting.
 std::chrono::hh_mm_ss<std::chrono::seconds>
 hours_minutes(const std::string_view& view);
 
 /// @brief Parse BoredPeriod from a string.
 /// @param view a string containing a time period e.g. 20:00-23:00.
-/// @return The BoredPeriod defined by view.
+/// @return The BoredPeriod defined by view, 00:00-00:00 if view is malformed.
+/// See parse_span for error reporting.
 BoredPeriod
 parse_bored_period(const std::string_view& view);
 
 /// @brief Parse all BoredPeriods defined in a string.
 /// @param view a string containing comma separated BoredPeriods, e.g.
 /// 15:00-16:00, 17:00-18:30.
-/// @return List of BoredPeriods.
+/// @return List of BoredPeriods up to the first malformed period. See
+/// parse_spans for error reporting.
 std::vector<BoredPeriod>
 parse_bored_periods(const std::string_view& view);
 
@@ -70,6 +79,31 @@ std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>
 parse_from_iniconf(const simpleini::SimpleINI& config,
                    const std::chrono::system_clock::time_point& now);
 
+/// @brief Mark the minutes covered by BoredPeriods starting on a day.
+/// @param mask the WeekMask to modify.
+/// @param day the day the periods start on.
+/// @param periods BoredPeriods of the day. A period that ends before it starts,
+/// e.g. 22:00-02:00, continues past midnight into the next day.
+void
+add_bored_periods(WeekMask& mask,
+                  std::chrono::weekday day,
+                  const std::vector<BoredPeriod>& periods);
+
+/// @brief Compile a single configuration section into a DeviceSchedule.
+/// @param name name of the device.
+/// @param section the configuration section of the device.
+/// @details Per-weekday keys (monday, tuesday, ...) take precedence over the
+/// weekdays and weekend keys for that day.
+/// @return The device and the minutes of the week it should be plugged in.
+DeviceSchedule
+compile_section(const std::string& name, const simpleini::INISection& section);
+
+/// @brief Compile every device in a configuration object into a schedule.
+/// @param config a SimpleINI object with the used configuration.
+/// @return Schedule of every configured device.
+CompiledSchedule
+compile_schedule(const simpleini::SimpleINI& config);
+
 /// @brief Check if the <BoredPeriod, usb_id> list contains an unplugged USB
 /// device that should be plugged in.
 /// @param bored The <BoredPeriod, USB_device> list to check.
@@ -86,6 +120,22 @@ list_unconnected(
   const std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>& bored,
   const std::chrono::hh_mm_ss<std::chrono::seconds>& now_hms);
 
+/// @brief Changes of the unconnected devices since a generation, see
+/// BoredomScheduler::unconnected_changes.
+struct UnconnectedChanges
+{
+    /// @brief Generation of the unconnected devices the changes lead to,
+    /// passed to the next unconnected_changes call.
+    uint64_t generation{ 0 };
+    /// @brief True if the changes since the requested generation are no
+    /// longer known. unconnected then lists every unconnected device.
+    bool full{ false };
+    /// @brief Devices that became unconnected.
+    std::vector<USBDevice> unconnected;
+    /// @brief Devices that were unconnected and no longer are.
+    std::vector<USBDevice> reconnected;
+};
+
 /// @brief Tracks configuration and connected devices
 class BoredomScheduler
 {
@@ -110,12 +160,33 @@ class BoredomScheduler
     /// that the device should be plugged in.
     explicit BoredomScheduler(const std::filesystem::path& config);
 
-    /// @brief Set config file path. init is called after the path is set.
+    /// @brief Create a BoredomScheduler object with a schedule compiled into
+    /// the program instead of a configuration file.
+    /// @param devices the devices and their schedules, e.g. a constexpr array
+    /// of EmbeddedDevice. Only referenced during construction.
+    /// @details The configuration file functions (set_config_file,
+    /// reload_config and create_boredom_period) have no effect.
+    explicit BoredomScheduler(std::span<const EmbeddedDevice> devices);
+    ~BoredomScheduler();
+
+    BoredomScheduler(const BoredomScheduler&) = delete;
+    BoredomScheduler& operator=(const BoredomScheduler&) = delete;
+
+    /// @brief Set config file path. init is called after the path is set if
+    /// the object is not initialized yet, otherwise the new file is loaded
+    /// like in reload_config.
     /// @param config path to config file.
     void set_config_file(const std::filesystem::path& config);
 
-    /// @brief Initialize the object. Reads configuration and saved
-    /// enabled/disabled state.
+    /// @brief Re-read the configuration file and recompile the sections that
+    /// changed.
+    /// @details Called from handle_events when the configuration file is
+    /// modified. The new schedule replaces the old one atomically, and the
+    /// USB tracker and its connected device state are kept.
+    void reload_config();
+
+    /// @brief Initialize the object. Reads configuration and the saved
+    /// enabled/disabled state and snoozes.
     void init();
 
     /// @brief Check if alarm needs to be set.
@@ -127,6 +198,11 @@ class BoredomScheduler
     void snooze(std::chrono::seconds seconds);
     void snooze(int seconds) { snooze(std::chrono::seconds(seconds)); };
 
+    /// @brief Set the alarm off for a single device for a time period.
+    /// @param id vid:pid of the device.
+    /// @param seconds Number of seconds to snooze.
+    void snooze(const usb_id& id, std::chrono::seconds seconds);
+
     /// @brief Disables the alarms until enabled.
     void disable();
     /// @brief Enables the alarms.
@@ -135,8 +211,52 @@ class BoredomScheduler
     void set_device_event_cb(std::function<void(void*)> callback);
     void set_event_cb_data(void* data);
 
+    /// @brief Get a file descriptor that becomes readable when the alarm
+    /// state may have changed.
+    /// @details Poll the descriptor (e.g. with poll or epoll) and call
+    /// handle_events when it is readable. Valid after init.
+    /// @return pollable file descriptor.
+    int fd() const;
+
+    /// @brief Re-evaluate the alarm state after fd became readable.
+    /// @details Calls the state change callback if the alarm state changed
+    /// and arms the timer for the next instant the state can change.
+    void handle_events();
+
+    /// @brief Set a callback called from handle_events when the alarm state
+    /// changes.
+    /// @param callback called with the new is_alarm value.
+    void set_state_change_cb(std::function<void(bool)> callback);
+
+    /// @brief Set the executor state_change resumes coroutines with. Set it
+    /// before awaiting.
+    void set_executor(Executor executor);
+
+    /// @brief Wait for the alarm state to change in a coroutine, e.g.
+    /// bool alarm = co_await scheduler.state_change().
+    /// @details The coroutine is resumed through the executor from
+    /// handle_events, after the state change callback. An event loop drives
+    /// the scheduler by calling handle_events when fd() is readable.
+    /// Destroy waiting coroutines before the scheduler.
+    /// @return awaitable resuming with the new is_alarm value.
+    WaitList<bool>::Awaiter state_change();
+
+    /// @brief Replace the clock used for evaluating the schedule and snoozes.
+    /// @details The timer behind fd() follows the system clock, so with a
+    /// ManualClock call handle_events after moving the clock.
+    /// @param clock the new clock.
+    void set_clock(std::shared_ptr<const Clock> clock);
+
+    /// @brief Get the next instant the alarm state can change without a
+    /// hotplug event, i.e. the next period boundary or snooze expiry.
+    /// @return time point of the next possible change.
+    std::chrono::system_clock::time_point next_change() const;
+
     /// @brief Adds a boredom period for device to the current configuration
     /// file.
+    /// @details Only the device is compiled and indexed, replacing its
+    /// previous period, but publishing copies the schedule, which is O(n) in
+    /// the number of devices.
     /// @param device usb_id of the device.
     /// @param weekday_times string representing weekday bored times, e.g.
     /// 20:00-24:00
@@ -146,35 +266,177 @@ class BoredomScheduler
                                const std::string& weekday_times,
                                const std::string& weekend_times);
 
+    /// @brief Changes kept for unconnected_changes.
+    static constexpr std::size_t UNCONNECTED_LOG_SIZE = 256;
+
     /// @brief List devices that should be connected but aren't.
     /// @return list of unconnected devices.
     std::vector<USBDevice> list_unconnected_devices();
+
+    /// @brief Get the changes of the unconnected devices since a generation.
+    /// @details Only the changes are returned, so polling costs nothing
+    /// while no device changes. Changes that cancel out are left out.
+    /// @param since generation returned by the previous call, 0 on the first
+    /// call to get every unconnected device.
+    /// @return the changes and the current generation.
+    UnconnectedChanges unconnected_changes(uint64_t since);
+
+    /// @brief Bring the unconnected devices up to date.
+    /// @details Only the devices of the hotplug events, per-device snoozes
+    /// and snooze expiries since the last update and the devices whose
+    /// periods start or end in between are evaluated again. Everything is
+    /// evaluated after the configuration or clock changes, or when the last
+    /// update was more than an hour ago.
     void update();
 
+    /// @brief Record the hotplug transitions of the configured devices and
+    /// the alarm edges in a journal.
+    /// @details The journal is compacted from handle_events once a day,
+    /// transitions older than JOURNAL_RETENTION are folded.
+    /// @param path journal file, "journal" in the data directory if empty.
+    /// @return false if the journal couldn't be opened.
+    bool open_journal(const std::filesystem::path& path = {});
+
+    /// @brief Get the journal opened with open_journal for queries.
+    Journal& journal() { return m_journal; }
+
+    /// @brief Age of the journal records kept as they are.
+    static constexpr std::chrono::days JOURNAL_RETENTION{ 90 };
+
   private:
     /// @brief Configuration file path.
     std::filesystem::path m_configfile;
     /// @brief INI configuration read from m_configfile.
     simpleini::SimpleINI m_config;
     /// @brief File used for saving object status to storage.
-    std::filesystem::path m_statusfile;
+    std::filesystem::path m_statefile;
     std::filesystem::path m_dir;
-    BSchedulerStatus m_status;
-    std::chrono::seconds m_snooze_t{ 0 };
-    std::chrono::time_point<std::chrono::system_clock> m_snooze_start;
+    /// @brief Status, snoozes and device states, saved in m_statefile.
+    StateFile m_state;
+    /// @brief History of transitions, written if open_journal was called.
+    Journal m_journal;
+    /// @brief Clock of every time stamp, also read by the hotplug callback
+    /// on the USB tracker thread while set_clock may replace it.
+    std::atomic<std::shared_ptr<const Clock>> m_clock{
+        std::make_shared<SystemClock>()
+    };
+    /// @brief Local day and UTC offset of m_clock.
+    mutable LocalTimeCache m_local_time;
     std::function<void(void*)> m_callback;
-    std::vector<USBDevice> m_unconnected;
-    std::unique_ptr<USBTracker> m_usbtracker;
+    void* m_user_data{ nullptr };
+    std::function<void(bool)> m_state_callback;
+    /// @brief Coroutines waiting in state_change.
+    WaitList<bool> m_state_waiters;
+    Executor m_executor;
+    /// @brief Alarm state reported by the last handle_events call.
+    bool m_alarm_state{ false };
+    /// @brief epoll set of m_timer_fd, m_wake_fd and m_inotify_fd returned by
+    /// fd().
+    int m_epoll_fd{ -1 };
+    /// @brief timerfd armed for next_change().
+    int m_timer_fd{ -1 };
+    /// @brief eventfd signaled on hotplug events and state modifications.
+    int m_wake_fd{ -1 };
+    /// @brief Schedule the unconnected devices were evaluated against.
+    std::shared_ptr<const TransitionIndex> m_unconnected_schedule;
+    /// @brief Indexes of the unconnected devices in m_unconnected_schedule,
+    /// ascending.
+    std::vector<uint32_t> m_unconnected;
+    /// @brief Bitmap of the required devices, reused between updates.
+    std::vector<uint64_t> m_required;
+    /// @brief Indexes of the devices of each packed vid:pid.
+    std::unordered_map<uint32_t, std::vector<uint32_t>> m_devices_by_id;
+    /// @brief Time and minute of the week of the last update.
+    std::chrono::system_clock::time_point m_unconnected_time;
+    std::size_t m_unconnected_minute{ 0 };
+    struct DeviceSnooze
+    {
+        std::chrono::system_clock::time_point until;
+        TimerId timer;
+    };
 
-    bool has_unconnected(
-      const std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>& bored,
-      const std::chrono::hh_mm_ss<std::chrono::seconds>& now_hms) const;
+    /// @brief Pending device snoozes by packed vid:pid, with their timers in
+    /// m_timers.
+    std::unordered_map<uint32_t, DeviceSnooze> m_snoozes;
+    /// @brief Expiries of m_snoozes, keyed by packed vid:pid.
+    TimerWheel m_timers;
+    /// @brief Ids to evaluate again, pushed by the hotplug callback on the
+    /// tracker thread and drained by update.
+    EventQueue<usb_id, UNCONNECTED_LOG_SIZE> m_changed_ids;
+    /// @brief m_changed_ids.dropped() at the last update.
+    uint64_t m_changed_ids_dropped{ 0 };
 
-    std::vector<USBDevice> list_unconnected(
-      const std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>& bored,
-      const std::chrono::hh_mm_ss<std::chrono::seconds>& now_hms) const;
+    struct UnconnectedChange
+    {
+        uint64_t generation;
+        USBDevice device;
+        bool unconnected;
+    };
+
+    /// @brief Last UNCONNECTED_LOG_SIZE changes, oldest first.
+    std::deque<UnconnectedChange> m_unconnected_log;
+    uint64_t m_unconnected_generation{ 0 };
+    /// @brief Changes after this generation are all in m_unconnected_log.
+    uint64_t m_unconnected_log_base{ 0 };
+    /// @brief m_config compiled into minute-of-week bitmaps and indexed by
+    /// transition. A modified copy replaces it when the configuration
+    /// changes.
+    std::atomic<std::shared_ptr<const TransitionIndex>> m_schedule{
+        std::make_shared<const TransitionIndex>()
+    };
+    /// @brief Values of the sections in m_schedule by name, see
+    /// section_fingerprint.
+    std::map<std::string, std::string> m_section_fingerprints;
+    /// @brief True if the schedule was compiled into the program.
+    bool m_embedded{ false };
+    /// @brief inotify instance watching the directory of m_configfile.
+    int m_inotify_fd{ -1 };
+    int m_config_watch{ -1 };
+    /// @brief Process-wide tracker shared with other schedulers.
+    std::shared_ptr<USBTracker> m_usbtracker;
+    /// @brief Subscription to events of the devices in m_schedule.
+    SubscriptionId m_subscription{ 0 };
+
+    bool has_unconnected(const TransitionIndex& schedule,
+                         std::size_t minute) const;
+
+    /// @brief Evaluate every device again.
+    void m_rebuild_unconnected(std::shared_ptr<const TransitionIndex> schedule,
+                               std::size_t minute);
+    /// @brief Evaluate a device again, logging a change.
+    void m_update_unconnected(uint32_t device, std::size_t minute);
+    void m_log_unconnected(const USBDevice& device, bool unconnected);
+    bool m_is_unconnected(const DeviceSchedule& item,
+                          std::size_t minute) const;
 
     bool m_is_snooze() const;
+    bool m_is_snooze(const usb_id& id) const;
+    /// @brief Drop the device snoozes ended by now and queue their devices
+    /// for the next update.
+    void m_expire_snoozes();
+    void m_load_state();
+    /// @brief Record the current device and alarm states in m_journal.
+    void m_journal_state();
+
+    std::vector<usb_id> m_configured_ids() const;
+    /// @brief Read m_configfile and apply it.
+    void m_read_config();
+    void m_apply_config();
+    /// @brief Publish a copy of m_schedule without the sections named in
+    /// removed and with the added ones.
+    void m_publish(std::vector<std::string> removed, CompiledSchedule added);
+    /// @brief Save the connection state of a device in m_state, logging when
+    /// there is no room for it.
+    void m_save_connected(const usb_id& id,
+                          bool connected,
+                          const std::chrono::system_clock::time_point& at);
+    void m_watch_config();
+    bool m_config_changed();
+    void m_open_event_fds();
+    void m_arm_timer();
+    void m_wake();
+    /// @brief Current time of m_clock.
+    std::chrono::system_clock::time_point m_now() const;
 };
 
 #endif /* SCHEDULER_H */
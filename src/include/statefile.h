@@ -0,0 +1,117 @@
+#ifndef STATEFILE_H_
+#define STATEFILE_H_
+
+#include "tools.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// @brief Scheduler state kept in a memory-mapped file, so a restarted
+/// scheduler resumes with the same status and snoozes.
+/// @details An update first writes its words and the new checksum to a redo
+/// log in the mapping and commits it with a single store of the log count,
+/// then applies the words with an O(1) update of a position-weighted
+/// checksum. A process killed halfway leaves a committed log that open
+/// replays, so the file is consistent after a process crash. Writers of
+/// every mapping of the file, e.g. two schedulers in a process or the daemon
+/// and another process, are serialized with an flock of the file, the only
+/// system call on the update path. The checksum detects pages torn by a
+/// system crash, in which case the file starts over from defaults. The kernel
+/// writes dirty pages back on its own; sync and the sync interval bound how
+/// much a system crash can lose.
+class StateFile
+{
+  public:
+    /// @brief Maximum number of devices with a saved state.
+    static constexpr std::size_t DEVICES = 64;
+
+    using time_point = std::chrono::system_clock::time_point;
+
+    /// @brief Create a state kept in memory only until open is called.
+    StateFile();
+    ~StateFile();
+    StateFile(const StateFile&) = delete;
+    StateFile& operator=(const StateFile&) = delete;
+
+    /// @brief Map a state file, creating it if needed.
+    /// @details A file with another version or a bad checksum is reset to
+    /// the defaults. If the file can't be mapped the state stays in memory.
+    /// @param path path of the state file.
+    /// @return false if the file couldn't be used as is.
+    bool open(const std::filesystem::path& path);
+
+    /// @brief Flush the mapping to storage and wait for it.
+    void sync();
+
+    /// @brief Flush changes asynchronously at most once per interval.
+    /// @details Zero, the default, leaves write-back to the kernel.
+    void set_sync_interval(std::chrono::milliseconds interval);
+
+    /// @brief Saved BSchedulerStatus value.
+    uint32_t status() const;
+    void set_status(uint32_t status);
+
+    /// @brief End of the snooze of every device.
+    time_point snooze_until() const;
+    void set_snooze_until(const time_point& until);
+
+    /// @brief End of the snooze of a single device.
+    time_point snooze_until(const usb_id& id) const;
+    /// @return false if there is no room for another device.
+    bool set_snooze_until(const usb_id& id, const time_point& until);
+
+    /// @brief Earliest device snooze ending after now.
+    /// @return the end of the snooze, time_point::max() if none.
+    time_point next_snooze_end(const time_point& now) const;
+
+    /// @brief Device snoozes ending after now.
+    std::vector<std::pair<usb_id, time_point>> device_snoozes(
+      const time_point& now) const;
+
+    /// @brief Last known connection state of a device.
+    bool connected(const usb_id& id) const;
+    /// @brief Time the connection state of a device last changed.
+    time_point connected_changed(const usb_id& id) const;
+    /// @return false if there is no room for another device.
+    bool set_connected(const usb_id& id, bool connected, const time_point& at);
+
+    /// @brief Free the slots of the devices not in ids whose snooze ended,
+    /// so devices removed from the configuration make room for new ones.
+    /// @param ids the devices whose state is kept.
+    /// @param now the current time.
+    void retain(const std::vector<usb_id>& ids, const time_point& now);
+
+  private:
+    struct Data;
+    class Writer;
+
+    Data* m_data{ nullptr };
+    std::unique_ptr<Data> m_memory;
+    int m_fd{ -1 };
+    std::filesystem::path m_path;
+    /// @brief Serializes the writers of this object, the checksum update is
+    /// read-modify-write. Other mappings are excluded by an flock of m_fd.
+    std::mutex m_write_mtx;
+    std::chrono::milliseconds m_sync_interval{ 0 };
+    std::chrono::steady_clock::time_point m_last_sync;
+
+    void m_close();
+    void m_reset();
+    uint64_t m_checksum() const;
+    /// @brief Store words of m_data as a single update.
+    void m_store(std::initializer_list<std::pair<uint64_t*, uint64_t>> stores);
+    /// @brief Finish the update committed to the log before a crash.
+    void m_replay();
+    std::size_t m_find(const usb_id& id) const;
+    std::size_t m_slot(const usb_id& id);
+    void m_written();
+};
+
+#endif // STATEFILE_H_
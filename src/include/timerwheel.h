@@ -0,0 +1,113 @@
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// @brief Identifies a timer of a TimerWheel. Ids of expired or cancelled
+/// timers are never reused.
+struct TimerId
+{
+    uint32_t index{ 0 };
+    /// @brief 0 for an id that never refers to a timer.
+    uint32_t generation{ 0 };
+
+    bool operator==(const TimerId& rhs) const = default;
+};
+
+/// @brief Hierarchical timing wheel with millisecond ticks.
+/// @details Each level has 64 slots, a slot of level k spans 64^k ticks. A
+/// timer is kept in the lowest level whose slot holds both the timer and the
+/// current time, in a doubly-linked list, so adding and cancelling a timer
+/// is O(1). Advancing jumps from one occupied slot to the next with per-level
+/// occupancy bitmaps and moves the timers of a higher-level slot down once
+/// the wheel reaches it, so the cost of advancing depends on the timers that
+/// expire, not on the time passed or the number of timers pending. The last
+/// level is a ring covering over a century ahead; later timers expire at its
+/// end. Not thread-safe.
+class TimerWheel
+{
+  public:
+    using time_point = std::chrono::system_clock::time_point;
+
+    static constexpr std::size_t LEVELS = 7;
+    static constexpr std::size_t SLOTS = 64;
+
+    /// @param now the time the wheel starts at.
+    explicit TimerWheel(const time_point& now = {});
+
+    /// @brief Add a timer.
+    /// @param expiry time the timer expires at, timers in the past expire on
+    /// the next advance.
+    /// @param data value reported when the timer expires.
+    /// @return id of the timer, passed to cancel.
+    TimerId add(const time_point& expiry, uint64_t data);
+
+    /// @brief Remove a timer before it expires.
+    /// @return false if the timer already expired or was cancelled.
+    bool cancel(TimerId id);
+
+    /// @brief Move the wheel to a time and collect the timers expired by
+    /// then. The wheel never moves backwards, see reset.
+    /// @param now the current time.
+    /// @param expired vector the data of the expired timers are appended to,
+    /// in expiry order.
+    /// @return Number of expired timers.
+    std::size_t advance(const time_point& now, std::vector<uint64_t>& expired);
+
+    /// @brief Get the earliest expiry of the pending timers.
+    /// @return the expiry rounded up to a tick, time_point::max() if no
+    /// timer is pending.
+    time_point next_expiry() const;
+
+    /// @brief Remove every timer and restart the wheel at a time.
+    void reset(const time_point& now);
+
+    /// @brief Time the wheel has advanced to.
+    time_point now() const;
+
+    /// @brief Number of pending timers.
+    std::size_t size() const { return m_size; }
+
+  private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr unsigned BITS = 6;
+
+    struct Node
+    {
+        uint64_t expiry;
+        uint64_t data;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation;
+        uint8_t level;
+        uint8_t slot;
+        bool pending;
+    };
+
+    std::vector<Node> m_nodes;
+    /// @brief Head of the free node list, linked through Node::next.
+    uint32_t m_free{ NIL };
+    std::array<std::array<uint32_t, SLOTS>, LEVELS> m_heads;
+    /// @brief Bit s of level k is set if slot s of level k holds a timer.
+    std::array<uint64_t, LEVELS> m_occupied{};
+    /// @brief Current time in ticks.
+    uint64_t m_now{ 0 };
+    std::size_t m_size{ 0 };
+    /// @brief Cached next_expiry, recomputed when m_next_valid is false.
+    mutable uint64_t m_next{ 0 };
+    mutable bool m_next_valid{ false };
+
+    static uint64_t m_to_ticks(const time_point& time, bool round_up);
+    static time_point m_from_ticks(uint64_t ticks);
+    void m_link(uint32_t index);
+    void m_unlink(uint32_t index);
+    /// @brief Tick of the next slot that expires or cascades, UINT64_MAX if
+    /// none.
+    uint64_t m_next_event() const;
+};
+
+#endif // TIMERWHEEL_H_
@@ -1,9 +1,12 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
+#include <array>
 #include <cstdint>
+#include <filesystem>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 /// @brief Reperesents USB device with product and vendor ID.
@@ -16,10 +19,15 @@ struct usb_id
 
     void print() const { printf("%04x:%04x\n", vid, pid); }
 
-    bool operator==(const usb_id rhs) const
+    constexpr bool operator==(const usb_id rhs) const
     {
         return this->vid == rhs.vid && this->pid == rhs.pid;
     }
+    /// @brief Get vid and pid packed into a single 32-bit key.
+    constexpr uint32_t packed() const
+    {
+        return (static_cast<uint32_t>(vid) << 16) | pid;
+    }
     std::string to_string() const
     {
         char buffer[11];
@@ -28,14 +36,116 @@ struct usb_id
     }
 };
 
+/// @brief Physical location of a USB device: the bus number and the port
+/// path from the root hub, named 1-1.4 in sysfs.
+struct USBPort
+{
+    /// @brief Maximum number of hubs between a device and the root hub.
+    static constexpr std::size_t MAX_DEPTH = 7;
+
+    /// @brief Bus number, 0 if the location is unknown.
+    uint8_t bus{ 0 };
+    /// @brief Number of ports in the path.
+    uint8_t depth{ 0 };
+    std::array<uint8_t, MAX_DEPTH> ports{};
+
+    bool empty() const { return bus == 0; }
+    bool operator==(const USBPort& rhs) const = default;
+    /// @brief Get the sysfs name of the port, e.g. 1-1.4.
+    std::string to_string() const;
+};
+
+/// @brief A single connected USB device.
+struct USBDeviceInstance
+{
+    usb_id id;
+    /// @brief Location of the device, empty if the source doesn't know it.
+    USBPort port{};
+    /// @brief Serial number string of the device, empty if unknown.
+    std::string serial{};
+};
+
+/// @brief USB device with usb_id and name
+struct USBDevice
+{
+    usb_id id;
+    std::string name;
+    /// @brief Port the device must be plugged in to, any port if empty.
+    USBPort port{};
+    /// @brief Serial number the device must have, any if empty.
+    std::string serial{};
+    bool operator==(const USBDevice& rhs) const { return this->id == rhs.id; }
+
+    /// @brief Check if the device is pinned to a port or serial number.
+    bool pinned() const { return !port.empty() || !serial.empty(); }
+
+    /// @brief Check if a connected device is this device.
+    bool matches(const USBDeviceInstance& instance) const
+    {
+        return instance.id == id && (port.empty() || instance.port == port) &&
+               (serial.empty() || instance.serial == serial);
+    }
+};
+
+struct libusb_context;
+
+/// @brief Directory listing USB devices in sysfs.
+inline const std::filesystem::path SYSFS_USB_DEVICES{ "/sys/bus/usb/devices" };
+
 /// @brief List plugged USB devices.
+/// @details Reads sysfs and falls back to a temporary libusb context when
+/// sysfs is not available.
 /// @return List of USB vid:pid values of plugged devices.
 std::vector<usb_id>
 list_usb();
 
+/// @brief List plugged USB devices, falling back to an existing libusb
+/// context when sysfs is not available.
+/// @param ctx libusb context to enumerate with.
+/// @return List of USB vid:pid values of plugged devices.
+std::vector<usb_id>
+list_usb(libusb_context* ctx);
+
+/// @brief List USB devices from the idVendor and idProduct attributes in
+/// sysfs.
+/// @param root sysfs USB device directory, usually SYSFS_USB_DEVICES.
+/// @param devices list the found devices are appended to.
+/// @return true if any device was found.
+bool
+list_usb_sysfs(const std::filesystem::path& root, std::vector<usb_id>& devices);
+
+/// @brief List USB devices in sysfs with their ports and serial numbers.
+/// @param root sysfs USB device directory, usually SYSFS_USB_DEVICES.
+/// @param devices list the found devices are appended to.
+/// @return true if any device was found.
+bool
+list_usb_sysfs(const std::filesystem::path& root,
+               std::vector<USBDeviceInstance>& devices);
+
+/// @brief Parse a port from its sysfs name.
+/// @param name sysfs name of a USB device, e.g. 1-1.4 or usb1 for a root
+/// hub.
+/// @return the port, empty if name isn't a device name.
+USBPort
+parse_usb_port(std::string_view name);
+
+/// @brief Read the serial number of a device from sysfs.
+/// @param root sysfs USB device directory, usually SYSFS_USB_DEVICES.
+/// @param port port of the device.
+/// @return the serial number, empty if the device has none.
+std::string
+read_usb_serial(const std::filesystem::path& root, const USBPort& port);
+
+/// @brief List USB devices with libusb.
+/// @param ctx libusb context to enumerate with.
+/// @return List of USB vid:pid values of plugged devices.
+std::vector<usb_id>
+list_usb_libusb(libusb_context* ctx);
+
 /// @brief Create a USB id from string
 /// @param id USB VID_PID string
-/// @return usb_id struct
+/// @return usb_id struct, 0000:0000 if id is malformed. See parse_usb_id for
+/// error reporting.
 usb_id
 usb_id_from_string(const std::string& id);
 
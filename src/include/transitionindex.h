@@ -0,0 +1,131 @@
+#ifndef TRANSITIONINDEX_H_
+#define TRANSITIONINDEX_H_
+
+#include "weekschedule.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+/// @brief Sweep-line index over the periods of every device in a schedule.
+/// @details Each maximal run of marked minutes of a device becomes one
+/// interval. The start and end of every interval are kept in a timeline
+/// sorted by minute, and the intervals are stored in a segment tree over the
+/// minutes of the week. Finding the devices required at a minute takes
+/// O(log n + k) and finding the next transition O(log n), where n is the
+/// number of transitions and k the number of devices reported. The intervals
+/// are also kept as a structure of arrays of 16-bit minutes, which
+/// required_bitmap scans with vector compares to evaluate every device at
+/// once.
+class TransitionIndex
+{
+  public:
+    /// @brief A device whose marking changes at a minute.
+    struct Transition
+    {
+        uint16_t minute;
+        /// @brief True if the device is required from minute on, false if
+        /// it no longer is.
+        bool required;
+        /// @brief Index of the device in schedule().
+        uint32_t device;
+    };
+
+    TransitionIndex() = default;
+    explicit TransitionIndex(CompiledSchedule schedule);
+
+    /// @brief The indexed schedule.
+    const CompiledSchedule& schedule() const { return m_schedule; }
+
+    /// @brief Add a device, indexing only its own periods.
+    /// @return index of the device in schedule().
+    std::size_t add(DeviceSchedule device);
+
+    /// @brief Add devices after the last one, indexing only their own
+    /// periods.
+    void add(CompiledSchedule devices);
+
+    /// @brief Remove devices, moving the later ones down to close the gaps.
+    /// @details A single pass over the index renumbers the remaining
+    /// devices, no WeekMask is scanned again.
+    /// @param devices indexes into schedule().
+    void remove(std::vector<uint32_t> devices);
+
+    /// @brief Check if any device required at a minute satisfies pred.
+    /// @param minute minute of the week.
+    /// @param pred called with the DeviceSchedule of required devices until
+    /// it returns true.
+    template<typename Predicate>
+    bool any_required(std::size_t minute, Predicate pred) const
+    {
+        for (auto node = m_leaf(minute); node > 0; node /= 2) {
+            const auto devices = m_nodes.find(node);
+            if (devices == m_nodes.end()) {
+                continue;
+            }
+            for (const auto device : devices->second) {
+                if (pred(m_schedule[device])) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /// @brief List the devices required at a minute.
+    /// @param minute minute of the week.
+    /// @return indexes into schedule() in ascending order.
+    std::vector<uint32_t> required_at(std::size_t minute) const;
+
+    /// @brief Mark the devices required at a minute in a bitmap.
+    /// @details Scans every interval, 16 at a time with AVX2 or 8 with SSE2,
+    /// without touching the per-device WeekMasks.
+    /// @param minute minute of the week.
+    /// @param bitmap resized to one bit per device in schedule(), bit i % 64
+    /// of word i / 64 is set if device i is required.
+    void required_bitmap(std::size_t minute,
+                         std::vector<uint64_t>& bitmap) const;
+
+    /// @brief Find the next minute where any device changes.
+    /// @param minute minute of the week to start from.
+    /// @return Number of minutes until the next transition after minute, or
+    /// MINUTES_PER_WEEK if no device ever changes.
+    std::size_t next_transition(std::size_t minute) const;
+
+    /// @brief Get the transitions happening at a minute.
+    std::span<const Transition> transitions_at(std::size_t minute) const;
+
+  private:
+    /// @brief Number of leaves of the segment tree, one for every minute.
+    static constexpr std::size_t LEAVES = std::bit_ceil(MINUTES_PER_WEEK);
+
+    CompiledSchedule m_schedule;
+    /// @brief Transitions of every device sorted by minute.
+    std::vector<Transition> m_timeline;
+    /// @brief Intervals [begin, end) of every device as parallel arrays.
+    struct Intervals
+    {
+        std::vector<uint16_t> begins;
+        std::vector<uint16_t> ends;
+        std::vector<uint32_t> devices;
+    };
+
+    Intervals m_intervals;
+    /// @brief Devices of the intervals stored in each segment tree node.
+    /// Only nodes holding an interval are present.
+    std::unordered_map<uint32_t, std::vector<uint32_t>> m_nodes;
+
+    static std::size_t m_leaf(std::size_t minute)
+    {
+        return LEAVES + minute % MINUTES_PER_WEEK;
+    }
+    void m_index(uint32_t device);
+    /// @brief Merge the transitions appended from indexed on into the
+    /// timeline.
+    void m_merge(std::size_t indexed);
+    void m_insert(std::size_t begin, std::size_t end, uint32_t device);
+};
+
+#endif // TRANSITIONINDEX_H_
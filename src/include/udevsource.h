@@ -0,0 +1,68 @@
+#ifndef UDEVSOURCE_H_
+#define UDEVSOURCE_H_
+
+#include "devicesource.h"
+#include <atomic>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct udev;
+struct udev_monitor;
+
+/// @brief Parse the PRODUCT property of a USB device uevent.
+/// @param product the property value, vid/pid/bcdDevice in hex without
+/// leading zeros, e.g. 46d/c52b/1201.
+/// @param id set to the vid:pid of the device.
+/// @return false if product is malformed.
+bool
+usb_id_from_uevent_product(std::string_view product, usb_id& id);
+
+/// @brief Device source backed by a udev netlink monitor.
+/// @details The monitor only subscribes to usb/usb_device uevents, so the
+/// socket filter drops the uevents of interfaces and other subsystems in the
+/// kernel before they wake up the source thread. The vid:pid is read from
+/// the uevent properties, devices are never opened. Connected devices are
+/// enumerated from sysfs.
+class UdevSource : public DeviceSource
+{
+  public:
+    UdevSource() = default;
+    ~UdevSource() override;
+
+    std::vector<usb_id> enumerate() override;
+    std::vector<USBDeviceInstance> enumerate_instances() override;
+    bool start(USBTracker& tracker) override;
+    void stop() override;
+    void join() override;
+
+    /// @brief Deliver only the events of the wanted vid:pid ids.
+    /// @details udev can't filter by vid:pid in the kernel, unwanted events
+    /// are dropped on the source thread before they reach the tracker.
+    void set_filter(const std::vector<uint32_t>& wanted,
+                    bool match_any) override;
+
+  private:
+    std::thread m_thread;
+    std::atomic<bool> m_running{ false };
+    USBTracker* m_tracker{ nullptr };
+    udev* m_udev{ nullptr };
+    udev_monitor* m_monitor{ nullptr };
+    /// @brief epoll set of the monitor socket and m_stop_fd.
+    int m_epoll_fd{ -1 };
+    /// @brief eventfd signaled by stop.
+    int m_stop_fd{ -1 };
+
+    /// @brief Guards m_wanted and m_match_any.
+    std::mutex m_filter_mtx;
+    /// @brief Sorted packed vid:pid ids delivered to the tracker.
+    std::vector<uint32_t> m_wanted;
+    bool m_match_any{ false };
+
+    void m_event_loop();
+    void m_receive();
+    bool m_is_wanted(const usb_id& id);
+};
+
+#endif // UDEVSOURCE_H_
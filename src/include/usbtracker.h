@@ -1,43 +1,272 @@
 #ifndef USBTRACKER_H_
 #define USBTRACKER_H_
 
+#include "awaitable.h"
+#include "connectedset.h"
+#include "devicesource.h"
+#include "eventqueue.h"
 #include "tools.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <unistd.h>
 #include <vector>
 
+/// @brief Event loop measurements collected when measuring is enabled.
+struct USBTrackerStats
+{
+    /// @brief Number of times the tracker thread woke up.
+    uint64_t wakeups;
+    /// @brief Number of hotplug events handled.
+    uint64_t events;
+    /// @brief Time the statistics cover.
+    std::chrono::nanoseconds elapsed;
+    /// @brief Sum of wakeup-to-callback latencies of all events.
+    std::chrono::nanoseconds total_latency;
+    /// @brief Largest wakeup-to-callback latency.
+    std::chrono::nanoseconds max_latency;
+
+    double wakeups_per_second() const;
+    std::chrono::nanoseconds mean_latency() const;
+};
+
+/// @brief Identifies a subscription to a USBTracker.
+using SubscriptionId = uint64_t;
+
+/// @brief Device source a USBTracker uses when none is given.
+enum USBBackend
+{
+    /// @brief libusb hotplug callbacks, see LibusbSource.
+    LIBUSB_BACKEND = 0,
+    /// @brief udev netlink monitor, see UdevSource.
+    UDEV_BACKEND = 1,
+};
+
 class USBTracker
 {
   public:
-    USBTracker(){};
+    /// @brief Maximum number of undrained events before events are dropped.
+    static constexpr std::size_t EVENT_QUEUE_SIZE = 1024;
+
+    /// @brief Create a tracker fed by the default backend, see
+    /// set_default_backend.
+    USBTracker();
+    /// @brief Create a tracker fed by a backend.
+    explicit USBTracker(USBBackend backend);
+    /// @brief Create a tracker fed by another device source.
+    /// @param source source of the connected devices and hotplug events.
+    explicit USBTracker(std::unique_ptr<DeviceSource> source);
     ~USBTracker();
 
+    /// @brief Get the process-wide tracker, starting it if needed.
+    /// @details All holders share one tracker thread and one connected
+    /// device set. Tracking stops when the last reference is released.
+    /// @return Reference to the shared tracker.
+    static std::shared_ptr<USBTracker> shared();
+
+    /// @brief Set the backend of trackers created without one, including
+    /// the shared tracker when it is created next. LIBUSB_BACKEND by default.
+    static void set_default_backend(USBBackend backend);
+
+    /// @brief Subscribe to hotplug events of a set of devices.
+    /// @param devices the devices the subscriber is interested in.
+    /// @param callback called on the tracker thread for every hotplug event
+    /// of the devices, without any tracker lock held, so it may subscribe
+    /// and unsubscribe.
+    /// @return id of the subscription, passed to unsubscribe.
+    SubscriptionId subscribe(const std::vector<usb_id>& devices,
+                             std::function<void(const USBEvent&)> callback);
+
+    /// @brief Replace the device set of a subscription.
+    /// @details The connected state of ids whose events were filtered out
+    /// until now is refreshed from the device source before this returns.
+    void update_subscription(SubscriptionId id,
+                             const std::vector<usb_id>& devices);
+
+    /// @brief Remove a subscription. The callback is not running and will not
+    /// be called once this returns, except when called from a callback,
+    /// which doesn't wait for itself.
+    void unsubscribe(SubscriptionId id);
+
+    /// @brief Receive hotplug events of every device.
+    /// @details While anything is subscribed, the tracker asks its device
+    /// source for the events of the subscribed vid:pid ids only, so events
+    /// of other devices are dropped before they reach the tracker. How early
+    /// depends on the source: libusb still wakes its event thread for every
+    /// uevent and only skips the callbacks. When an id is subscribed again,
+    /// the source lists the connected devices to refresh its connected
+    /// state. A tracker without subscriptions receives every event. Enable
+    /// to track every device while subscribed.
+    /// @param enabled true to receive events of every device.
+    void set_match_any(bool enabled);
+
     void start_tracking();
     void stop_tracking();
 
     void handle_device_add_event(const usb_id& dev);
     void handle_device_remove_event(const usb_id& dev);
+
+    /// @brief Add a connected device instance.
+    /// @details An instance already known at the same port is not added
+    /// again, so a device the startup enumeration and a hotplug event both
+    /// report is counted once.
+    void handle_device_add_event(const USBDeviceInstance& dev);
+
+    /// @brief Remove a device instance.
+    /// @details Removes the instance at the port of dev, or one instance of
+    /// its vid:pid if the port is unknown. Other instances of the vid:pid stay
+    /// connected.
+    void handle_device_remove_event(const USBDeviceInstance& dev);
     bool is_running() const;
+    /// @brief Wait until the device source runs out of events.
     void join_thread();
 
+    /// @brief Called by the device source every time its thread wakes up,
+    /// before it delivers the events it woke up for.
+    void note_wakeup();
+
     /// @brief Returns True if the device is connected via USB.
     /// @param device_id The vid:pid (USB vendor and product ID) of the device.
+    /// @details Never takes a lock, safe to call at a high rate from any
+    /// thread while the tracker thread handles events.
     /// @return true if the device is connected.
-    bool usb_id_is_connected(const usb_id& device_id);
+    bool usb_id_is_connected(const usb_id& device_id) const;
+
+    /// @brief Returns True if a configured device is connected.
+    /// @details Devices that aren't pinned to a port or serial number are
+    /// looked up like usb_id_is_connected. Pinned devices are matched against
+    /// the connected instances, which never takes a lock either.
+    bool is_connected(const USBDevice& device) const;
+
+    /// @brief List the connected device instances.
+    std::vector<USBDeviceInstance> connected_devices() const;
 
     void set_device_event_cb(std::function<void(void*)> callback);
 
     void set_event_cb_data(void* data);
 
+    /// @brief Set the executor next_event resumes coroutines with. Set it
+    /// before awaiting.
+    void set_executor(Executor executor);
+
+    /// @brief Wait for a hotplug event in a coroutine, e.g.
+    /// co_await tracker.next_event(devices).
+    /// @details The coroutine is resumed through the executor from the
+    /// device source thread. Like subscriber callbacks, only events of
+    /// subscribed ids are delivered while anything is subscribed, unless
+    /// set_match_any is enabled. Destroy
+    /// waiting coroutines before the tracker.
+    /// @param filter the devices to wait for, any device if empty.
+    /// @return awaitable resuming with the event.
+    WaitList<USBEvent>::Awaiter next_event(std::vector<usb_id> filter = {});
+
+    /// @brief Wait for a hotplug event of a single device in a coroutine.
+    WaitList<USBEvent>::Awaiter next_event(const usb_id& device);
+
+    /// @brief Get a file descriptor that is readable while hotplug events are
+    /// waiting to be drained.
+    int event_fd() const;
+
+    /// @brief Move queued hotplug events to events, oldest first.
+    /// @details Only one thread may drain events at a time. The tracker
+    /// thread never waits for the consumer; if the queue fills up, new events
+    /// are dropped and counted in dropped_events.
+    /// @param events vector the events are appended to.
+    /// @param max_events maximum number of events to move.
+    /// @return Number of events moved.
+    std::size_t drain_events(std::vector<USBEvent>& events,
+                             std::size_t max_events = EVENT_QUEUE_SIZE);
+
+    /// @brief Number of hotplug events dropped because the queue was full.
+    uint64_t dropped_events() const;
+
+    /// @brief Enable or disable measuring the event loop. Enabling resets
+    /// the collected statistics.
+    /// @details Latency is measured from the moment the device source thread
+    /// wakes up with pending events to the moment the device event callback
+    /// is called.
+    void set_measure(bool enabled);
+
+    /// @brief Get the statistics collected since measuring was enabled.
+    USBTrackerStats stats() const;
+
   private:
-    std::vector<usb_id> m_connected_devices;
-    std::thread m_thread;
-    std::atomic<bool> m_running;
-    void* m_user_data;
+    ConnectedSet m_connected_devices;
+    std::unique_ptr<DeviceSource> m_source;
+    std::atomic<bool> m_running{ false };
+    void* m_user_data{ nullptr };
     std::function<void(void*)> m_callback;
+    /// @brief Connected instances, replaced as a whole on every change.
+    std::atomic<std::shared_ptr<const std::vector<USBDeviceInstance>>>
+      m_instances{ std::make_shared<const std::vector<USBDeviceInstance>>() };
+    /// @brief Serializes writers of m_connected_devices and m_instances.
     std::mutex m_mtx;
+    /// @brief Number of changes to m_instances, guarded by m_mtx.
+    uint64_t m_changes{ 0 };
+    EventQueue<USBEvent, EVENT_QUEUE_SIZE> m_event_queue;
+    /// @brief Coroutines waiting in next_event.
+    WaitList<USBEvent> m_event_waiters;
+    Executor m_executor;
+    /// @brief eventfd signaled when an event is queued.
+    int m_event_fd{ -1 };
+
+    /// @brief Orders the filter updates passed to m_source.
+    std::mutex m_filter_mtx;
+    std::atomic<bool> m_match_any{ false };
+    /// @brief True if the source delivered the events of every device since
+    /// the last enumeration, else the sorted ids it delivered in m_tracked.
+    /// Guarded by m_filter_mtx.
+    bool m_tracked_all{ true };
+    std::vector<uint32_t> m_tracked;
+
+    std::atomic<bool> m_measure{ false };
+    std::atomic<uint64_t> m_wakeups{ 0 };
+    std::atomic<uint64_t> m_events{ 0 };
+    std::atomic<int64_t> m_total_latency_ns{ 0 };
+    std::atomic<int64_t> m_max_latency_ns{ 0 };
+    std::chrono::steady_clock::time_point m_measure_start;
+    std::chrono::steady_clock::time_point m_wake_time;
+
+    struct Subscription
+    {
+        std::vector<usb_id> devices;
+        std::shared_ptr<const std::function<void(const USBEvent&)>> callback;
+    };
+
+    /// @brief Guards the subscription maps and m_running_callbacks. Released
+    /// while callbacks run.
+    std::mutex m_subscription_mtx;
+    /// @brief Subscriptions whose callback is running, with the thread
+    /// running it.
+    std::vector<std::pair<SubscriptionId, std::thread::id>>
+      m_running_callbacks;
+    /// @brief Signaled when a callback returns.
+    std::condition_variable m_callback_done;
+    SubscriptionId m_next_subscription{ 1 };
+    std::map<SubscriptionId, Subscription> m_subscriptions;
+    /// @brief Subscriptions interested in each packed vid:pid.
+    std::unordered_map<uint32_t, std::vector<SubscriptionId>> m_subscribers;
+
+    void m_record_event();
+    /// @brief Lock m_mtx, recording the wait in LOCK_WAIT.
+    void m_lock();
+    void m_handle_event(const usb_id& dev, USBEventType type);
+    /// @brief Deliver a hotplug event to the callbacks.
+    void m_notify(const usb_id& dev, USBEventType type);
+    void m_sync_filter();
+    /// @brief Replace the connected state of some ids with a new listing
+    /// from the source.
+    /// @param keys sorted packed vid:pid ids.
+    /// @param except true to refresh every id but keys.
+    void m_refresh(const std::vector<uint32_t>& keys, bool except);
+    void m_index_subscription(SubscriptionId id);
+    void m_unindex_subscription(SubscriptionId id);
 };
 
 #endif // USBTRACKER_H_
\ No newline at end of file
@@ -0,0 +1,164 @@
+#ifndef WEEKSCHEDULE_H
+#define WEEKSCHEDULE_H
+
+#include "tools.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// @brief Number of minutes in a day.
+inline constexpr std::size_t MINUTES_PER_DAY = 24 * 60;
+/// @brief Number of minutes in a week.
+inline constexpr std::size_t MINUTES_PER_WEEK = 7 * MINUTES_PER_DAY;
+
+/// @brief Bitmap with one bit for every minute of a week.
+/// @details Minute 0 is Sunday 00:00 local time, matching the C encoding of
+/// std::chrono::weekday.
+class WeekMask
+{
+  public:
+    /// @brief Mark a single minute of the week.
+    constexpr void set(std::size_t minute)
+    {
+        minute %= MINUTES_PER_WEEK;
+        m_words[minute / 64] |= uint64_t{ 1 } << (minute % 64);
+    }
+
+    /// @brief Mark the minutes [begin, end). The range wraps around the end
+    /// of the week, so Saturday 22:00 - Sunday 02:00 is a valid range.
+    constexpr void set_range(std::size_t begin, std::size_t end)
+    {
+        if (end < begin) {
+            set_range(begin, MINUTES_PER_WEEK);
+            set_range(0, end);
+            return;
+        }
+        if (begin >= MINUTES_PER_WEEK) {
+            set_range(begin - MINUTES_PER_WEEK, end - MINUTES_PER_WEEK);
+            return;
+        }
+        if (end > MINUTES_PER_WEEK) {
+            set_range(begin, MINUTES_PER_WEEK);
+            set_range(0, end - MINUTES_PER_WEEK);
+            return;
+        }
+
+        while (begin < end) {
+            const auto bit = begin % 64;
+            const auto count = std::min<std::size_t>(64 - bit, end - begin);
+            const auto bits =
+              count == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << count) - 1;
+            m_words[begin / 64] |= bits << bit;
+            begin += count;
+        }
+    }
+
+    /// @brief Check if a minute of the week is marked.
+    constexpr bool test(std::size_t minute) const
+    {
+        minute %= MINUTES_PER_WEEK;
+        return (m_words[minute / 64] >> (minute % 64)) & 1;
+    }
+
+    /// @brief Find the next minute where the marking changes.
+    /// @param minute minute of the week to start from.
+    /// @return Number of minutes from minute until the first minute whose
+    /// marking differs from minute, or MINUTES_PER_WEEK if it never changes.
+    constexpr std::size_t next_change(std::size_t minute) const
+    {
+        minute %= MINUTES_PER_WEEK;
+        const uint64_t flip = test(minute) ? ~uint64_t{ 0 } : 0;
+
+        for (std::size_t offset = 1; offset < MINUTES_PER_WEEK;) {
+            const auto pos = (minute + offset) % MINUTES_PER_WEEK;
+            const auto bit = pos % 64;
+            const auto valid =
+              std::min<std::size_t>(64 - bit, MINUTES_PER_WEEK - pos);
+
+            auto changed = (m_words[pos / 64] ^ flip) >> bit;
+            if (valid < 64) {
+                changed &= (uint64_t{ 1 } << valid) - 1;
+            }
+            if (changed) {
+                return std::min<std::size_t>(
+                  offset + std::countr_zero(changed), MINUTES_PER_WEEK);
+            }
+            offset += valid;
+        }
+        return MINUTES_PER_WEEK;
+    }
+
+    /// @brief Check if any minute is marked.
+    constexpr bool any() const
+    {
+        for (auto word : m_words) {
+            if (word) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    constexpr bool operator==(const WeekMask& rhs) const = default;
+
+  private:
+    std::array<uint64_t, (MINUTES_PER_WEEK + 63) / 64> m_words{};
+};
+
+/// @brief Time period within a day in minutes since midnight, e.g. 20:00 -
+/// 24:00 is { 1200, 1440 }. A span that ends before it starts continues past
+/// midnight into the next day.
+struct MinuteSpan
+{
+    uint16_t start;
+    uint16_t end;
+
+    constexpr bool operator==(const MinuteSpan& rhs) const = default;
+};
+
+/// @brief Mark the minutes covered by spans starting on a day.
+/// @param mask the WeekMask to modify.
+/// @param weekday day the spans start on, 0 is Sunday.
+/// @param spans first span.
+/// @param count number of spans.
+constexpr void
+add_spans(WeekMask& mask,
+          unsigned weekday,
+          const MinuteSpan* spans,
+          std::size_t count)
+{
+    const auto day_start = weekday * MINUTES_PER_DAY;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        const auto& span = spans[i];
+        if (span.start == span.end) {
+            continue;
+        }
+        const auto next_day = span.end < span.start ? MINUTES_PER_DAY : 0;
+        mask.set_range(day_start + span.start,
+                       day_start + span.end + next_day);
+    }
+}
+
+/// @brief A configured device and the minutes it should be plugged in.
+struct DeviceSchedule
+{
+    USBDevice device;
+    WeekMask mask;
+};
+
+/// @brief Schedule of every configured device, compiled from the config.
+using CompiledSchedule = std::vector<DeviceSchedule>;
+
+/// @brief Get the minute of the week for a time point in local time.
+/// @param now the time point.
+/// @return minutes since Sunday 00:00 local time.
+std::size_t
+minute_of_week(const std::chrono::system_clock::time_point& now);
+
+#endif /* WEEKSCHEDULE_H */
@@ -0,0 +1,533 @@
+#include "journal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr uint32_t JOURNAL_MAGIC = 0x524a4242; // "BBJR"
+static constexpr uint32_t JOURNAL_VERSION = 1;
+
+/// @brief File layout, followed by capacity records.
+struct JournalHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    /// @brief Number of written records, stored after the record.
+    uint64_t count;
+    /// @brief Records dropped because the file was full.
+    uint64_t dropped;
+    /// @brief Time of the last record, later records are clamped to it to
+    /// keep the records sorted.
+    int64_t last_time;
+    uint64_t reserved[3];
+};
+static_assert(sizeof(JournalRecord) == 16);
+
+static std::size_t
+file_size(std::size_t capacity)
+{
+    return sizeof(JournalHeader) + capacity * sizeof(JournalRecord);
+}
+
+static int64_t
+to_nanoseconds(const Journal::time_point& tp)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             tp.time_since_epoch())
+      .count();
+}
+
+static std::size_t
+index_home(uint32_t key)
+{
+    return static_cast<std::size_t>((key * 0x9e3779b97f4a7c15ull) >> 32) &
+           (Journal::INDEX_SLOTS - 1);
+}
+
+static uint64_t
+load(const uint64_t& word)
+{
+    return std::atomic_ref(const_cast<uint64_t&>(word))
+      .load(std::memory_order_acquire);
+}
+
+std::chrono::system_clock::time_point
+JournalRecord::time_point() const
+{
+    return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::nanoseconds(time)));
+}
+
+Journal::~Journal()
+{
+    flush();
+    m_unmap();
+}
+
+bool
+Journal::open(const std::filesystem::path& path)
+{
+    std::lock_guard write_lock(m_write_mtx);
+    std::unique_lock map_lock(m_map_mtx);
+
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error opening journal " << path << "\n";
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        std::cerr << "Error, journal " << path << " is used by another "
+                  << "process\n";
+        ::close(fd);
+        return false;
+    }
+
+    struct stat st;
+    JournalHeader header{};
+    const bool readable =
+      fstat(fd, &st) == 0 &&
+      static_cast<std::size_t>(st.st_size) >= sizeof(JournalHeader) &&
+      pread(fd, &header, sizeof(header), 0) == sizeof(header);
+    const bool valid = readable && header.magic == JOURNAL_MAGIC &&
+                       header.version == JOURNAL_VERSION &&
+                       header.count <= header.capacity &&
+                       static_cast<std::size_t>(st.st_size) >=
+                         file_size(header.capacity);
+    if (readable && !valid) {
+        std::cerr << "Error in journal " << path << ", starting over\n";
+    }
+
+    const auto capacity = valid ? header.capacity : INITIAL_CAPACITY;
+    if (!valid && (ftruncate(fd, 0) != 0 ||
+                   ftruncate(fd, file_size(capacity)) != 0)) {
+        std::cerr << "Error resizing journal " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+
+    m_unmap();
+    if (!m_map(fd, capacity)) {
+        std::cerr << "Error mapping journal " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+    m_path = path;
+    if (!valid) {
+        *m_header = JournalHeader{};
+        m_header->magic = JOURNAL_MAGIC;
+        m_header->version = JOURNAL_VERSION;
+        m_header->capacity = capacity;
+    }
+    m_reindex();
+    m_last_compaction = std::chrono::steady_clock::now();
+    return true;
+}
+
+void
+Journal::record_device(const usb_id& id, bool connected, const time_point& at)
+{
+    m_push(JournalRecord{ to_nanoseconds(at),
+                          id.packed(),
+                          connected ? JOURNAL_CONNECTED : JOURNAL_DISCONNECTED,
+                          {} });
+}
+
+void
+Journal::record_alarm(bool alarm, const time_point& at)
+{
+    m_push(JournalRecord{ to_nanoseconds(at),
+                          0,
+                          alarm ? JOURNAL_ALARM_ON : JOURNAL_ALARM_OFF,
+                          {} });
+}
+
+void
+Journal::flush()
+{
+    std::lock_guard lock(m_write_mtx);
+    m_write_queued();
+}
+
+void
+Journal::m_push(const JournalRecord& record)
+{
+    if (!is_open()) {
+        return;
+    }
+    m_queue.push(record);
+    // Whoever holds the lock is writing, it or the next writer picks the
+    // record up.
+    if (m_write_mtx.try_lock()) {
+        m_write_queued();
+        m_write_mtx.unlock();
+    }
+}
+
+void
+Journal::m_write_queued()
+{
+    if (!m_header) {
+        return;
+    }
+    m_queue.drain([this](JournalRecord record) {
+        const auto count = m_header->count;
+        if (count == m_capacity) {
+            std::atomic_ref(m_header->dropped)
+              .fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        record.time = std::max(record.time, m_header->last_time);
+        m_records[count] = record;
+        m_index(count);
+        m_header->last_time = record.time;
+        std::atomic_ref(m_header->count)
+          .store(count + 1, std::memory_order_release);
+    });
+}
+
+std::vector<JournalRecord>
+Journal::range(const time_point& from, const time_point& to)
+{
+    flush();
+    std::shared_lock lock(m_map_mtx);
+    std::vector<JournalRecord> records;
+    if (!m_header) {
+        return records;
+    }
+
+    const auto count = load(m_header->count);
+    const auto end = to_nanoseconds(to);
+    for (auto i = m_lower_bound(to_nanoseconds(from), count);
+         i < count && m_records[i].time < end;
+         ++i) {
+        records.push_back(m_records[i]);
+    }
+    return records;
+}
+
+std::chrono::nanoseconds
+Journal::disconnected_time(const usb_id& id,
+                           const time_point& from,
+                           const time_point& to)
+{
+    return m_time_in(id.packed(), JOURNAL_DISCONNECTED, from, to);
+}
+
+std::chrono::nanoseconds
+Journal::alarm_time(const time_point& from, const time_point& to)
+{
+    return m_time_in(0, JOURNAL_ALARM_ON, from, to);
+}
+
+/// @details The records of the key in the range are walked back from the
+/// last one through the index, which leads to the record before the range
+/// that sets the state at its start. Compaction keeps that one.
+std::chrono::nanoseconds
+Journal::m_time_in(uint32_t key,
+                   JournalEvent on,
+                   const time_point& from,
+                   const time_point& to)
+{
+    flush();
+    std::shared_lock lock(m_map_mtx);
+    if (!m_header) {
+        return std::chrono::nanoseconds{ 0 };
+    }
+
+    const auto count = load(m_header->count);
+    const auto start = to_nanoseconds(from);
+    const auto end = to_nanoseconds(to);
+    const auto first = m_lower_bound(start, count);
+
+    const auto slot = m_find_slot(key);
+    if (m_last[slot].load(std::memory_order_acquire) == 0) {
+        if (m_index_full) {
+            return m_scan_time_in(key, on, start, end, first, count);
+        }
+        return std::chrono::nanoseconds{ 0 };
+    }
+
+    int64_t total = 0;
+    auto next = end;
+    auto last = m_last_before(slot, m_lower_bound(end, count), count);
+    for (; last > first; last = m_previous[last - 1]) {
+        const auto& record = m_records[last - 1];
+        if (record.event == on) {
+            total += next - record.time;
+        }
+        next = record.time;
+    }
+    if (last > 0 && m_records[last - 1].event == on) {
+        total += next - start;
+    }
+    return std::chrono::nanoseconds(total);
+}
+
+std::chrono::nanoseconds
+Journal::m_scan_time_in(uint32_t key,
+                        JournalEvent on,
+                        int64_t start,
+                        int64_t end,
+                        std::size_t first,
+                        std::size_t count) const
+{
+    bool in_state = false;
+    for (auto j = first; j > 0; --j) {
+        if (m_records[j - 1].key == key) {
+            in_state = m_records[j - 1].event == on;
+            break;
+        }
+    }
+
+    int64_t total = 0;
+    auto since = start;
+    for (auto i = first; i < count && m_records[i].time < end; ++i) {
+        if (m_records[i].key != key) {
+            continue;
+        }
+        if (in_state) {
+            total += m_records[i].time - since;
+        }
+        since = m_records[i].time;
+        in_state = m_records[i].event == on;
+    }
+    if (in_state && end > since) {
+        total += end - since;
+    }
+    return std::chrono::nanoseconds(total);
+}
+
+bool
+Journal::compact(const time_point& before)
+{
+    std::lock_guard write_lock(m_write_mtx);
+    m_write_queued();
+    if (!m_header) {
+        return false;
+    }
+
+    const auto count = m_header->count;
+    const auto split = m_lower_bound(to_nanoseconds(before), count);
+    std::map<uint32_t, JournalRecord> last;
+    for (std::size_t i = 0; i < split; ++i) {
+        last[m_records[i].key] = m_records[i];
+    }
+    std::vector<JournalRecord> kept;
+    kept.reserve(last.size() + count - split);
+    for (const auto& [key, record] : last) {
+        kept.push_back(record);
+    }
+    std::sort(kept.begin(), kept.end(), [](const auto& a, const auto& b) {
+        return a.time < b.time;
+    });
+    kept.insert(kept.end(), m_records + split, m_records + count);
+
+    const auto capacity = std::max(INITIAL_CAPACITY, 2 * kept.size());
+    auto temporary = m_path;
+    temporary += ".tmp";
+    const int fd =
+      ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) != 0 ||
+        ftruncate(fd, file_size(capacity)) != 0) {
+        std::cerr << "Error creating compacted journal " << temporary << "\n";
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+
+    JournalHeader header = *m_header;
+    header.capacity = capacity;
+    header.count = kept.size();
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(fd,
+               kept.data(),
+               kept.size() * sizeof(JournalRecord),
+               sizeof(JournalHeader)) !=
+          static_cast<ssize_t>(kept.size() * sizeof(JournalRecord)) ||
+        fdatasync(fd) != 0 || rename(temporary.c_str(), m_path.c_str()) != 0) {
+        std::cerr << "Error writing compacted journal " << temporary << "\n";
+        ::close(fd);
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    std::unique_lock map_lock(m_map_mtx);
+    m_unmap();
+    if (!m_map(fd, capacity)) {
+        std::cerr << "Error mapping journal " << m_path << "\n";
+        ::close(fd);
+        return false;
+    }
+    m_reindex();
+    m_last_compaction = std::chrono::steady_clock::now();
+    return true;
+}
+
+void
+Journal::maintain(const time_point& now,
+                  std::chrono::seconds retention,
+                  std::chrono::seconds interval)
+{
+    if (!is_open()) {
+        return;
+    }
+    std::shared_lock lock(m_map_mtx);
+    const bool due =
+      std::chrono::steady_clock::now() - m_last_compaction >= interval ||
+      2 * load(m_header->count) > m_capacity;
+    lock.unlock();
+    if (due) {
+        compact(now - retention);
+    }
+}
+
+std::size_t
+Journal::size() const
+{
+    std::shared_lock lock(m_map_mtx);
+    return m_header ? load(m_header->count) : 0;
+}
+
+uint64_t
+Journal::dropped() const
+{
+    std::shared_lock lock(m_map_mtx);
+    const auto file_dropped = m_header ? load(m_header->dropped) : 0;
+    return m_queue.dropped() + file_dropped;
+}
+
+bool
+Journal::m_map(int fd, std::size_t capacity)
+{
+    void* map = mmap(
+      nullptr, file_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    m_fd = fd;
+    m_open = true;
+    m_capacity = capacity;
+    m_header = static_cast<JournalHeader*>(map);
+    m_records = reinterpret_cast<JournalRecord*>(m_header + 1);
+    return true;
+}
+
+void
+Journal::m_unmap()
+{
+    if (m_fd < 0) {
+        return;
+    }
+    msync(m_header, file_size(m_capacity), MS_SYNC);
+    munmap(m_header, file_size(m_capacity));
+    ::close(m_fd);
+    m_fd = -1;
+    m_open = false;
+    m_header = nullptr;
+    m_records = nullptr;
+    m_capacity = 0;
+}
+
+std::size_t
+Journal::m_lower_bound(int64_t time, std::size_t count) const
+{
+    const auto found = std::lower_bound(
+      m_records,
+      m_records + count,
+      time,
+      [](const JournalRecord& record, int64_t t) { return record.time < t; });
+    return static_cast<std::size_t>(found - m_records);
+}
+
+void
+Journal::m_reindex()
+{
+    for (auto& slot : m_last) {
+        slot.store(0, std::memory_order_relaxed);
+    }
+    m_indexed_keys = 0;
+    m_index_full = false;
+    m_previous.assign(m_capacity, 0);
+    m_checkpoints.assign((m_capacity / CHECKPOINT_INTERVAL + 1) * INDEX_SLOTS,
+                         0);
+    const auto count = m_header->count;
+    for (std::size_t i = 0; i < count; ++i) {
+        m_index(i);
+    }
+}
+
+/// @details Runs on the write path, so it only writes to what m_reindex
+/// allocated. The record and its link are written before the slot, which
+/// readers load with acquire.
+void
+Journal::m_index(std::size_t index)
+{
+    if (index % CHECKPOINT_INTERVAL == 0) {
+        auto checkpoint =
+          m_checkpoints.data() + index / CHECKPOINT_INTERVAL * INDEX_SLOTS;
+        for (const auto& slot : m_last) {
+            *checkpoint++ =
+              static_cast<uint32_t>(slot.load(std::memory_order_relaxed) >> 32);
+        }
+    }
+
+    const auto key = m_records[index].key;
+    const auto slot = m_find_slot(key);
+    const auto last = m_last[slot].load(std::memory_order_relaxed);
+    if (last == 0) {
+        if (4 * (m_indexed_keys + 1) > 3 * INDEX_SLOTS) {
+            m_index_full = true;
+            return;
+        }
+        m_indexed_keys++;
+    }
+    m_previous[index] = static_cast<uint32_t>(last >> 32);
+    m_last[slot].store((static_cast<uint64_t>(index + 1) << 32) | key,
+                       std::memory_order_release);
+}
+
+std::size_t
+Journal::m_find_slot(uint32_t key) const
+{
+    auto slot = index_home(key);
+    while (true) {
+        const auto value = m_last[slot].load(std::memory_order_acquire);
+        if (value == 0 || static_cast<uint32_t>(value) == key) {
+            return slot;
+        }
+        slot = (slot + 1) & (INDEX_SLOTS - 1);
+    }
+}
+
+/// @details The checkpoint at or after index, or the last record if there is
+/// none yet, is at most CHECKPOINT_INTERVAL records after index, so only the
+/// records of the key among those are walked back.
+uint32_t
+Journal::m_last_before(std::size_t slot,
+                       std::size_t index,
+                       std::size_t count) const
+{
+    const auto checkpoint =
+      (index + CHECKPOINT_INTERVAL - 1) / CHECKPOINT_INTERVAL;
+    uint32_t last;
+    if (checkpoint * CHECKPOINT_INTERVAL < count) {
+        last = m_checkpoints[checkpoint * INDEX_SLOTS + slot];
+    } else {
+        last = static_cast<uint32_t>(
+          m_last[slot].load(std::memory_order_acquire) >> 32);
+    }
+    while (last > index) {
+        last = m_previous[last - 1];
+    }
+    return last;
+}
@@ -0,0 +1,282 @@
+#include "libusbsource.h"
+#include "usbtracker.h"
+#include <algorithm>
+#include <iostream>
+
+#include <errno.h>
+#include <libusb-1.0/libusb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+int
+hotplug_callback(struct libusb_context* ctx [[maybe_unused]],
+                 struct libusb_device* dev,
+                 libusb_hotplug_event event,
+                 void* user_data)
+{
+    struct libusb_device_descriptor desc;
+
+    (void)libusb_get_device_descriptor(dev, &desc);
+
+    USBDeviceInstance instance{ .id = { .vid = desc.idVendor,
+                                        .pid = desc.idProduct } };
+    instance.port.bus = libusb_get_bus_number(dev);
+    const int depth = libusb_get_port_numbers(
+      dev, instance.port.ports.data(), instance.port.ports.size());
+    instance.port.depth = static_cast<uint8_t>(std::max(depth, 0));
+
+    auto tracker = static_cast<LibusbSource*>(user_data)->tracker();
+    if (!tracker) {
+        return 0;
+    }
+
+    if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
+        // Reading the serial string descriptor would open the device, the
+        // kernel already has it in sysfs.
+        instance.serial = read_usb_serial(SYSFS_USB_DEVICES, instance.port);
+        tracker->handle_device_add_event(instance);
+    } else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
+        tracker->handle_device_remove_event(instance);
+    } else {
+        std::cerr << "Unhandled event" << event << "\n";
+    }
+    return 0;
+}
+
+LibusbSource::~LibusbSource()
+{
+    stop();
+}
+
+USBTracker*
+LibusbSource::tracker() const
+{
+    return m_tracker;
+}
+
+std::vector<usb_id>
+LibusbSource::enumerate()
+{
+    std::lock_guard lock(m_hotplug_mtx);
+    if (!m_ctx && libusb_init(&m_ctx) != LIBUSB_SUCCESS) {
+        std::cerr << "Error initializing libusb\n";
+        m_ctx = nullptr;
+        return {};
+    }
+    return list_usb(m_ctx);
+}
+
+std::vector<USBDeviceInstance>
+LibusbSource::enumerate_instances()
+{
+    std::vector<USBDeviceInstance> devices;
+    if (list_usb_sysfs(SYSFS_USB_DEVICES, devices)) {
+        return devices;
+    }
+    return DeviceSource::enumerate_instances();
+}
+
+bool
+LibusbSource::start(USBTracker& tracker)
+{
+    std::unique_lock lock(m_hotplug_mtx);
+    if (!m_ctx && libusb_init(&m_ctx) != LIBUSB_SUCCESS) {
+        std::cerr << "Error initializing libusb\n";
+        m_ctx = nullptr;
+        return false;
+    }
+    m_tracker = &tracker;
+    m_running = true;
+    m_sync_hotplug_callbacks();
+    lock.unlock();
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    epoll_event stop_event{};
+    stop_event.events = EPOLLIN;
+    stop_event.data.fd = m_stop_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_stop_fd, &stop_event);
+
+    // libusb may add or remove descriptors later on, e.g. for timerfds.
+    libusb_set_pollfd_notifiers(m_ctx, m_pollfd_added, m_pollfd_removed, this);
+    const auto pollfds = libusb_get_pollfds(m_ctx);
+    for (auto pollfd = pollfds; pollfd && *pollfd; ++pollfd) {
+        m_pollfd_added((*pollfd)->fd, (*pollfd)->events, this);
+    }
+    libusb_free_pollfds(pollfds);
+
+    m_thread = std::thread(&LibusbSource::m_event_loop, this);
+    return true;
+}
+
+void
+LibusbSource::stop()
+{
+    m_running = false;
+    if (m_stop_fd >= 0) {
+        const uint64_t one = 1;
+        (void)!write(m_stop_fd, &one, sizeof(one));
+    }
+    if (m_thread.joinable())
+        m_thread.join();
+
+    m_exit();
+    m_tracker = nullptr;
+
+    for (auto fd : { m_stop_fd, m_epoll_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    m_stop_fd = -1;
+    m_epoll_fd = -1;
+}
+
+void
+LibusbSource::join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void
+LibusbSource::m_exit()
+{
+    std::lock_guard lock(m_hotplug_mtx);
+    if (m_ctx) {
+        libusb_set_pollfd_notifiers(m_ctx, nullptr, nullptr, nullptr);
+        for (const auto& [key, handle] : m_hotplug_handles) {
+            libusb_hotplug_deregister_callback(m_ctx, handle);
+        }
+        if (m_match_any_handle >= 0) {
+            libusb_hotplug_deregister_callback(m_ctx, m_match_any_handle);
+        }
+        libusb_exit(m_ctx);
+        m_ctx = nullptr;
+    }
+    m_hotplug_handles.clear();
+    m_match_any_handle = -1;
+}
+
+void
+LibusbSource::m_event_loop()
+{
+    constexpr int max_events = 8;
+    epoll_event events[max_events];
+    timeval zero{ .tv_sec = 0, .tv_usec = 0 };
+
+    while (m_running) {
+        // Block until libusb has work or stop is called. libusb may still
+        // need a wakeup for its own internal timeouts.
+        int timeout_ms = -1;
+        timeval next_timeout{};
+        if (libusb_get_next_timeout(m_ctx, &next_timeout) == 1) {
+            timeout_ms = static_cast<int>(next_timeout.tv_sec * 1000 +
+                                          (next_timeout.tv_usec + 999) / 1000);
+        }
+
+        const int count =
+          epoll_wait(m_epoll_fd, events, max_events, timeout_ms);
+        if (count < 0 && errno != EINTR) {
+            std::cerr << "Error waiting for USB events\n";
+            break;
+        }
+
+        m_tracker.load()->note_wakeup();
+        if (!m_running) {
+            break;
+        }
+        libusb_handle_events_timeout_completed(m_ctx, &zero, nullptr);
+    }
+}
+
+void
+LibusbSource::m_pollfd_added(int fd, short events, void* user_data)
+{
+    auto source = static_cast<LibusbSource*>(user_data);
+
+    epoll_event event{};
+    event.events = (events & POLLIN ? EPOLLIN : 0u) |
+                   (events & POLLOUT ? EPOLLOUT : 0u);
+    event.data.fd = fd;
+    epoll_ctl(source->m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void
+LibusbSource::m_pollfd_removed(int fd, void* user_data)
+{
+    auto source = static_cast<LibusbSource*>(user_data);
+    epoll_ctl(source->m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void
+LibusbSource::set_filter(const std::vector<uint32_t>& wanted, bool match_any)
+{
+    std::lock_guard lock(m_hotplug_mtx);
+    m_wanted = wanted;
+    m_match_any = match_any;
+    m_sync_hotplug_callbacks();
+}
+
+void
+LibusbSource::m_sync_hotplug_callbacks()
+{
+    if (!m_ctx || !m_running) {
+        return;
+    }
+
+    const auto events =
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
+
+    if (m_match_any && m_match_any_handle < 0) {
+        if (libusb_hotplug_register_callback(m_ctx,
+                                             events,
+                                             0,
+                                             LIBUSB_HOTPLUG_MATCH_ANY,
+                                             LIBUSB_HOTPLUG_MATCH_ANY,
+                                             LIBUSB_HOTPLUG_MATCH_ANY,
+                                             hotplug_callback,
+                                             this,
+                                             &m_match_any_handle) !=
+            LIBUSB_SUCCESS) {
+            std::cerr << "Error creating a hotplug callback\n";
+            m_match_any_handle = -1;
+        }
+    } else if (!m_match_any && m_match_any_handle >= 0) {
+        libusb_hotplug_deregister_callback(m_ctx, m_match_any_handle);
+        m_match_any_handle = -1;
+    }
+
+    const auto& wanted = m_match_any ? std::vector<uint32_t>{} : m_wanted;
+    std::erase_if(m_hotplug_handles, [this, &wanted](const auto& item) {
+        if (std::find(wanted.begin(), wanted.end(), item.first) !=
+            wanted.end()) {
+            return false;
+        }
+        libusb_hotplug_deregister_callback(m_ctx, item.second);
+        return true;
+    });
+
+    for (const auto key : wanted) {
+        if (m_hotplug_handles.contains(key)) {
+            continue;
+        }
+        libusb_hotplug_callback_handle handle;
+        if (libusb_hotplug_register_callback(m_ctx,
+                                             events,
+                                             0,
+                                             static_cast<int>(key >> 16),
+                                             static_cast<int>(key & 0xffff),
+                                             LIBUSB_HOTPLUG_MATCH_ANY,
+                                             hotplug_callback,
+                                             this,
+                                             &handle) != LIBUSB_SUCCESS) {
+            std::cerr << "Error creating a hotplug callback\n";
+            continue;
+        }
+        m_hotplug_handles[key] = handle;
+    }
+}
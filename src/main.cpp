@@ -1,17 +1,20 @@
 #include "scheduler.h"
 #include "tools.h"
 #include <iostream>
-#include <thread>
+#include <poll.h>
 
 int
 main()
 {
     BoredomScheduler test("/opt/boredom-lock/config.ini");
     test.init();
-    test.is_alarm();
-    for (size_t i = 0; i < 10; ++i) {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-        test.is_alarm();
+    test.set_state_change_cb([](bool alarm) {
+        std::cout << (alarm ? "Alarm on\n" : "Alarm off\n");
+    });
+
+    pollfd pfd{ test.fd(), POLLIN, 0 };
+    while (poll(&pfd, 1, -1) >= 0) {
+        test.handle_events();
     }
     return 0;
 }
@@ -0,0 +1,251 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> Metrics::m_enabled{ false };
+
+namespace {
+
+/// @brief Metrics recorded by a single thread.
+struct Shard
+{
+    std::array<std::atomic<uint64_t>, METRIC_COUNTERS> counters{};
+    std::array<std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS>,
+               METRIC_HISTOGRAMS>
+      buckets{};
+    std::array<std::atomic<uint64_t>, METRIC_HISTOGRAMS> sums{};
+    /// @brief Owned by a running thread. Shards of exited threads keep their
+    /// values and are handed to the next new thread.
+    bool in_use{ false };
+};
+
+struct Registry
+{
+    std::mutex mtx;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+Registry&
+registry()
+{
+    static Registry registry;
+    return registry;
+}
+
+/// @brief Releases the shard of a thread when the thread exits.
+struct ShardHandle
+{
+    Shard* shard{ nullptr };
+
+    ~ShardHandle()
+    {
+        if (shard) {
+            std::lock_guard lock(registry().mtx);
+            shard->in_use = false;
+        }
+    }
+};
+
+Shard&
+thread_shard()
+{
+    thread_local ShardHandle handle;
+    if (handle.shard) {
+        return *handle.shard;
+    }
+
+    auto& reg = registry();
+    std::lock_guard lock(reg.mtx);
+    auto free = std::find_if(reg.shards.begin(),
+                             reg.shards.end(),
+                             [](const auto& shard) { return !shard->in_use; });
+    if (free == reg.shards.end()) {
+        reg.shards.push_back(std::make_unique<Shard>());
+        free = reg.shards.end() - 1;
+    }
+    (*free)->in_use = true;
+    handle.shard = free->get();
+    return *handle.shard;
+}
+
+const char* const counter_names[METRIC_COUNTERS] = {
+    "boredomlock_hotplug_events_total",
+    "boredomlock_alarm_evaluations_total",
+    "boredomlock_config_reloads_total",
+};
+
+const char* const histogram_names[METRIC_HISTOGRAMS] = {
+    "boredomlock_event_latency_seconds",
+    "boredomlock_callback_seconds",
+    "boredomlock_evaluation_seconds",
+    "boredomlock_reload_seconds",
+    "boredomlock_lock_wait_seconds",
+};
+
+} // namespace
+
+std::chrono::nanoseconds
+HistogramSnapshot::percentile(double quantile) const
+{
+    if (count == 0) {
+        return std::chrono::nanoseconds{ 0 };
+    }
+    const auto rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(quantile * static_cast<double>(count) + 0.5));
+    uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+        seen += buckets[bucket];
+        if (seen >= rank) {
+            return std::chrono::nanoseconds(
+              static_cast<int64_t>(histogram_bucket_end(bucket)));
+        }
+    }
+    return std::chrono::nanoseconds::max();
+}
+
+void
+Metrics::set_enabled(bool enabled)
+{
+    m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void
+Metrics::m_add(MetricCounter counter, uint64_t value)
+{
+    thread_shard().counters[counter].fetch_add(value,
+                                               std::memory_order_relaxed);
+}
+
+void
+Metrics::m_record(MetricHistogram histogram, std::chrono::nanoseconds value)
+{
+    const auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(
+      0, std::chrono::nanoseconds(value).count()));
+    auto& shard = thread_shard();
+    shard.buckets[histogram][histogram_bucket(nanoseconds)].fetch_add(
+      1, std::memory_order_relaxed);
+    shard.sums[histogram].fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+MetricsSnapshot
+Metrics::snapshot()
+{
+    MetricsSnapshot snapshot;
+    auto& reg = registry();
+    std::lock_guard lock(reg.mtx);
+    for (const auto& shard : reg.shards) {
+        for (std::size_t i = 0; i < METRIC_COUNTERS; ++i) {
+            snapshot.counters[i] +=
+              shard->counters[i].load(std::memory_order_relaxed);
+        }
+        for (std::size_t i = 0; i < METRIC_HISTOGRAMS; ++i) {
+            auto& histogram = snapshot.histograms[i];
+            for (std::size_t bucket = 0; bucket < HISTOGRAM_BUCKETS;
+                 ++bucket) {
+                const auto count =
+                  shard->buckets[i][bucket].load(std::memory_order_relaxed);
+                histogram.buckets[bucket] += count;
+                histogram.count += count;
+            }
+            histogram.sum += shard->sums[i].load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+
+void
+Metrics::reset()
+{
+    auto& reg = registry();
+    std::lock_guard lock(reg.mtx);
+    for (auto& shard : reg.shards) {
+        for (auto& counter : shard->counters) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for (auto& histogram : shard->buckets) {
+            for (auto& bucket : histogram) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+        for (auto& sum : shard->sums) {
+            sum.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::string
+Metrics::prometheus(const MetricsSnapshot& snapshot)
+{
+    std::string text;
+    char line[160];
+
+    for (std::size_t i = 0; i < METRIC_COUNTERS; ++i) {
+        std::snprintf(line,
+                      sizeof(line),
+                      "# TYPE %s counter\n%s %llu\n",
+                      counter_names[i],
+                      counter_names[i],
+                      static_cast<unsigned long long>(snapshot.counters[i]));
+        text += line;
+    }
+
+    for (std::size_t i = 0; i < METRIC_HISTOGRAMS; ++i) {
+        const auto name = histogram_names[i];
+        const auto& histogram = snapshot.histograms[i];
+        std::snprintf(line, sizeof(line), "# TYPE %s histogram\n", name);
+        text += line;
+
+        // Only the buckets holding values are listed, the counts are
+        // cumulative so the empty ones carry no information.
+        uint64_t cumulative = 0;
+        for (std::size_t bucket = 0; bucket + 1 < HISTOGRAM_BUCKETS;
+             ++bucket) {
+            if (histogram.buckets[bucket] == 0) {
+                continue;
+            }
+            cumulative += histogram.buckets[bucket];
+            std::snprintf(
+              line,
+              sizeof(line),
+              "%s_bucket{le=\"%.9g\"} %llu\n",
+              name,
+              static_cast<double>(histogram_bucket_end(bucket) + 1) * 1e-9,
+              static_cast<unsigned long long>(cumulative));
+            text += line;
+        }
+        std::snprintf(line,
+                      sizeof(line),
+                      "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count "
+                      "%llu\n",
+                      name,
+                      static_cast<unsigned long long>(histogram.count),
+                      name,
+                      static_cast<double>(histogram.sum) * 1e-9,
+                      name,
+                      static_cast<unsigned long long>(histogram.count));
+        text += line;
+    }
+    return text;
+}
+
+bool
+Metrics::write_prometheus(const std::filesystem::path& path)
+{
+    auto temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        file << prometheus(snapshot());
+        if (!file) {
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+}
@@ -1,63 +1,79 @@
 #include "scheduler.h"
+#include "metrics.h"
 #include "usbtracker.h"
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <chrono>
+#include <ctime>
 #include <fstream>
 #include <iostream>
-#include <libudev.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 const std::string weekend{ "weekend" };
 const std::string weekdays{ "weekdays" };
+const std::array<std::string, 7> day_names{ "sunday",   "monday", "tuesday",
+                                            "wednesday", "thursday", "friday",
+                                            "saturday" };
 
-std::chrono::hh_mm_ss<std::chrono::seconds>
-hours_minutes(const std::string_view& view)
+/// @brief Minutes update steps through transition by transition, longer
+/// gaps evaluate every device.
+static constexpr std::size_t MAX_UNCONNECTED_STEP = 60;
+
+/// @brief Check if two configured devices are the same section.
+static bool
+same_device(const USBDevice& lhs, const USBDevice& rhs)
 {
-    short hour = 0;
-    short min = 0;
-    std::stringstream ss;
+    return lhs.id == rhs.id && lhs.name == rhs.name && lhs.port == rhs.port &&
+           lhs.serial == rhs.serial;
+}
 
-    auto delimiter = view.find(':');
+static std::string
+section_value(const simpleini::INISection& section, const std::string& key)
+{
+    try {
+        return section.get(key);
+    } catch (const std::exception&) {
+        return std::string{};
+    }
+}
 
-    auto start_str = view.substr(0, delimiter);
-    auto end_str = view.substr(delimiter + 1);
+static std::chrono::hh_mm_ss<std::chrono::seconds>
+to_hh_mm_ss(uint16_t minutes)
+{
+    return std::chrono::hh_mm_ss<std::chrono::seconds>{ std::chrono::minutes(
+      minutes) };
+}
 
-    ss << start_str;
-    ss >> hour;
-    if (delimiter != std::string::npos) {
-        ss.clear();
-        ss << end_str;
-        ss >> min;
-    }
+static BoredPeriod
+to_bored_period(MinuteSpan span)
+{
+    return BoredPeriod{ to_hh_mm_ss(span.start), to_hh_mm_ss(span.end) };
+}
 
-    return std::chrono::hh_mm_ss<std::chrono::seconds>{
-        std::chrono::hours(hour) + std::chrono::minutes(min)
-    };
+std::chrono::hh_mm_ss<std::chrono::seconds>
+hours_minutes(const std::string_view& view)
+{
+    return to_hh_mm_ss(parse_time_of_day(view).value_or(0));
 }
 
 BoredPeriod
 parse_bored_period(const std::string_view& view)
 {
-    auto delimiter = view.find('-');
-
-    auto start = hours_minutes(view.substr(0, delimiter));
-    auto end = hours_minutes(view.substr(delimiter + 1));
-
-    return BoredPeriod{ start, end };
+    return to_bored_period(parse_span(view).value_or(MinuteSpan{ 0, 0 }));
 }
 
 std::vector<BoredPeriod>
 parse_bored_periods(const std::string_view& view)
 {
     std::vector<BoredPeriod> periods{};
-    size_t delimiter = 0;
-    size_t prev = 0;
-
-    while (delimiter < std::string::npos) {
-        delimiter = view.find(',', prev);
-        periods.push_back(parse_bored_period(view.substr(prev, delimiter)));
-        prev = delimiter + 1;
-    }
-
+    for_each_span(view, [&periods](MinuteSpan span) {
+        periods.push_back(to_bored_period(span));
+    });
     return periods;
 }
 
@@ -82,10 +98,11 @@ bool
 is_weekend(const std::chrono::time_point<std::chrono::system_clock>& now)
 {
     const auto now_time_t = std::chrono::system_clock::to_time_t(now);
-    const auto local_tm = std::localtime(&now_time_t);
+    std::tm local_tm{};
+    localtime_r(&now_time_t, &local_tm);
 
-    return (local_tm->tm_wday == std::chrono::Saturday.c_encoding() ||
-            local_tm->tm_wday == std::chrono::Sunday.c_encoding());
+    return (local_tm.tm_wday == std::chrono::Saturday.c_encoding() ||
+            local_tm.tm_wday == std::chrono::Sunday.c_encoding());
 }
 
 std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>
@@ -110,35 +127,125 @@ parse_from_iniconf(const simpleini::SimpleINI& config,
     return bored;
 }
 
-bool
-BoredomScheduler::has_unconnected(
-  const std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>& bored,
-  const std::chrono::hh_mm_ss<std::chrono::seconds>& now_hms) const
-{
-    for (const auto& item : bored) {
-        if (is_in_bored_periods(now_hms, item.first)) {
-            if (!m_usbtracker->usb_id_is_connected(item.second.id)) {
-                return true;
-            }
-        }
+void
+add_bored_periods(WeekMask& mask,
+                  std::chrono::weekday day,
+                  const std::vector<BoredPeriod>& periods)
+{
+    for (const auto& period : periods) {
+        const auto start = std::chrono::duration_cast<std::chrono::minutes>(
+          period.first.to_duration());
+        const auto end = std::chrono::duration_cast<std::chrono::minutes>(
+          period.second.to_duration());
+        const MinuteSpan span{ static_cast<uint16_t>(start.count()),
+                               static_cast<uint16_t>(end.count()) };
+        add_spans(mask, day.c_encoding(), &span, 1);
     }
-    return false;
 }
 
-std::vector<USBDevice>
-BoredomScheduler::list_unconnected(
-  const std::vector<std::pair<std::vector<BoredPeriod>, USBDevice>>& bored,
-  const std::chrono::hh_mm_ss<std::chrono::seconds>& now_hms) const
-{
-    std::vector<USBDevice> unconnected;
-    for (const auto& item : bored) {
-        if (is_in_bored_periods(now_hms, item.first)) {
-            if (!m_usbtracker->usb_id_is_connected(item.second.id)) {
-                unconnected.push_back(item.second);
-            }
+/// @brief Parse the periods of a configuration value, reporting errors.
+static std::vector<MinuteSpan>
+section_spans(const std::string& name,
+              const simpleini::INISection& section,
+              const std::string& key)
+{
+    const auto value = section_value(section, key);
+    auto spans = parse_spans(value);
+    if (!spans) {
+        std::cerr << "Error parsing " << key << " of " << name
+                  << " at column " << spans.error().column << ": "
+                  << spans.error().message << "\n";
+        return {};
+    }
+    return *spans;
+}
+
+DeviceSchedule
+compile_section(const std::string& name, const simpleini::INISection& section)
+{
+    DeviceSchedule compiled{ { {}, name }, {} };
+
+    const auto id = parse_usb_id(section_value(section, "usb_id"));
+    if (id) {
+        compiled.device.id = *id;
+    } else {
+        std::cerr << "Error parsing usb_id of " << name << " at column "
+                  << id.error().column << ": " << id.error().message << "\n";
+    }
+
+    const auto port = section_value(section, "port");
+    compiled.device.port = parse_usb_port(port);
+    if (!port.empty() && compiled.device.port.empty()) {
+        std::cerr << "Error parsing port of " << name << ": " << port << "\n";
+    }
+    compiled.device.serial = section_value(section, "serial");
+
+    const auto weekday_spans = section_spans(name, section, weekdays);
+    const auto weekend_spans = section_spans(name, section, weekend);
+
+    for (unsigned day = 0; day < day_names.size(); ++day) {
+        const std::chrono::weekday wday{ day };
+        const auto* spans = &weekday_spans;
+        std::vector<MinuteSpan> override_spans;
+
+        if (!section_value(section, day_names[day]).empty()) {
+            override_spans = section_spans(name, section, day_names[day]);
+            spans = &override_spans;
+        } else if (wday == std::chrono::Saturday ||
+                   wday == std::chrono::Sunday) {
+            spans = &weekend_spans;
         }
+        add_spans(compiled.mask, day, spans->data(), spans->size());
+    }
+    return compiled;
+}
+
+CompiledSchedule
+compile_schedule(const simpleini::SimpleINI& config)
+{
+    const auto& map = config.get_map();
+    CompiledSchedule schedule;
+    schedule.reserve(map.size());
+
+    for (const auto& item : map) {
+        schedule.push_back(compile_section(item.first, item.second));
+    }
+    return schedule;
+}
+
+/// @brief Join the values a section is compiled from, to detect changes.
+static std::string
+section_fingerprint(const simpleini::INISection& section)
+{
+    std::string values = section_value(section, "usb_id");
+    values += '\n' + section_value(section, "port");
+    values += '\n' + section_value(section, "serial");
+    for (const auto& key : { weekdays, weekend }) {
+        values += '\n' + section_value(section, key);
+    }
+    for (const auto& key : day_names) {
+        values += '\n' + section_value(section, key);
     }
-    return unconnected;
+    return values;
+}
+
+bool
+BoredomScheduler::has_unconnected(const TransitionIndex& schedule,
+                                  std::size_t minute) const
+{
+    return schedule.any_required(minute, [this](const DeviceSchedule& item) {
+        return !m_usbtracker->is_connected(item.device) &&
+               !m_is_snooze(item.device.id);
+    });
+}
+
+bool
+BoredomScheduler::m_is_unconnected(const DeviceSchedule& item,
+                                   std::size_t minute) const
+{
+    return item.mask.test(minute) &&
+           !m_usbtracker->is_connected(item.device) &&
+           !m_is_snooze(item.device.id);
 }
 
 BoredomScheduler::BoredomScheduler(const std::filesystem::path& config)
@@ -147,14 +254,61 @@ BoredomScheduler::BoredomScheduler(const std::filesystem::path& config)
     const char* homedir = getenv("HOME");
     m_dir = std::filesystem::path(homedir) /
             std::filesystem::path(".local/share/BoredomScheduler/");
-    m_statusfile = m_dir / std::filesystem::path("status");
+    m_statefile = m_dir / std::filesystem::path("state");
+}
+
+BoredomScheduler::BoredomScheduler(std::span<const EmbeddedDevice> devices)
+  : m_embedded(true)
+{
+    const char* homedir = getenv("HOME");
+    m_dir = std::filesystem::path(homedir) /
+            std::filesystem::path(".local/share/BoredomScheduler/");
+    m_statefile = m_dir / std::filesystem::path("state");
+
+    CompiledSchedule schedule;
+    schedule.reserve(devices.size());
+    for (const auto& device : devices) {
+        schedule.push_back(
+          DeviceSchedule{ USBDevice{ device.id, device.name }, device.mask });
+    }
+    m_schedule.store(
+      std::make_shared<const TransitionIndex>(std::move(schedule)));
+}
+
+BoredomScheduler::~BoredomScheduler()
+{
+    if (m_usbtracker) {
+        m_usbtracker->unsubscribe(m_subscription);
+    }
+    m_usbtracker.reset();
+
+    for (auto fd : { m_timer_fd, m_wake_fd, m_inotify_fd, m_epoll_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
 }
 
 void
 BoredomScheduler::set_config_file(const std::filesystem::path& config)
 {
     m_configfile = config;
-    init();
+    if (!m_usbtracker) {
+        init();
+        return;
+    }
+    m_watch_config();
+    reload_config();
+}
+
+void
+BoredomScheduler::reload_config()
+{
+    if (m_embedded) {
+        return;
+    }
+    m_read_config();
+    m_wake();
 }
 
 void
@@ -164,82 +318,195 @@ BoredomScheduler::init()
         std::filesystem::create_directories(m_dir);
     }
 
-    if (!std::filesystem::exists(m_statusfile)) {
-        m_status = BSchedulerStatus::ENABLED;
-        std::ofstream statusfile(m_statusfile, std::ofstream::binary);
-
-        statusfile.write(reinterpret_cast<const char*>(&m_status),
-                         sizeof(m_status));
-        statusfile.close();
+    m_load_state();
+    m_snoozes.clear();
+    m_timers.reset(m_now());
+    for (const auto& [id, until] : m_state.device_snoozes(m_now())) {
+        m_snoozes[id.packed()] = { until, m_timers.add(until, id.packed()) };
     }
 
-    std::ifstream statusfile(m_statusfile, std::ifstream::binary);
-    statusfile.read(reinterpret_cast<char*>(&m_status), sizeof(m_status));
-    statusfile.close();
+    if (!m_embedded) {
+        m_read_config();
+    }
+    if (m_usbtracker) {
+        m_usbtracker->unsubscribe(m_subscription);
+    }
+    m_usbtracker = USBTracker::shared();
+    m_unconnected_schedule.reset();
+    m_subscription = m_usbtracker->subscribe(
+      m_configured_ids(), [this](const USBEvent& event) {
+          // Another instance of the vid:pid may still be connected after one
+          // leaves.
+          const auto now = m_now();
+          const bool connected = m_usbtracker->usb_id_is_connected(event.id);
+          m_save_connected(event.id, connected, now);
+          m_journal.record_device(event.id, connected, now);
+          m_changed_ids.push(event.id);
+          if (m_callback) {
+              m_callback(m_user_data);
+          }
+          m_wake();
+      });
+    for (const auto& id : m_configured_ids()) {
+        m_save_connected(id, m_usbtracker->usb_id_is_connected(id), m_now());
+    }
 
-    m_config = simpleini::SimpleINI(m_configfile);
-    m_usbtracker = std::make_unique<USBTracker>();
-    m_usbtracker->start_tracking();
+    m_open_event_fds();
+    m_watch_config();
+    m_alarm_state = is_alarm();
+    m_journal_state();
+    m_arm_timer();
 }
 
 bool
 BoredomScheduler::is_alarm() const
 {
-    if (m_is_snooze() || m_status == BSchedulerStatus::DISABLED) {
+    MetricTimer timer(EVALUATION_TIME);
+    Metrics::add(ALARM_EVALUATIONS);
+    if (m_is_snooze() || m_state.status() == BSchedulerStatus::DISABLED) {
         return false;
     }
 
-    const auto now = std::chrono::system_clock::now();
-    const auto now_t = std::chrono::system_clock::to_time_t(now);
-    auto now_tm = std::localtime(&now_t);
-
-    const auto now_hms = std::chrono::hh_mm_ss<std::chrono::seconds>{ (
-      std::chrono::hours(now_tm->tm_hour) +
-      std::chrono::minutes(now_tm->tm_min)) };
-
-    auto bored = parse_from_iniconf(m_config, now);
-    return has_unconnected(bored, now_hms);
+    const auto minute = m_local_time.minute_of_week(m_now());
+    return has_unconnected(*m_schedule.load(), minute);
 }
 
 void
 BoredomScheduler::snooze(std::chrono::seconds seconds)
 {
-    m_snooze_t = seconds;
-    m_snooze_start = std::chrono::system_clock::now();
+    m_state.set_snooze_until(m_now() + seconds);
+    m_wake();
 }
 
 void
-BoredomScheduler::disable()
+BoredomScheduler::snooze(const usb_id& id, std::chrono::seconds seconds)
 {
-    m_status = BSchedulerStatus::DISABLED;
-    std::ofstream statusfile(m_statusfile, std::ofstream::binary);
+    const auto now = m_now();
+    const auto until = now + seconds;
+    // The snooze holds until it ends even if it can't be saved.
+    if (!m_state.set_snooze_until(id, until)) {
+        std::cerr << "Too many devices to snooze\n";
+    }
 
-    statusfile.write(reinterpret_cast<const char*>(&m_status),
-                     sizeof(m_status));
-    statusfile.close();
+    m_expire_snoozes();
+    const auto found = m_snoozes.find(id.packed());
+    if (found != m_snoozes.end()) {
+        m_timers.cancel(found->second.timer);
+        m_snoozes.erase(found);
+    }
+    if (until > now) {
+        m_snoozes[id.packed()] = { until, m_timers.add(until, id.packed()) };
+    }
+    m_changed_ids.push(id);
+    m_wake();
 }
 
 void
-BoredomScheduler::enable()
+BoredomScheduler::disable()
 {
-    m_status = BSchedulerStatus::ENABLED;
-    std::ofstream statusfile(m_statusfile, std::ofstream::binary);
+    m_state.set_status(BSchedulerStatus::DISABLED);
+    m_wake();
+}
 
-    statusfile.write(reinterpret_cast<const char*>(&m_status),
-                     sizeof(m_status));
-    statusfile.close();
+void
+BoredomScheduler::enable()
+{
+    m_state.set_status(BSchedulerStatus::ENABLED);
+    m_wake();
 }
 
 void
 BoredomScheduler::set_device_event_cb(std::function<void(void*)> callback)
 {
-    m_usbtracker->set_device_event_cb(callback);
+    m_callback = callback;
 }
 
 void
 BoredomScheduler::set_event_cb_data(void* data)
 {
-    m_usbtracker->set_event_cb_data(data);
+    m_user_data = data;
+}
+
+int
+BoredomScheduler::fd() const
+{
+    return m_epoll_fd;
+}
+
+void
+BoredomScheduler::handle_events()
+{
+    uint64_t count;
+    // Both descriptors are non-blocking, a failed read means nothing was
+    // pending. ECANCELED from the timer means the wall clock was set.
+    (void)!read(m_timer_fd, &count, sizeof(count));
+    (void)!read(m_wake_fd, &count, sizeof(count));
+
+    m_expire_snoozes();
+    if (m_config_changed()) {
+        reload_config();
+    }
+
+    const auto alarm = is_alarm();
+    if (alarm != m_alarm_state) {
+        m_alarm_state = alarm;
+        m_journal.record_alarm(alarm, m_now());
+        if (m_state_callback) {
+            m_state_callback(alarm);
+        }
+        m_state_waiters.notify(alarm);
+    }
+    m_journal.maintain(m_now(),
+                       JOURNAL_RETENTION,
+                       std::chrono::days(1));
+    m_arm_timer();
+}
+
+void
+BoredomScheduler::set_state_change_cb(std::function<void(bool)> callback)
+{
+    m_state_callback = callback;
+}
+
+void
+BoredomScheduler::set_executor(Executor executor)
+{
+    m_executor = std::move(executor);
+}
+
+WaitList<bool>::Awaiter
+BoredomScheduler::state_change()
+{
+    return { m_state_waiters, m_executor };
+}
+
+void
+BoredomScheduler::set_clock(std::shared_ptr<const Clock> clock)
+{
+    m_clock.store(clock);
+    m_wake();
+}
+
+std::chrono::system_clock::time_point
+BoredomScheduler::next_change() const
+{
+    const auto now = m_now();
+    const auto minute = m_local_time.minute_of_week(now);
+
+    const auto minutes = m_schedule.load()->next_transition(minute);
+
+    std::chrono::system_clock::time_point next =
+      std::chrono::floor<std::chrono::minutes>(now) +
+      std::chrono::minutes(minutes);
+
+    // Minutes are counted in local time, which is only valid until the next
+    // local midnight or UTC offset change.
+    next = std::min(next, m_local_time.valid_until(now));
+
+    if (m_is_snooze()) {
+        next = std::min(next, m_state.snooze_until());
+    }
+    return std::min(next, m_timers.next_expiry());
 }
 
 void
@@ -247,39 +514,492 @@ BoredomScheduler::create_boredom_period(const USBDevice& device,
                                         const std::string& weekday_times,
                                         const std::string& weekend_times)
 {
+    if (m_embedded) {
+        std::cerr << "Can't add a boredom period to an embedded schedule\n";
+        return;
+    }
     simpleini::INISection new_section{ device.name,
                                        { { "usb_id", device.id.to_string() },
                                          { weekdays, weekday_times },
                                          { weekend, weekend_times } } };
 
-    m_config.add_section(device.id.to_string(), new_section);
+    const auto name = device.id.to_string();
+    m_config.add_section(name, new_section);
     m_config.write();
+
+    // Index only this device, replacing its previous section.
+    std::vector<std::string> removed;
+    if (m_section_fingerprints.contains(name)) {
+        removed.push_back(name);
+    }
+    CompiledSchedule added;
+    added.push_back(compile_section(name, new_section));
+    m_section_fingerprints[name] = section_fingerprint(new_section);
+    m_publish(std::move(removed), std::move(added));
 }
 
 std::vector<USBDevice>
 BoredomScheduler::list_unconnected_devices()
+{
+    MetricTimer timer(EVALUATION_TIME);
+    Metrics::add(ALARM_EVALUATIONS);
+    update();
+
+    std::vector<USBDevice> devices;
+    devices.reserve(m_unconnected.size());
+    for (const auto device : m_unconnected) {
+        devices.push_back(m_unconnected_schedule->schedule()[device].device);
+    }
+    return devices;
+}
+
+UnconnectedChanges
+BoredomScheduler::unconnected_changes(uint64_t since)
 {
     update();
-    return m_unconnected;
+    UnconnectedChanges changes;
+    changes.generation = m_unconnected_generation;
+    if (since >= m_unconnected_generation) {
+        return changes;
+    }
+    if (since < m_unconnected_log_base) {
+        changes.full = true;
+        changes.unconnected = list_unconnected_devices();
+        return changes;
+    }
+
+    auto change = std::partition_point(
+      m_unconnected_log.begin(),
+      m_unconnected_log.end(),
+      [since](const auto& item) { return item.generation <= since; });
+    for (; change != m_unconnected_log.end(); ++change) {
+        auto& same = change->unconnected ? changes.unconnected
+                                         : changes.reconnected;
+        auto& opposite = change->unconnected ? changes.reconnected
+                                             : changes.unconnected;
+        const auto found =
+          std::find_if(opposite.begin(), opposite.end(), [&](const auto& d) {
+              return same_device(d, change->device);
+          });
+        if (found != opposite.end()) {
+            opposite.erase(found);
+        } else {
+            same.push_back(change->device);
+        }
+    }
+    return changes;
+}
+
+bool
+BoredomScheduler::open_journal(const std::filesystem::path& path)
+{
+    if (!std::filesystem::exists(m_dir)) {
+        std::filesystem::create_directories(m_dir);
+    }
+    if (!m_journal.open(path.empty() ? m_dir / "journal" : path)) {
+        return false;
+    }
+    if (m_usbtracker) {
+        m_journal_state();
+    }
+    return true;
+}
+
+void
+BoredomScheduler::m_journal_state()
+{
+    const auto now = m_now();
+    for (const auto& id : m_configured_ids()) {
+        m_journal.record_device(id, m_usbtracker->usb_id_is_connected(id), now);
+    }
+    m_journal.record_alarm(m_alarm_state, now);
 }
 
 void
 BoredomScheduler::update()
 {
-    const auto now = std::chrono::system_clock::now();
-    const auto now_t = std::chrono::system_clock::to_time_t(now);
-    auto now_tm = std::localtime(&now_t);
+    const auto now = m_now();
+    const auto minute = m_local_time.minute_of_week(now);
+    auto schedule = m_schedule.load();
+    m_expire_snoozes();
+    const auto dropped = m_changed_ids.dropped();
+    // The minute of the week jumps on UTC offset changes and clock changes.
+    const auto elapsed =
+      (minute + MINUTES_PER_WEEK - m_unconnected_minute) % MINUTES_PER_WEEK;
+
+    if (schedule != m_unconnected_schedule || now < m_unconnected_time ||
+        elapsed > MAX_UNCONNECTED_STEP || dropped != m_changed_ids_dropped) {
+        m_changed_ids.drain([](const usb_id&) {});
+        m_changed_ids_dropped = m_changed_ids.dropped();
+        m_rebuild_unconnected(std::move(schedule), minute);
+    } else {
+        m_changed_ids.drain([this, minute](const usb_id& id) {
+            const auto devices = m_devices_by_id.find(id.packed());
+            if (devices == m_devices_by_id.end()) {
+                return;
+            }
+            for (const auto device : devices->second) {
+                m_update_unconnected(device, minute);
+            }
+        });
+        const auto& index = *m_unconnected_schedule;
+        for (std::size_t i = 1; i <= elapsed; ++i) {
+            for (const auto& transition :
+                 index.transitions_at(m_unconnected_minute + i)) {
+                m_update_unconnected(transition.device, minute);
+            }
+        }
+    }
+
+    m_unconnected_time = now;
+    m_unconnected_minute = minute;
+    if (!m_unconnected_log.empty() &&
+        m_unconnected_log.back().generation > m_unconnected_generation) {
+        m_unconnected_generation++;
+    }
+}
+
+void
+BoredomScheduler::m_rebuild_unconnected(
+  std::shared_ptr<const TransitionIndex> schedule,
+  std::size_t minute)
+{
+    const auto& devices = schedule->schedule();
+    if (schedule != m_unconnected_schedule) {
+        m_devices_by_id.clear();
+        for (uint32_t i = 0; i < devices.size(); ++i) {
+            m_devices_by_id[devices[i].device.id.packed()].push_back(i);
+        }
+    }
+
+    // Only the required devices are looked up in the tracker.
+    std::vector<uint32_t> unconnected;
+    schedule->required_bitmap(minute, m_required);
+    for (std::size_t word = 0; word < m_required.size(); ++word) {
+        for (auto bits = m_required[word]; bits; bits &= bits - 1) {
+            const auto i =
+              static_cast<uint32_t>(word * 64 + std::countr_zero(bits));
+            if (!m_usbtracker->is_connected(devices[i].device) &&
+                !m_is_snooze(devices[i].device.id)) {
+                unconnected.push_back(i);
+            }
+        }
+    }
+
+    // The previous devices may be from another schedule, compare them by
+    // value.
+    const auto contains = [](const CompiledSchedule& in,
+                             const std::vector<uint32_t>& indexes,
+                             const USBDevice& device) {
+        return std::any_of(indexes.begin(), indexes.end(), [&](auto i) {
+            return same_device(in[i].device, device);
+        });
+    };
+    if (m_unconnected_schedule) {
+        const auto& previous = m_unconnected_schedule->schedule();
+        for (const auto i : m_unconnected) {
+            if (!contains(devices, unconnected, previous[i].device)) {
+                m_log_unconnected(previous[i].device, false);
+            }
+        }
+        for (const auto i : unconnected) {
+            if (!contains(previous, m_unconnected, devices[i].device)) {
+                m_log_unconnected(devices[i].device, true);
+            }
+        }
+    } else {
+        for (const auto i : unconnected) {
+            m_log_unconnected(devices[i].device, true);
+        }
+    }
+
+    m_unconnected = std::move(unconnected);
+    m_unconnected_schedule = std::move(schedule);
+}
 
-    const auto now_hms = std::chrono::hh_mm_ss<std::chrono::seconds>{ (
-      std::chrono::hours(now_tm->tm_hour) +
-      std::chrono::minutes(now_tm->tm_min)) };
+void
+BoredomScheduler::m_update_unconnected(uint32_t device, std::size_t minute)
+{
+    const auto& item = m_unconnected_schedule->schedule()[device];
+    const bool unconnected = m_is_unconnected(item, minute);
+    const auto found =
+      std::lower_bound(m_unconnected.begin(), m_unconnected.end(), device);
+    if (unconnected == (found != m_unconnected.end() && *found == device)) {
+        return;
+    }
+    if (unconnected) {
+        m_unconnected.insert(found, device);
+    } else {
+        m_unconnected.erase(found);
+    }
+    m_log_unconnected(item.device, unconnected);
+}
 
-    auto bored = parse_from_iniconf(m_config, now);
-    m_unconnected = list_unconnected(bored, now_hms);
+void
+BoredomScheduler::m_log_unconnected(const USBDevice& device, bool unconnected)
+{
+    if (m_unconnected_log.size() == UNCONNECTED_LOG_SIZE) {
+        m_unconnected_log_base = m_unconnected_log.front().generation;
+        m_unconnected_log.pop_front();
+    }
+    m_unconnected_log.push_back(
+      UnconnectedChange{ m_unconnected_generation + 1, device, unconnected });
 }
 
 bool
 BoredomScheduler::m_is_snooze() const
 {
-    return std::chrono::system_clock::now() < (m_snooze_start + m_snooze_t);
+    return m_now() < m_state.snooze_until();
+}
+
+bool
+BoredomScheduler::m_is_snooze(const usb_id& id) const
+{
+    const auto found = m_snoozes.find(id.packed());
+    return found != m_snoozes.end() && m_now() < found->second.until;
+}
+
+void
+BoredomScheduler::m_expire_snoozes()
+{
+    const auto now = m_now();
+    // The wheel never moves backwards, start it over when the clock does.
+    if (now < m_timers.now()) {
+        m_timers.reset(now);
+        for (auto& [key, snooze] : m_snoozes) {
+            snooze.timer = m_timers.add(snooze.until, key);
+        }
+    }
+
+    std::vector<uint64_t> expired;
+    m_timers.advance(now, expired);
+    for (const auto key : expired) {
+        usb_id id;
+        id.vid = static_cast<uint16_t>(key >> 16);
+        id.pid = static_cast<uint16_t>(key);
+        m_snoozes.erase(static_cast<uint32_t>(key));
+        m_changed_ids.push(id);
+    }
+}
+
+void
+BoredomScheduler::m_load_state()
+{
+    const auto existed = std::filesystem::exists(m_statefile);
+    m_state.open(m_statefile);
+    if (existed) {
+        return;
+    }
+
+    // Carry over the status saved by older versions.
+    const auto legacy = m_dir / std::filesystem::path("status");
+    BSchedulerStatus status = BSchedulerStatus::ENABLED;
+    std::ifstream statusfile(legacy, std::ifstream::binary);
+    if (statusfile.read(reinterpret_cast<char*>(&status), sizeof(status))) {
+        m_state.set_status(status);
+    }
+}
+
+std::vector<usb_id>
+BoredomScheduler::m_configured_ids() const
+{
+    const auto schedule = m_schedule.load();
+    std::vector<usb_id> ids;
+    ids.reserve(schedule->schedule().size());
+    for (const auto& item : schedule->schedule()) {
+        ids.push_back(item.device.id);
+    }
+    return ids;
+}
+
+void
+BoredomScheduler::m_read_config()
+{
+    MetricTimer timer(RELOAD_TIME);
+    Metrics::add(CONFIG_RELOADS);
+    m_config = simpleini::SimpleINI(m_configfile);
+    m_apply_config();
+}
+
+void
+BoredomScheduler::m_apply_config()
+{
+    // Only the added, changed and removed sections are compiled and indexed.
+    const auto& map = m_config.get_map();
+    std::map<std::string, std::string> fingerprints;
+    std::vector<std::string> removed;
+    CompiledSchedule added;
+
+    for (const auto& [name, section] : map) {
+        auto values = section_fingerprint(section);
+        const auto previous = m_section_fingerprints.find(name);
+        if (previous == m_section_fingerprints.end()) {
+            added.push_back(compile_section(name, section));
+        } else if (previous->second != values) {
+            removed.push_back(name);
+            added.push_back(compile_section(name, section));
+        }
+        fingerprints.emplace(name, std::move(values));
+    }
+    for (const auto& [name, values] : m_section_fingerprints) {
+        if (!fingerprints.contains(name)) {
+            removed.push_back(name);
+        }
+    }
+
+    m_section_fingerprints = std::move(fingerprints);
+    if (!removed.empty() || !added.empty()) {
+        m_publish(std::move(removed), std::move(added));
+    }
+    // The state of removed devices is dropped once their snoozes end.
+    m_state.retain(m_configured_ids(), m_now());
+}
+
+/// @details Copying the published index is O(n) in the number of devices,
+/// only the removed and added devices are indexed again.
+void
+BoredomScheduler::m_publish(std::vector<std::string> removed,
+                            CompiledSchedule added)
+{
+    auto schedule = std::make_shared<TransitionIndex>(*m_schedule.load());
+    if (!removed.empty()) {
+        std::sort(removed.begin(), removed.end());
+        std::vector<uint32_t> devices;
+        const auto& current = schedule->schedule();
+        for (uint32_t i = 0; i < current.size(); ++i) {
+            if (std::binary_search(
+                  removed.begin(), removed.end(), current[i].device.name)) {
+                devices.push_back(i);
+            }
+        }
+        schedule->remove(std::move(devices));
+    }
+    std::vector<usb_id> ids;
+    for (const auto& item : added) {
+        ids.push_back(item.device.id);
+    }
+    schedule->add(std::move(added));
+    m_schedule.store(std::move(schedule));
+
+    if (m_usbtracker) {
+        m_usbtracker->update_subscription(m_subscription, m_configured_ids());
+        for (const auto& id : ids) {
+            m_save_connected(
+              id, m_usbtracker->usb_id_is_connected(id), m_now());
+        }
+    }
+}
+
+void
+BoredomScheduler::m_save_connected(
+  const usb_id& id,
+  bool connected,
+  const std::chrono::system_clock::time_point& at)
+{
+    if (!m_state.set_connected(id, connected, at)) {
+        std::cerr << "Too many devices to save the state of "
+                  << id.to_string() << "\n";
+    }
+}
+
+void
+BoredomScheduler::m_watch_config()
+{
+    if (m_inotify_fd < 0 || m_embedded) {
+        return;
+    }
+    if (m_config_watch >= 0) {
+        inotify_rm_watch(m_inotify_fd, m_config_watch);
+    }
+
+    // Editors often replace the file instead of writing to it, so the
+    // directory is watched instead of the file.
+    auto directory = m_configfile.parent_path();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    m_config_watch = inotify_add_watch(
+      m_inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+}
+
+bool
+BoredomScheduler::m_config_changed()
+{
+    alignas(inotify_event) char buffer[4096];
+    const auto filename = m_configfile.filename().string();
+    bool changed = false;
+
+    while (true) {
+        const auto size = read(m_inotify_fd, buffer, sizeof(buffer));
+        if (size <= 0) {
+            return changed;
+        }
+
+        for (auto offset = 0; offset < size;) {
+            const auto event =
+              reinterpret_cast<const inotify_event*>(buffer + offset);
+            if (event->len > 0 && filename == event->name) {
+                changed = true;
+            }
+            offset += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+
+void
+BoredomScheduler::m_open_event_fds()
+{
+    if (m_epoll_fd >= 0) {
+        return;
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    for (auto fd : { m_timer_fd, m_wake_fd, m_inotify_fd }) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+void
+BoredomScheduler::m_arm_timer()
+{
+    if (m_timer_fd < 0) {
+        return;
+    }
+
+    const auto next = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        next_change().time_since_epoch())
+                        .count();
+
+    itimerspec spec{};
+    spec.it_value.tv_sec = next / 1000000000;
+    spec.it_value.tv_nsec = next % 1000000000;
+
+    timerfd_settime(m_timer_fd,
+                    TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                    &spec,
+                    nullptr);
+}
+
+void
+BoredomScheduler::m_wake()
+{
+    if (m_wake_fd < 0) {
+        return;
+    }
+
+    const uint64_t one = 1;
+    (void)!write(m_wake_fd, &one, sizeof(one));
+}
+
+std::chrono::system_clock::time_point
+BoredomScheduler::m_now() const
+{
+    return m_clock.load()->now();
 }
@@ -0,0 +1,472 @@
+#include "statefile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr uint32_t STATE_MAGIC = 0x54534242; // "BBST"
+static constexpr uint32_t STATE_VERSION = 2;
+/// @brief Most words written by a single update.
+static constexpr std::size_t LOG_WORDS = 2;
+/// @brief Number of words covered by the checksum, status to the devices.
+static constexpr std::size_t WORDS = 2 + 4 * StateFile::DEVICES;
+
+/// @brief File layout. Everything from status to the log is 64-bit words
+/// covered by the checksum, so it can be updated one word at a time.
+struct StateFile::Data
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t checksum;
+    uint64_t status;
+    uint64_t snooze_until;
+    struct Device
+    {
+        /// @brief Packed vid:pid, 0 for an unused slot.
+        uint64_t key;
+        uint64_t snooze_until;
+        uint64_t connected;
+        uint64_t connected_changed;
+    } devices[DEVICES];
+    /// @brief Update in progress, not covered by the checksum.
+    struct Log
+    {
+        /// @brief Number of words of a committed update, 0 if none.
+        uint64_t count;
+        /// @brief Checksum after the update.
+        uint64_t checksum;
+        /// @brief Index of each word after status, and its new value.
+        uint64_t words[LOG_WORDS];
+        uint64_t values[LOG_WORDS];
+    } log;
+};
+
+
+static uint64_t
+load(const uint64_t& word)
+{
+    return std::atomic_ref(const_cast<uint64_t&>(word))
+      .load(std::memory_order_acquire);
+}
+
+static void
+store(uint64_t& word, uint64_t value)
+{
+    std::atomic_ref(word).store(value, std::memory_order_release);
+}
+
+static uint64_t
+to_word(const StateFile::time_point& tp)
+{
+    return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        tp.time_since_epoch())
+        .count());
+}
+
+static StateFile::time_point
+to_time_point(uint64_t word)
+{
+    return StateFile::time_point(std::chrono::duration_cast<
+                                 StateFile::time_point::duration>(
+      std::chrono::nanoseconds(static_cast<int64_t>(word))));
+}
+
+/// @brief Holds m_write_mtx and an flock of the file, so that writers of
+/// other mappings of the file, in this process or another, wait as well.
+class StateFile::Writer
+{
+  public:
+    explicit Writer(StateFile& state)
+      : m_state(state)
+      , m_lock(state.m_write_mtx)
+    {
+        if (m_state.m_fd >= 0) {
+            flock(m_state.m_fd, LOCK_EX);
+        }
+        // Finish the update of a writer killed while holding the lock.
+        m_state.m_replay();
+    }
+
+    ~Writer()
+    {
+        if (m_state.m_fd >= 0) {
+            flock(m_state.m_fd, LOCK_UN);
+        }
+    }
+
+  private:
+    StateFile& m_state;
+    std::lock_guard<std::mutex> m_lock;
+};
+
+StateFile::StateFile()
+  : m_memory(std::make_unique<Data>())
+{
+    m_data = m_memory.get();
+    m_reset();
+}
+
+StateFile::~StateFile()
+{
+    m_close();
+}
+
+bool
+StateFile::open(const std::filesystem::path& path)
+{
+    std::lock_guard lock(m_write_mtx);
+
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error opening state file " << path << "\n";
+        return false;
+    }
+    // Closing fd on an error releases the lock.
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    const bool fresh = fstat(fd, &st) != 0 || st.st_size == 0;
+    if (!fresh && static_cast<std::size_t>(st.st_size) != sizeof(Data) &&
+        ftruncate(fd, 0) != 0) {
+        std::cerr << "Error resizing state file " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+    if (ftruncate(fd, sizeof(Data)) != 0) {
+        std::cerr << "Error resizing state file " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+
+    void* map =
+      mmap(nullptr, sizeof(Data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error mapping state file " << path << "\n";
+        ::close(fd);
+        return false;
+    }
+
+    const Data saved = *m_data;
+    m_close();
+    m_fd = fd;
+    m_path = path;
+    m_data = static_cast<Data*>(map);
+    m_memory.reset();
+
+    if (m_data->magic == STATE_MAGIC && m_data->version == STATE_VERSION) {
+        m_replay();
+    }
+    bool valid = m_data->magic == STATE_MAGIC &&
+                 m_data->version == STATE_VERSION &&
+                 m_data->checksum == m_checksum();
+    if (!valid) {
+        if (!fresh) {
+            std::cerr << "Error in state file " << path << ", resetting it\n";
+        }
+        // Keep what was set before the file was opened.
+        *m_data = saved;
+        m_data->checksum = m_checksum();
+        msync(m_data, sizeof(Data), MS_SYNC);
+        valid = fresh;
+    }
+    flock(fd, LOCK_UN);
+    return valid;
+}
+
+void
+StateFile::sync()
+{
+    if (m_fd >= 0) {
+        msync(m_data, sizeof(Data), MS_SYNC);
+    }
+}
+
+void
+StateFile::set_sync_interval(std::chrono::milliseconds interval)
+{
+    m_sync_interval = interval;
+}
+
+uint32_t
+StateFile::status() const
+{
+    return static_cast<uint32_t>(load(m_data->status));
+}
+
+void
+StateFile::set_status(uint32_t status)
+{
+    Writer writer(*this);
+    m_store({ { &m_data->status, status } });
+    m_written();
+}
+
+StateFile::time_point
+StateFile::snooze_until() const
+{
+    return to_time_point(load(m_data->snooze_until));
+}
+
+void
+StateFile::set_snooze_until(const time_point& until)
+{
+    Writer writer(*this);
+    m_store({ { &m_data->snooze_until, to_word(until) } });
+    m_written();
+}
+
+StateFile::time_point
+StateFile::snooze_until(const usb_id& id) const
+{
+    const auto slot = m_find(id);
+    if (slot == DEVICES) {
+        return time_point{};
+    }
+    return to_time_point(load(m_data->devices[slot].snooze_until));
+}
+
+bool
+StateFile::set_snooze_until(const usb_id& id, const time_point& until)
+{
+    Writer writer(*this);
+    const auto slot = m_slot(id);
+    if (slot == DEVICES) {
+        return false;
+    }
+    m_store({ { &m_data->devices[slot].snooze_until, to_word(until) } });
+    m_written();
+    return true;
+}
+
+StateFile::time_point
+StateFile::next_snooze_end(const time_point& now) const
+{
+    auto next = time_point::max();
+    for (const auto& device : m_data->devices) {
+        if (load(device.key) == 0) {
+            continue;
+        }
+        const auto until = to_time_point(load(device.snooze_until));
+        if (until > now && until < next) {
+            next = until;
+        }
+    }
+    return next;
+}
+
+std::vector<std::pair<usb_id, StateFile::time_point>>
+StateFile::device_snoozes(const time_point& now) const
+{
+    std::vector<std::pair<usb_id, time_point>> snoozes;
+    for (const auto& device : m_data->devices) {
+        const auto key = load(device.key);
+        const auto until = to_time_point(load(device.snooze_until));
+        if (key == 0 || until <= now) {
+            continue;
+        }
+        usb_id id;
+        id.vid = static_cast<uint16_t>(key >> 16);
+        id.pid = static_cast<uint16_t>(key);
+        snoozes.emplace_back(id, until);
+    }
+    return snoozes;
+}
+
+bool
+StateFile::connected(const usb_id& id) const
+{
+    const auto slot = m_find(id);
+    return slot != DEVICES && load(m_data->devices[slot].connected) != 0;
+}
+
+StateFile::time_point
+StateFile::connected_changed(const usb_id& id) const
+{
+    const auto slot = m_find(id);
+    if (slot == DEVICES) {
+        return time_point{};
+    }
+    return to_time_point(load(m_data->devices[slot].connected_changed));
+}
+
+bool
+StateFile::set_connected(const usb_id& id,
+                         bool connected,
+                         const time_point& at)
+{
+    Writer writer(*this);
+    const auto slot = m_slot(id);
+    if (slot == DEVICES) {
+        return false;
+    }
+    auto& device = m_data->devices[slot];
+    if (load(device.connected) != static_cast<uint64_t>(connected)) {
+        m_store({ { &device.connected, connected },
+                  { &device.connected_changed, to_word(at) } });
+        m_written();
+    }
+    return true;
+}
+
+void
+StateFile::retain(const std::vector<usb_id>& ids, const time_point& now)
+{
+    std::vector<uint64_t> kept;
+    for (const auto& id : ids) {
+        kept.push_back(id.packed());
+    }
+    std::sort(kept.begin(), kept.end());
+
+    Writer writer(*this);
+    for (auto& device : m_data->devices) {
+        const auto key = load(device.key);
+        if (key == 0 || std::binary_search(kept.begin(), kept.end(), key) ||
+            to_time_point(load(device.snooze_until)) > now) {
+            continue;
+        }
+        // The other words are cleared when the slot is taken again.
+        m_store({ { &device.key, 0 } });
+        m_written();
+    }
+}
+
+void
+StateFile::m_close()
+{
+    if (m_fd < 0) {
+        return;
+    }
+    msync(m_data, sizeof(Data), MS_SYNC);
+    munmap(m_data, sizeof(Data));
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+void
+StateFile::m_reset()
+{
+    *m_data = Data{};
+    m_data->magic = STATE_MAGIC;
+    m_data->version = STATE_VERSION;
+    m_data->checksum = m_checksum();
+}
+
+/// @details Sum of every word after the checksum weighted by an odd factor
+/// depending on its position, so swapped words change the sum as well.
+uint64_t
+StateFile::m_checksum() const
+{
+    static_assert(offsetof(Data, log) - offsetof(Data, status) == WORDS * 8);
+    const auto words = reinterpret_cast<const uint64_t*>(&m_data->status);
+
+    uint64_t sum = STATE_MAGIC;
+    for (std::size_t i = 0; i < WORDS; ++i) {
+        sum += load(words[i]) * (2 * i + 1);
+    }
+    return sum;
+}
+
+/// @details The log entries are written before the count that commits them
+/// and the count is cleared after the words, every store a release, so a
+/// crash at any point leaves either the old words with no committed log or a
+/// committed log.
+void
+StateFile::m_store(std::initializer_list<std::pair<uint64_t*, uint64_t>> stores)
+{
+    const auto base = reinterpret_cast<uint64_t*>(&m_data->status);
+    auto& log = m_data->log;
+
+    uint64_t checksum = load(m_data->checksum);
+    std::size_t count = 0;
+    for (const auto& [word, value] : stores) {
+        const auto index = static_cast<uint64_t>(word - base);
+        checksum += (value - load(*word)) * (2 * index + 1);
+        store(log.words[count], index);
+        store(log.values[count], value);
+        count++;
+    }
+    store(log.checksum, checksum);
+    store(log.count, count);
+
+    for (const auto& [word, value] : stores) {
+        store(*word, value);
+    }
+    store(m_data->checksum, checksum);
+    store(log.count, 0);
+}
+
+void
+StateFile::m_replay()
+{
+    auto& log = m_data->log;
+    const auto count = load(log.count);
+    if (count == 0) {
+        return;
+    }
+    if (count <= LOG_WORDS) {
+        const auto base = reinterpret_cast<uint64_t*>(&m_data->status);
+        for (std::size_t i = 0; i < count; ++i) {
+            const auto index = load(log.words[i]);
+            if (index < WORDS) {
+                store(base[index], load(log.values[i]));
+            }
+        }
+        store(m_data->checksum, load(log.checksum));
+    }
+    // A log that doesn't check out is from a torn page, the checksum catches
+    // it.
+    store(log.count, 0);
+}
+
+std::size_t
+StateFile::m_find(const usb_id& id) const
+{
+    const uint64_t key = id.packed();
+    for (std::size_t slot = 0; slot < DEVICES; ++slot) {
+        if (load(m_data->devices[slot].key) == key) {
+            return slot;
+        }
+    }
+    return DEVICES;
+}
+
+std::size_t
+StateFile::m_slot(const usb_id& id)
+{
+    const auto slot = m_find(id);
+    if (slot != DEVICES || id.packed() == 0) {
+        return slot;
+    }
+    for (std::size_t free = 0; free < DEVICES; ++free) {
+        auto& device = m_data->devices[free];
+        if (load(device.key) == 0) {
+            // A freed slot keeps the words of its last device, they are
+            // cleared before the key makes them visible.
+            m_store({ { &device.snooze_until, 0 }, { &device.connected, 0 } });
+            m_store({ { &device.connected_changed, 0 },
+                      { &device.key, id.packed() } });
+            return free;
+        }
+    }
+    return DEVICES;
+}
+
+void
+StateFile::m_written()
+{
+    if (m_fd < 0 || m_sync_interval.count() == 0) {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (now - m_last_sync >= m_sync_interval) {
+        m_last_sync = now;
+        msync(m_data, sizeof(Data), MS_ASYNC);
+    }
+}
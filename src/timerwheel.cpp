@@ -0,0 +1,257 @@
+#include "timerwheel.h"
+
+#include <algorithm>
+#include <bit>
+
+/// @brief Bits of the ticks in a slot of the last level.
+static constexpr unsigned TOP_BITS = 6 * (TimerWheel::LEVELS - 1);
+
+TimerWheel::TimerWheel(const time_point& now)
+  : m_now(m_to_ticks(now, false))
+{
+    for (auto& level : m_heads) {
+        level.fill(NIL);
+    }
+}
+
+uint64_t
+TimerWheel::m_to_ticks(const time_point& time, bool round_up)
+{
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      time.time_since_epoch())
+                      .count();
+    if (ns <= 0) {
+        return 0;
+    }
+    // Expiries are rounded up and the current time down, so a timer never
+    // expires early.
+    return (static_cast<uint64_t>(ns) + (round_up ? 999999 : 0)) / 1000000;
+}
+
+TimerWheel::time_point
+TimerWheel::m_from_ticks(uint64_t ticks)
+{
+    const auto limit = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         time_point::max().time_since_epoch())
+                         .count();
+    if (ticks >= static_cast<uint64_t>(limit)) {
+        return time_point::max();
+    }
+    return time_point(std::chrono::duration_cast<time_point::duration>(
+      std::chrono::milliseconds(ticks)));
+}
+
+TimerId
+TimerWheel::add(const time_point& expiry, uint64_t data)
+{
+    uint32_t index = m_free;
+    if (index != NIL) {
+        m_free = m_nodes[index].next;
+    } else {
+        index = static_cast<uint32_t>(m_nodes.size());
+        m_nodes.push_back(Node{});
+        m_nodes[index].generation = 1;
+    }
+
+    // The last level is a ring, timers past its last slot expire at the end
+    // of that slot.
+    const auto last = (((m_now >> TOP_BITS) + SLOTS) << TOP_BITS) - 1;
+    auto& node = m_nodes[index];
+    node.expiry = std::clamp(m_to_ticks(expiry, true), m_now, last);
+    node.data = data;
+    node.pending = true;
+    m_link(index);
+    m_size++;
+
+    if (m_next_valid) {
+        m_next = std::min(m_next, node.expiry);
+    }
+    return TimerId{ index, node.generation };
+}
+
+bool
+TimerWheel::cancel(TimerId id)
+{
+    if (id.index >= m_nodes.size()) {
+        return false;
+    }
+    auto& node = m_nodes[id.index];
+    if (!node.pending || node.generation != id.generation) {
+        return false;
+    }
+
+    m_unlink(id.index);
+    if (node.expiry == m_next) {
+        m_next_valid = false;
+    }
+    return true;
+}
+
+std::size_t
+TimerWheel::advance(const time_point& now, std::vector<uint64_t>& expired)
+{
+    const auto target = std::max(m_to_ticks(now, false), m_now);
+    const auto first = expired.size();
+
+    for (auto event = m_next_event(); event <= target;
+         event = m_next_event()) {
+        m_now = event;
+
+        // Timers of a higher-level slot the wheel enters move down, the
+        // highest level first so they can move down again.
+        for (auto level = LEVELS - 1; level > 0; --level) {
+            const auto shift = BITS * level;
+            const auto slot = (m_now >> shift) & (SLOTS - 1);
+            if ((m_now & ((uint64_t{ 1 } << shift) - 1)) != 0 ||
+                !(m_occupied[level] >> slot & 1)) {
+                continue;
+            }
+            auto index = m_heads[level][slot];
+            m_heads[level][slot] = NIL;
+            m_occupied[level] &= ~(uint64_t{ 1 } << slot);
+            while (index != NIL) {
+                const auto next = m_nodes[index].next;
+                m_link(index);
+                index = next;
+            }
+        }
+
+        const auto slot = m_now & (SLOTS - 1);
+        while (m_heads[0][slot] != NIL) {
+            const auto index = m_heads[0][slot];
+            expired.push_back(m_nodes[index].data);
+            m_unlink(index);
+        }
+    }
+
+    m_now = target;
+    m_next_valid = false;
+    return expired.size() - first;
+}
+
+TimerWheel::time_point
+TimerWheel::next_expiry() const
+{
+    if (m_size == 0) {
+        return time_point::max();
+    }
+    if (!m_next_valid) {
+        // Timers of a level expire after those of the levels below, and
+        // within a level in ring order of the slots. A level-0 slot is a
+        // single tick, only a higher-level slot has to be scanned.
+        m_next = UINT64_MAX;
+        for (std::size_t level = 0; level < LEVELS; ++level) {
+            const auto shift = BITS * level;
+            const auto digit = (m_now >> shift) & (SLOTS - 1);
+            const auto occupied =
+              std::rotr(m_occupied[level], static_cast<int>(digit));
+            if (!occupied) {
+                continue;
+            }
+            const auto offset =
+              static_cast<uint64_t>(std::countr_zero(occupied));
+            if (level == 0) {
+                m_next = m_now + offset;
+                break;
+            }
+            for (auto index = m_heads[level][(digit + offset) % SLOTS];
+                 index != NIL;
+                 index = m_nodes[index].next) {
+                m_next = std::min(m_next, m_nodes[index].expiry);
+            }
+            break;
+        }
+        m_next_valid = true;
+    }
+    return m_from_ticks(m_next);
+}
+
+void
+TimerWheel::reset(const time_point& now)
+{
+    for (uint32_t index = 0; index < m_nodes.size(); ++index) {
+        if (m_nodes[index].pending) {
+            m_unlink(index);
+        }
+    }
+    m_now = m_to_ticks(now, false);
+    m_next_valid = false;
+}
+
+TimerWheel::time_point
+TimerWheel::now() const
+{
+    return m_from_ticks(m_now);
+}
+
+void
+TimerWheel::m_link(uint32_t index)
+{
+    auto& node = m_nodes[index];
+    const auto expiry = std::max(node.expiry, m_now);
+
+    // The lowest level whose slot holds both the expiry and the current time.
+    std::size_t level = 0;
+    while (level + 1 < LEVELS &&
+           expiry >> (BITS * (level + 1)) != m_now >> (BITS * (level + 1))) {
+        level++;
+    }
+    const auto slot = (expiry >> (BITS * level)) & (SLOTS - 1);
+
+    node.level = static_cast<uint8_t>(level);
+    node.slot = static_cast<uint8_t>(slot);
+    node.prev = NIL;
+    node.next = m_heads[level][slot];
+    if (node.next != NIL) {
+        m_nodes[node.next].prev = index;
+    }
+    m_heads[level][slot] = index;
+    m_occupied[level] |= uint64_t{ 1 } << slot;
+}
+
+/// @details Frees the node as well, bumping its generation so ids of the
+/// timer no longer match.
+void
+TimerWheel::m_unlink(uint32_t index)
+{
+    auto& node = m_nodes[index];
+    if (node.prev != NIL) {
+        m_nodes[node.prev].next = node.next;
+    } else {
+        m_heads[node.level][node.slot] = node.next;
+        if (node.next == NIL) {
+            m_occupied[node.level] &= ~(uint64_t{ 1 } << node.slot);
+        }
+    }
+    if (node.next != NIL) {
+        m_nodes[node.next].prev = node.prev;
+    }
+
+    node.pending = false;
+    node.generation = node.generation == UINT32_MAX ? 1 : node.generation + 1;
+    node.next = m_free;
+    m_free = index;
+    m_size--;
+}
+
+uint64_t
+TimerWheel::m_next_event() const
+{
+    uint64_t next = UINT64_MAX;
+    for (std::size_t level = 0; level < LEVELS; ++level) {
+        const auto shift = BITS * level;
+        const auto digit = (m_now >> shift) & (SLOTS - 1);
+        // Slots in ring order from the current one. The current slot of a
+        // higher level was moved down when the wheel entered it.
+        auto occupied = std::rotr(m_occupied[level], static_cast<int>(digit));
+        if (level > 0) {
+            occupied &= ~uint64_t{ 1 };
+        }
+        if (!occupied) {
+            continue;
+        }
+        const auto offset = static_cast<uint64_t>(std::countr_zero(occupied));
+        next = std::min(next, ((m_now >> shift) + offset) << shift);
+    }
+    return next;
+}
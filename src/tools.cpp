@@ -1,53 +1,213 @@
 #include "tools.h"
+#include "periodparser.h"
 
 #include <algorithm>
-#include <sstream>
+#include <charconv>
+#include <fcntl.h>
+#include <libusb-1.0/libusb.h>
 #include <stdio.h>
-#include <usb.h>
+#include <unistd.h>
+
+/// @brief Read a sysfs attribute containing a 16-bit hex value.
+static bool
+read_hex_attribute(const std::filesystem::path& path, uint16_t& value)
+{
+    char buffer[16];
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const auto size = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    if (size <= 0) {
+        return false;
+    }
+
+    const auto result = std::from_chars(buffer, buffer + size, value, 16);
+    return result.ec == std::errc{};
+}
+
+bool
+list_usb_sysfs(const std::filesystem::path& root, std::vector<usb_id>& devices)
+{
+    std::error_code error;
+    std::filesystem::directory_iterator entries(root, error);
+    if (error) {
+        return false;
+    }
+
+    bool found = false;
+    for (const auto& entry : entries) {
+        usb_id id{};
+        // Interfaces (e.g. 1-1:1.0) have no idVendor and are skipped.
+        if (read_hex_attribute(entry.path() / "idVendor", id.vid) &&
+            read_hex_attribute(entry.path() / "idProduct", id.pid)) {
+            devices.push_back(id);
+            found = true;
+        }
+    }
+    return found;
+}
+
+/// @brief Read a short sysfs attribute without the trailing newline.
+static std::string
+read_string_attribute(const std::filesystem::path& path)
+{
+    char buffer[256];
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {};
+    }
+    const auto size = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    if (size <= 0) {
+        return {};
+    }
+
+    std::string value(buffer, static_cast<std::size_t>(size));
+    while (!value.empty() && (value.back() == '\n' || value.back() == ' ')) {
+        value.pop_back();
+    }
+    return value;
+}
+
+bool
+list_usb_sysfs(const std::filesystem::path& root,
+               std::vector<USBDeviceInstance>& devices)
+{
+    std::error_code error;
+    std::filesystem::directory_iterator entries(root, error);
+    if (error) {
+        return false;
+    }
+
+    bool found = false;
+    for (const auto& entry : entries) {
+        USBDeviceInstance device{};
+        if (read_hex_attribute(entry.path() / "idVendor", device.id.vid) &&
+            read_hex_attribute(entry.path() / "idProduct", device.id.pid)) {
+            device.port = parse_usb_port(entry.path().filename().native());
+            device.serial = read_string_attribute(entry.path() / "serial");
+            devices.push_back(std::move(device));
+            found = true;
+        }
+    }
+    return found;
+}
+
+std::string
+USBPort::to_string() const
+{
+    if (empty()) {
+        return {};
+    }
+    if (depth == 0) {
+        return "usb" + std::to_string(bus);
+    }
+    std::string name = std::to_string(bus);
+    for (uint8_t i = 0; i < depth; ++i) {
+        name += (i == 0 ? '-' : '.');
+        name += std::to_string(ports[i]);
+    }
+    return name;
+}
+
+USBPort
+parse_usb_port(std::string_view name)
+{
+    USBPort port;
+    const auto end = name.data() + name.size();
+
+    if (name.starts_with("usb")) {
+        const auto result = std::from_chars(name.data() + 3, end, port.bus);
+        if (result.ec != std::errc{} || result.ptr != end) {
+            return USBPort{};
+        }
+        return port;
+    }
+
+    auto result = std::from_chars(name.data(), end, port.bus);
+    if (result.ec != std::errc{} || result.ptr == end || *result.ptr != '-') {
+        return USBPort{};
+    }
+    auto next = result.ptr;
+    // Interfaces, e.g. 1-1.4:1.0, end with a configuration and are rejected.
+    while (next != end && (*next == '-' || *next == '.')) {
+        if (port.depth == USBPort::MAX_DEPTH) {
+            return USBPort{};
+        }
+        result = std::from_chars(next + 1, end, port.ports[port.depth]);
+        if (result.ec != std::errc{}) {
+            return USBPort{};
+        }
+        port.depth++;
+        next = result.ptr;
+    }
+    if (next != end || port.depth == 0) {
+        return USBPort{};
+    }
+    return port;
+}
+
+std::string
+read_usb_serial(const std::filesystem::path& root, const USBPort& port)
+{
+    if (port.empty()) {
+        return {};
+    }
+    return read_string_attribute(root / port.to_string() / "serial");
+}
 
 std::vector<usb_id>
-list_usb()
+list_usb_libusb(libusb_context* ctx)
 {
     std::vector<usb_id> found_devices{};
+    libusb_device** list = nullptr;
 
-    struct usb_bus* bus;
-    struct usb_device* dev;
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
-
-    for (bus = usb_busses; bus; bus = bus->next) {
-        for (dev = bus->devices; dev; dev = dev->next) {
-            found_devices.push_back({
-              dev->descriptor.idVendor,
-              dev->descriptor.idProduct,
-            });
+    const auto count = libusb_get_device_list(ctx, &list);
+    for (ssize_t i = 0; i < count; ++i) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) == LIBUSB_SUCCESS) {
+            found_devices.push_back({ desc.idVendor, desc.idProduct });
         }
     }
-
+    if (count >= 0) {
+        libusb_free_device_list(list, 1);
+    }
     return found_devices;
 }
 
-usb_id
-usb_id_from_string(const std::string& id)
+std::vector<usb_id>
+list_usb(libusb_context* ctx)
 {
-    std::stringstream ss;
-    std::string_view id_v(id);
-    uint16_t vid;
-    uint16_t pid;
-
-    auto delimiter = id_v.find(':');
+    std::vector<usb_id> found_devices{};
 
-    if (delimiter == std::string::npos) {
-        return usb_id{};
+    if (list_usb_sysfs(SYSFS_USB_DEVICES, found_devices)) {
+        return found_devices;
     }
+    return list_usb_libusb(ctx);
+}
 
-    ss << std::hex << id_v.substr(0, delimiter);
-    ss >> vid;
-    ss.clear();
+std::vector<usb_id>
+list_usb()
+{
+    std::vector<usb_id> found_devices{};
 
-    ss << std::hex << id_v.substr(delimiter + 1);
-    ss >> pid;
+    if (list_usb_sysfs(SYSFS_USB_DEVICES, found_devices)) {
+        return found_devices;
+    }
+
+    libusb_context* ctx = nullptr;
+    if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+        return found_devices;
+    }
+    found_devices = list_usb_libusb(ctx);
+    libusb_exit(ctx);
+    return found_devices;
+}
 
-    return usb_id(vid, pid);
+usb_id
+usb_id_from_string(const std::string& id)
+{
+    return parse_usb_id(id).value_or(usb_id{ 0, 0 });
 }
@@ -0,0 +1,338 @@
+#include "transitionindex.h"
+
+#include <algorithm>
+#include <bit>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static bool
+earlier(const TransitionIndex::Transition& lhs,
+        const TransitionIndex::Transition& rhs)
+{
+    return lhs.minute < rhs.minute;
+}
+
+TransitionIndex::TransitionIndex(CompiledSchedule schedule)
+  : m_schedule(std::move(schedule))
+{
+    for (std::size_t device = 0; device < m_schedule.size(); ++device) {
+        m_index(static_cast<uint32_t>(device));
+    }
+    std::stable_sort(m_timeline.begin(), m_timeline.end(), earlier);
+}
+
+std::size_t
+TransitionIndex::add(DeviceSchedule device)
+{
+    m_schedule.push_back(std::move(device));
+    const auto index = m_schedule.size() - 1;
+    const auto indexed = m_timeline.size();
+    m_index(static_cast<uint32_t>(index));
+    m_merge(indexed);
+    return index;
+}
+
+void
+TransitionIndex::add(CompiledSchedule devices)
+{
+    const auto indexed = m_timeline.size();
+    for (auto& device : devices) {
+        m_schedule.push_back(std::move(device));
+        m_index(static_cast<uint32_t>(m_schedule.size() - 1));
+    }
+    m_merge(indexed);
+}
+
+void
+TransitionIndex::remove(std::vector<uint32_t> devices)
+{
+    if (devices.empty()) {
+        return;
+    }
+    std::sort(devices.begin(), devices.end());
+
+    // New index of every device, REMOVED for the removed ones.
+    constexpr uint32_t REMOVED = UINT32_MAX;
+    std::vector<uint32_t> renumbered(m_schedule.size());
+    uint32_t next = 0;
+    auto removed = devices.begin();
+    for (uint32_t device = 0; device < m_schedule.size(); ++device) {
+        if (removed != devices.end() && *removed == device) {
+            renumbered[device] = REMOVED;
+            removed = std::upper_bound(removed, devices.end(), device);
+            continue;
+        }
+        if (next != device) {
+            m_schedule[next] = std::move(m_schedule[device]);
+        }
+        renumbered[device] = next++;
+    }
+    m_schedule.resize(next);
+
+    // The kept entries stay in order, so the timeline stays sorted.
+    std::size_t kept = 0;
+    for (auto transition : m_timeline) {
+        transition.device = renumbered[transition.device];
+        if (transition.device != REMOVED) {
+            m_timeline[kept++] = transition;
+        }
+    }
+    m_timeline.resize(kept);
+
+    kept = 0;
+    auto& intervals = m_intervals;
+    for (std::size_t i = 0; i < intervals.devices.size(); ++i) {
+        const auto device = renumbered[intervals.devices[i]];
+        if (device != REMOVED) {
+            intervals.begins[kept] = intervals.begins[i];
+            intervals.ends[kept] = intervals.ends[i];
+            intervals.devices[kept++] = device;
+        }
+    }
+    intervals.begins.resize(kept);
+    intervals.ends.resize(kept);
+    intervals.devices.resize(kept);
+
+    for (auto node = m_nodes.begin(); node != m_nodes.end();) {
+        auto& node_devices = node->second;
+        kept = 0;
+        for (const auto device : node_devices) {
+            if (renumbered[device] != REMOVED) {
+                node_devices[kept++] = renumbered[device];
+            }
+        }
+        node_devices.resize(kept);
+        node = node_devices.empty() ? m_nodes.erase(node) : std::next(node);
+    }
+}
+
+std::vector<uint32_t>
+TransitionIndex::required_at(std::size_t minute) const
+{
+    std::vector<uint32_t> devices;
+    for (auto node = m_leaf(minute); node > 0; node /= 2) {
+        const auto found = m_nodes.find(node);
+        if (found != m_nodes.end()) {
+            devices.insert(
+              devices.end(), found->second.begin(), found->second.end());
+        }
+    }
+    std::sort(devices.begin(), devices.end());
+    return devices;
+}
+
+/// @brief Set the bit of a device in a bitmap.
+static void
+mark(uint64_t* bitmap, uint32_t device)
+{
+    bitmap[device / 64] |= uint64_t{ 1 } << (device % 64);
+}
+
+/// @brief Mark the devices of the intervals from first on containing minute.
+static void
+mark_scalar(const uint16_t* begins,
+            const uint16_t* ends,
+            const uint32_t* devices,
+            std::size_t first,
+            std::size_t count,
+            uint16_t minute,
+            uint64_t* bitmap)
+{
+    for (auto i = first; i < count; ++i) {
+        const uint64_t hit = (begins[i] <= minute) & (minute < ends[i]);
+        bitmap[devices[i] / 64] |= hit << (devices[i] % 64);
+    }
+}
+
+#if defined(__x86_64__)
+// Minutes fit in int16_t, so the signed compares work for the unsigned
+// values. Each 16-bit lane sets two bits of the byte movemask.
+
+/// @return number of intervals scanned, the rest are left for mark_scalar.
+static std::size_t
+mark_sse2(const uint16_t* begins,
+          const uint16_t* ends,
+          const uint32_t* devices,
+          std::size_t count,
+          uint16_t minute,
+          uint64_t* bitmap)
+{
+    const auto after = _mm_set1_epi16(static_cast<int16_t>(minute + 1));
+    const auto at = _mm_set1_epi16(static_cast<int16_t>(minute));
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const auto begin =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(begins + i));
+        const auto end =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(ends + i));
+        const auto hit = _mm_and_si128(_mm_cmpgt_epi16(after, begin),
+                                       _mm_cmpgt_epi16(end, at));
+        for (auto bits = static_cast<uint32_t>(_mm_movemask_epi8(hit)); bits;
+             bits &= bits - 1, bits &= bits - 1) {
+            mark(bitmap, devices[i + std::countr_zero(bits) / 2]);
+        }
+    }
+    return i;
+}
+
+/// @return number of intervals scanned, the rest are left for mark_scalar.
+__attribute__((target("avx2"))) static std::size_t
+mark_avx2(const uint16_t* begins,
+          const uint16_t* ends,
+          const uint32_t* devices,
+          std::size_t count,
+          uint16_t minute,
+          uint64_t* bitmap)
+{
+    const auto after = _mm256_set1_epi16(static_cast<int16_t>(minute + 1));
+    const auto at = _mm256_set1_epi16(static_cast<int16_t>(minute));
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const auto begin =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begins + i));
+        const auto end =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ends + i));
+        const auto hit = _mm256_and_si256(_mm256_cmpgt_epi16(after, begin),
+                                          _mm256_cmpgt_epi16(end, at));
+        for (auto bits = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+             bits;
+             bits &= bits - 1, bits &= bits - 1) {
+            mark(bitmap, devices[i + std::countr_zero(bits) / 2]);
+        }
+    }
+    return i;
+}
+#endif
+
+void
+TransitionIndex::required_bitmap(std::size_t minute,
+                                 std::vector<uint64_t>& bitmap) const
+{
+    bitmap.assign((m_schedule.size() + 63) / 64, 0);
+    const auto at = static_cast<uint16_t>(minute % MINUTES_PER_WEEK);
+    const auto begins = m_intervals.begins.data();
+    const auto ends = m_intervals.ends.data();
+    const auto devices = m_intervals.devices.data();
+    const auto count = m_intervals.begins.size();
+
+    std::size_t scanned = 0;
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    scanned = avx2
+                ? mark_avx2(begins, ends, devices, count, at, bitmap.data())
+                : mark_sse2(begins, ends, devices, count, at, bitmap.data());
+#endif
+    mark_scalar(begins, ends, devices, scanned, count, at, bitmap.data());
+}
+
+std::size_t
+TransitionIndex::next_transition(std::size_t minute) const
+{
+    if (m_timeline.empty()) {
+        return MINUTES_PER_WEEK;
+    }
+    minute %= MINUTES_PER_WEEK;
+
+    const auto next = std::upper_bound(
+      m_timeline.begin(),
+      m_timeline.end(),
+      minute,
+      [](std::size_t value, const Transition& item) {
+          return value < item.minute;
+      });
+    if (next == m_timeline.end()) {
+        return m_timeline.front().minute + MINUTES_PER_WEEK - minute;
+    }
+    return next->minute - minute;
+}
+
+std::span<const TransitionIndex::Transition>
+TransitionIndex::transitions_at(std::size_t minute) const
+{
+    minute %= MINUTES_PER_WEEK;
+    const auto [first, last] = std::equal_range(
+      m_timeline.begin(),
+      m_timeline.end(),
+      Transition{ static_cast<uint16_t>(minute), false, 0 },
+      earlier);
+    return { first, last };
+}
+
+/// @details Appends the transitions of the device to the timeline, the
+/// caller sorts it.
+void
+TransitionIndex::m_index(uint32_t device)
+{
+    const auto& mask = m_schedule[device].mask;
+    if (!mask.any()) {
+        return;
+    }
+
+    // Minutes where the marking of the device flips, in ascending order.
+    std::vector<std::size_t> flips;
+    if (mask.test(0) != mask.test(MINUTES_PER_WEEK - 1)) {
+        flips.push_back(0);
+    }
+    for (std::size_t minute = 0;;) {
+        const auto step = mask.next_change(minute);
+        minute += step;
+        if (step == MINUTES_PER_WEEK || minute >= MINUTES_PER_WEEK) {
+            break;
+        }
+        flips.push_back(minute);
+    }
+
+    if (flips.empty()) {
+        // Marked for the whole week, required all the time.
+        m_insert(0, MINUTES_PER_WEEK, device);
+        return;
+    }
+
+    for (std::size_t i = 0; i < flips.size(); ++i) {
+        const auto minute = flips[i];
+        const bool required = mask.test(minute);
+        m_timeline.push_back(
+          Transition{ static_cast<uint16_t>(minute), required, device });
+
+        if (required) {
+            const auto end = flips[(i + 1) % flips.size()];
+            if (end > minute) {
+                m_insert(minute, end, device);
+            } else {
+                m_insert(minute, MINUTES_PER_WEEK, device);
+                m_insert(0, end, device);
+            }
+        }
+    }
+}
+
+void
+TransitionIndex::m_merge(std::size_t indexed)
+{
+    // Only the new transitions need sorting.
+    const auto middle = m_timeline.begin() + indexed;
+    std::sort(middle, m_timeline.end(), earlier);
+    std::inplace_merge(m_timeline.begin(), middle, m_timeline.end(), earlier);
+}
+
+/// @details Standard bottom-up segment tree insertion, the interval ends up
+/// in at most two nodes per level. The interval is also appended to
+/// m_intervals.
+void
+TransitionIndex::m_insert(std::size_t begin, std::size_t end, uint32_t device)
+{
+    m_intervals.begins.push_back(static_cast<uint16_t>(begin));
+    m_intervals.ends.push_back(static_cast<uint16_t>(end));
+    m_intervals.devices.push_back(device);
+
+    for (begin += LEAVES, end += LEAVES; begin < end; begin /= 2, end /= 2) {
+        if (begin & 1) {
+            m_nodes[static_cast<uint32_t>(begin++)].push_back(device);
+        }
+        if (end & 1) {
+            m_nodes[static_cast<uint32_t>(--end)].push_back(device);
+        }
+    }
+}
@@ -0,0 +1,179 @@
+#include "udevsource.h"
+#include "usbtracker.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+
+#include <errno.h>
+#include <libudev.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+bool
+usb_id_from_uevent_product(std::string_view product, usb_id& id)
+{
+    const auto end = product.data() + product.size();
+    auto result = std::from_chars(product.data(), end, id.vid, 16);
+    if (result.ec != std::errc{} || result.ptr == end || *result.ptr != '/') {
+        return false;
+    }
+    result = std::from_chars(result.ptr + 1, end, id.pid, 16);
+    return result.ec == std::errc{} && (result.ptr == end || *result.ptr == '/');
+}
+
+UdevSource::~UdevSource()
+{
+    stop();
+}
+
+std::vector<usb_id>
+UdevSource::enumerate()
+{
+    std::vector<usb_id> devices;
+    list_usb_sysfs(SYSFS_USB_DEVICES, devices);
+    return devices;
+}
+
+std::vector<USBDeviceInstance>
+UdevSource::enumerate_instances()
+{
+    std::vector<USBDeviceInstance> devices;
+    list_usb_sysfs(SYSFS_USB_DEVICES, devices);
+    return devices;
+}
+
+bool
+UdevSource::start(USBTracker& tracker)
+{
+    m_udev = udev_new();
+    if (m_udev) {
+        m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+    }
+    if (!m_monitor ||
+        udev_monitor_filter_add_match_subsystem_devtype(
+          m_monitor, "usb", "usb_device") < 0 ||
+        udev_monitor_enable_receiving(m_monitor) < 0) {
+        std::cerr << "Error creating a udev monitor\n";
+        stop();
+        return false;
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    for (auto fd : { udev_monitor_get_fd(m_monitor), m_stop_fd }) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    m_tracker = &tracker;
+    m_running = true;
+    m_thread = std::thread(&UdevSource::m_event_loop, this);
+    return true;
+}
+
+void
+UdevSource::stop()
+{
+    m_running = false;
+    if (m_stop_fd >= 0) {
+        const uint64_t one = 1;
+        (void)!write(m_stop_fd, &one, sizeof(one));
+    }
+    if (m_thread.joinable())
+        m_thread.join();
+
+    if (m_monitor) {
+        udev_monitor_unref(m_monitor);
+        m_monitor = nullptr;
+    }
+    if (m_udev) {
+        udev_unref(m_udev);
+        m_udev = nullptr;
+    }
+    m_tracker = nullptr;
+
+    for (auto fd : { m_stop_fd, m_epoll_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    m_stop_fd = -1;
+    m_epoll_fd = -1;
+}
+
+void
+UdevSource::join()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void
+UdevSource::set_filter(const std::vector<uint32_t>& wanted, bool match_any)
+{
+    std::lock_guard lock(m_filter_mtx);
+    m_wanted = wanted;
+    std::sort(m_wanted.begin(), m_wanted.end());
+    m_match_any = match_any;
+}
+
+void
+UdevSource::m_event_loop()
+{
+    constexpr int max_events = 2;
+    epoll_event events[max_events];
+
+    while (m_running) {
+        const int count = epoll_wait(m_epoll_fd, events, max_events, -1);
+        if (count < 0 && errno != EINTR) {
+            std::cerr << "Error waiting for udev events\n";
+            break;
+        }
+
+        m_tracker->note_wakeup();
+        if (!m_running) {
+            break;
+        }
+        m_receive();
+    }
+}
+
+void
+UdevSource::m_receive()
+{
+    // The monitor socket is non-blocking, receive until it is empty.
+    while (auto device = udev_monitor_receive_device(m_monitor)) {
+        const char* action = udev_device_get_action(device);
+        const char* product =
+          udev_device_get_property_value(device, "PRODUCT");
+        USBDeviceInstance instance{};
+        if (action && product &&
+            usb_id_from_uevent_product(product, instance.id) &&
+            m_is_wanted(instance.id)) {
+            if (const char* name = udev_device_get_sysname(device)) {
+                instance.port = parse_usb_port(name);
+            }
+            if (std::strcmp(action, "add") == 0) {
+                const char* serial =
+                  udev_device_get_sysattr_value(device, "serial");
+                instance.serial = serial ? serial : "";
+                m_tracker->handle_device_add_event(instance);
+            } else if (std::strcmp(action, "remove") == 0) {
+                m_tracker->handle_device_remove_event(instance);
+            }
+        }
+        udev_device_unref(device);
+    }
+}
+
+bool
+UdevSource::m_is_wanted(const usb_id& id)
+{
+    std::lock_guard lock(m_filter_mtx);
+    return m_match_any ||
+           std::binary_search(m_wanted.begin(), m_wanted.end(), id.packed());
+}
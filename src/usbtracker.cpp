@@ -1,125 +1,237 @@
 #include "usbtracker.h"
-#include <filesystem>
-#include <fstream>
+#include "libusbsource.h"
+#include "metrics.h"
+#include "udevsource.h"
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <optional>
 
-#include <libusb-1.0/libusb.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-#include <usb.h>
+#include <sys/eventfd.h>
 
-int
-hotplug_callback(struct libusb_context* ctx [[maybe_unused]],
-                 struct libusb_device* dev,
-                 libusb_hotplug_event event,
-                 void* user_data)
+static std::atomic<USBBackend> default_backend{ LIBUSB_BACKEND };
+
+static std::unique_ptr<DeviceSource>
+make_source(USBBackend backend)
 {
-    static libusb_device_handle* dev_handle = NULL;
-    struct libusb_device_descriptor desc;
+    if (backend == UDEV_BACKEND) {
+        return std::make_unique<UdevSource>();
+    }
+    return std::make_unique<LibusbSource>();
+}
 
-    (void)libusb_get_device_descriptor(dev, &desc);
+USBTracker::USBTracker()
+  : USBTracker(default_backend.load())
+{
+}
 
-    usb_id new_id{
-        .vid = desc.idVendor,
-        .pid = desc.idProduct,
-    };
+USBTracker::USBTracker(USBBackend backend)
+  : USBTracker(make_source(backend))
+{
+}
 
-    auto tracker = static_cast<USBTracker*>(user_data);
+USBTracker::USBTracker(std::unique_ptr<DeviceSource> source)
+  : m_source(std::move(source))
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
 
-    if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
-        tracker->handle_device_add_event(new_id);
+USBTracker::~USBTracker()
+{
+    stop_tracking();
+    close(m_event_fd);
+}
 
-    } else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
-        tracker->handle_device_remove_event(new_id);
-        if (dev_handle) {
-            libusb_close(dev_handle);
-            dev_handle = NULL;
-        }
-    } else {
-        std::cerr << "Unhandled event" << event << "\n";
+double
+USBTrackerStats::wakeups_per_second() const
+{
+    const auto seconds = std::chrono::duration<double>(elapsed).count();
+    return seconds > 0 ? static_cast<double>(wakeups) / seconds : 0.0;
+}
+
+std::chrono::nanoseconds
+USBTrackerStats::mean_latency() const
+{
+    if (events == 0) {
+        return std::chrono::nanoseconds{ 0 };
     }
-    return 0;
+    return total_latency / static_cast<int64_t>(events);
 }
 
-int
-track_usb_devices(USBTracker* tracker)
+void
+USBTracker::start_tracking()
 {
-    libusb_hotplug_callback_handle callback_handle;
-    int rc;
-    struct timeval blocktime
+    m_running = true;
+    auto instances = m_source->enumerate_instances();
+    std::vector<usb_id> ids;
+    for (const auto& instance : instances) {
+        ids.push_back(instance.id);
+    }
     {
-        .tv_sec = 0, .tv_usec = 500,
-    };
+        std::lock_guard lock(m_mtx);
+        m_connected_devices.assign(ids);
+        m_instances.store(
+          std::make_shared<const std::vector<USBDeviceInstance>>(
+            std::move(instances)));
+        m_changes++;
+    }
+    {
+        std::lock_guard lock(m_filter_mtx);
+        m_tracked_all = true;
+        m_tracked.clear();
+    }
+    m_sync_filter();
+    if (!m_source->start(*this)) {
+        m_running = false;
+    }
+}
 
-    libusb_init(NULL);
+void
+USBTracker::stop_tracking()
+{
+    m_running = false;
+    m_source->stop();
+}
 
-    rc = libusb_hotplug_register_callback(NULL,
-                                          LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
-                                            LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
-                                          0,
-                                          LIBUSB_HOTPLUG_MATCH_ANY,
-                                          LIBUSB_HOTPLUG_MATCH_ANY,
-                                          LIBUSB_HOTPLUG_MATCH_ANY,
-                                          hotplug_callback,
-                                          tracker,
-                                          &callback_handle);
-    if (LIBUSB_SUCCESS != rc) {
-        std::cerr << "Error creating a hotplug callback\n";
-        libusb_exit(NULL);
-        return EXIT_FAILURE;
+void
+USBTracker::note_wakeup()
+{
+    if (m_measure) {
+        m_wakeups++;
+    }
+    if (m_measure || Metrics::enabled()) {
+        m_wake_time = std::chrono::steady_clock::now();
     }
+}
 
-    while (tracker->is_running()) {
-        libusb_handle_events_timeout_completed(NULL, &blocktime, NULL);
-        usleep(1000UL);
+void
+USBTracker::m_record_event()
+{
+    Metrics::add(HOTPLUG_EVENTS);
+    if (!m_measure && !Metrics::enabled()) {
+        return;
     }
 
-    libusb_hotplug_deregister_callback(NULL, callback_handle);
-    libusb_exit(NULL);
+    const auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - m_wake_time)
+                           .count();
+    Metrics::record(EVENT_LATENCY, std::chrono::nanoseconds(latency));
+    if (!m_measure) {
+        return;
+    }
+    m_events++;
+    m_total_latency_ns += latency;
 
-    return 0;
+    auto max = m_max_latency_ns.load();
+    while (latency > max &&
+           !m_max_latency_ns.compare_exchange_weak(max, latency)) {
+    }
 }
 
-USBTracker::~USBTracker()
+void
+USBTracker::handle_device_add_event(const usb_id& dev)
 {
-    stop_tracking();
+    handle_device_add_event(USBDeviceInstance{ dev });
 }
 
 void
-USBTracker::start_tracking()
+USBTracker::handle_device_remove_event(const usb_id& dev)
 {
-    m_running = true;
-    m_connected_devices = list_usb();
-    m_thread = std::thread(track_usb_devices, this);
+    handle_device_remove_event(USBDeviceInstance{ dev });
 }
 
 void
-USBTracker::stop_tracking()
+USBTracker::handle_device_add_event(const USBDeviceInstance& dev)
 {
-    m_running = false;
-    if (m_thread.joinable())
-        m_thread.join();
+    m_lock();
+    auto instances = *m_instances.load();
+    std::optional<usb_id> replaced;
+    if (!dev.port.empty()) {
+        const auto known = std::find_if(
+          instances.begin(), instances.end(), [&dev](const auto& instance) {
+              return instance.port == dev.port;
+          });
+        if (known != instances.end() && known->id == dev.id) {
+            m_mtx.unlock();
+            return;
+        }
+        if (known != instances.end()) {
+            // The remove event of the previous device was missed.
+            replaced = known->id;
+            m_connected_devices.erase(known->id);
+            instances.erase(known);
+        }
+    }
+    if (!m_connected_devices.insert(dev.id)) {
+        std::cerr << "Too many connected USB devices to track\n";
+    } else {
+        instances.push_back(dev);
+    }
+    m_changes++;
+    m_instances.store(std::make_shared<const std::vector<USBDeviceInstance>>(
+      std::move(instances)));
+    m_mtx.unlock();
+
+    if (replaced) {
+        m_notify(*replaced, DEVICE_LEFT);
+    }
+    m_notify(dev.id, DEVICE_ARRIVED);
 }
 
 void
-USBTracker::handle_device_add_event(const usb_id& dev)
+USBTracker::handle_device_remove_event(const USBDeviceInstance& dev)
 {
-    m_mtx.lock();
-    m_connected_devices.push_back(dev);
-    m_callback(m_user_data);
+    m_lock();
+    auto instances = *m_instances.load();
+    auto found = instances.end();
+    if (!dev.port.empty()) {
+        found = std::find_if(
+          instances.begin(), instances.end(), [&dev](const auto& instance) {
+              return instance.id == dev.id && instance.port == dev.port;
+          });
+    }
+    if (found == instances.end()) {
+        // Without a known port any instance of the vid:pid will do, prefer
+        // one whose port is unknown too.
+        found = std::find_if(
+          instances.begin(), instances.end(), [&dev](const auto& instance) {
+              return instance.id == dev.id && instance.port.empty();
+          });
+    }
+    if (found == instances.end() && dev.port.empty()) {
+        found = std::find_if(
+          instances.begin(), instances.end(), [&dev](const auto& instance) {
+              return instance.id == dev.id;
+          });
+    }
+    if (found != instances.end()) {
+        m_connected_devices.erase(dev.id);
+        instances.erase(found);
+        m_instances.store(
+          std::make_shared<const std::vector<USBDeviceInstance>>(
+            std::move(instances)));
+        m_changes++;
+    }
     m_mtx.unlock();
+    m_notify(dev.id, DEVICE_LEFT);
 }
 
 void
-USBTracker::handle_device_remove_event(const usb_id& dev)
+USBTracker::m_notify(const usb_id& dev, USBEventType type)
+{
+    m_record_event();
+    MetricTimer callbacks(CALLBACK_TIME);
+    m_handle_event(dev, type);
+    if (m_callback) {
+        m_callback(m_user_data);
+    }
+}
+
+void
+USBTracker::m_lock()
 {
+    MetricTimer wait(LOCK_WAIT);
     m_mtx.lock();
-    m_connected_devices.erase(std::remove(std::begin(m_connected_devices),
-                                          std::end(m_connected_devices),
-                                          dev),
-                              std::end(m_connected_devices));
-    m_callback(m_user_data);
-    m_mtx.unlock();
 }
 
 bool
@@ -131,18 +243,32 @@ USBTracker::is_running() const
 void
 USBTracker::join_thread()
 {
-    m_thread.join();
+    m_source->join();
 }
 
 bool
-USBTracker::usb_id_is_connected(const usb_id& device_id)
+USBTracker::usb_id_is_connected(const usb_id& device_id) const
 {
-    m_mtx.lock();
-    bool result = std::find(std::begin(m_connected_devices),
-                            std::end(m_connected_devices),
-                            device_id) != std::end(m_connected_devices);
-    m_mtx.unlock();
-    return result;
+    return m_connected_devices.contains(device_id);
+}
+
+bool
+USBTracker::is_connected(const USBDevice& device) const
+{
+    if (!device.pinned()) {
+        return m_connected_devices.contains(device.id);
+    }
+    const auto instances = m_instances.load();
+    return std::any_of(
+      instances->begin(), instances->end(), [&device](const auto& instance) {
+          return device.matches(instance);
+      });
+}
+
+std::vector<USBDeviceInstance>
+USBTracker::connected_devices() const
+{
+    return *m_instances.load();
 }
 
 void
@@ -156,3 +282,332 @@ USBTracker::set_event_cb_data(void* data)
 {
     m_user_data = data;
 }
+
+void
+USBTracker::set_executor(Executor executor)
+{
+    m_executor = std::move(executor);
+}
+
+WaitList<USBEvent>::Awaiter
+USBTracker::next_event(std::vector<usb_id> filter)
+{
+    if (filter.empty()) {
+        return { m_event_waiters, m_executor };
+    }
+    return { m_event_waiters,
+             m_executor,
+             [filter = std::move(filter)](const USBEvent& event) {
+                 return std::find(filter.begin(), filter.end(), event.id) !=
+                        filter.end();
+             } };
+}
+
+WaitList<USBEvent>::Awaiter
+USBTracker::next_event(const usb_id& device)
+{
+    return { m_event_waiters,
+             m_executor,
+             [device](const USBEvent& event) { return event.id == device; } };
+}
+
+int
+USBTracker::event_fd() const
+{
+    return m_event_fd;
+}
+
+std::size_t
+USBTracker::drain_events(std::vector<USBEvent>& events, std::size_t max_events)
+{
+    uint64_t count;
+    (void)!read(m_event_fd, &count, sizeof(count));
+
+    const auto drained = m_event_queue.drain(
+      [&events](const USBEvent& event) { events.push_back(event); },
+      max_events);
+
+    if (drained == max_events) {
+        // Events may be left in the queue, keep the descriptor readable.
+        const uint64_t one = 1;
+        (void)!write(m_event_fd, &one, sizeof(one));
+    }
+    return drained;
+}
+
+uint64_t
+USBTracker::dropped_events() const
+{
+    return m_event_queue.dropped();
+}
+
+std::shared_ptr<USBTracker>
+USBTracker::shared()
+{
+    static std::mutex shared_mtx;
+    static std::weak_ptr<USBTracker> shared_tracker;
+
+    std::lock_guard lock(shared_mtx);
+    auto tracker = shared_tracker.lock();
+    if (!tracker) {
+        tracker = std::make_shared<USBTracker>();
+        tracker->start_tracking();
+        shared_tracker = tracker;
+    }
+    return tracker;
+}
+
+void
+USBTracker::set_default_backend(USBBackend backend)
+{
+    default_backend = backend;
+}
+
+SubscriptionId
+USBTracker::subscribe(const std::vector<usb_id>& devices,
+                      std::function<void(const USBEvent&)> callback)
+{
+    std::unique_lock lock(m_subscription_mtx);
+    const auto id = m_next_subscription++;
+    m_subscriptions[id] = Subscription{
+        devices,
+        std::make_shared<const std::function<void(const USBEvent&)>>(
+          std::move(callback))
+    };
+    m_index_subscription(id);
+    lock.unlock();
+
+    m_sync_filter();
+    return id;
+}
+
+void
+USBTracker::update_subscription(SubscriptionId id,
+                                const std::vector<usb_id>& devices)
+{
+    std::unique_lock lock(m_subscription_mtx);
+    if (!m_subscriptions.contains(id)) {
+        return;
+    }
+    m_unindex_subscription(id);
+    m_subscriptions[id].devices = devices;
+    m_index_subscription(id);
+    lock.unlock();
+
+    m_sync_filter();
+}
+
+void
+USBTracker::unsubscribe(SubscriptionId id)
+{
+    std::unique_lock lock(m_subscription_mtx);
+    if (!m_subscriptions.contains(id)) {
+        return;
+    }
+    m_unindex_subscription(id);
+    m_subscriptions.erase(id);
+    m_callback_done.wait(lock, [this, id] {
+        return std::none_of(
+          m_running_callbacks.begin(),
+          m_running_callbacks.end(),
+          [id](const auto& running) {
+              return running.first == id &&
+                     running.second != std::this_thread::get_id();
+          });
+    });
+    lock.unlock();
+
+    m_sync_filter();
+}
+
+void
+USBTracker::set_match_any(bool enabled)
+{
+    m_match_any = enabled;
+    m_sync_filter();
+}
+
+void
+USBTracker::m_sync_filter()
+{
+    std::lock_guard lock(m_filter_mtx);
+
+    // libusb calls hotplug callbacks with its own lock held, and the
+    // callbacks take m_subscription_mtx, so the source is only called after
+    // m_subscription_mtx is released.
+    // Without subscriptions every event is delivered, for the event queue
+    // and set_device_event_cb.
+    std::vector<uint32_t> wanted;
+    bool match_any = m_match_any;
+    if (!match_any) {
+        std::lock_guard subscription_lock(m_subscription_mtx);
+        for (const auto& [key, subscribers] : m_subscribers) {
+            wanted.push_back(key);
+        }
+        match_any = wanted.empty();
+    }
+    std::sort(wanted.begin(), wanted.end());
+    m_source->set_filter(wanted, match_any);
+
+    // Events of the ids that were filtered out were never delivered, so
+    // their connected state is refreshed once the source delivers them.
+    if (!m_tracked_all && m_running) {
+        if (match_any) {
+            m_refresh(m_tracked, true);
+        } else {
+            std::vector<uint32_t> added;
+            std::set_difference(wanted.begin(),
+                                wanted.end(),
+                                m_tracked.begin(),
+                                m_tracked.end(),
+                                std::back_inserter(added));
+            if (!added.empty()) {
+                m_refresh(added, false);
+            }
+        }
+    }
+    m_tracked_all = match_any;
+    m_tracked = match_any ? std::vector<uint32_t>{} : std::move(wanted);
+}
+
+void
+USBTracker::m_refresh(const std::vector<uint32_t>& keys, bool except)
+{
+    const auto stale = [&keys, except](const usb_id& id) {
+        return std::binary_search(keys.begin(), keys.end(), id.packed()) !=
+               except;
+    };
+
+    // The source lists the devices without m_mtx, as libusb may be waiting
+    // for it in a hotplug callback. An event handled meanwhile may be
+    // missing from the list, so the list is taken again.
+    constexpr int attempts = 3;
+    for (int attempt = 1;; ++attempt) {
+        m_lock();
+        const auto changes = m_changes;
+        m_mtx.unlock();
+
+        auto listed = m_source->enumerate_instances();
+
+        m_lock();
+        if (m_changes != changes && attempt < attempts) {
+            m_mtx.unlock();
+            continue;
+        }
+        auto instances = *m_instances.load();
+        for (const auto& instance : instances) {
+            if (stale(instance.id)) {
+                m_connected_devices.erase_all(instance.id);
+            }
+        }
+        std::erase_if(instances, [&stale](const auto& instance) {
+            return stale(instance.id);
+        });
+        for (auto& instance : listed) {
+            if (!stale(instance.id)) {
+                continue;
+            }
+            if (!m_connected_devices.insert(instance.id)) {
+                std::cerr << "Too many connected USB devices to track\n";
+                continue;
+            }
+            instances.push_back(std::move(instance));
+        }
+        m_instances.store(
+          std::make_shared<const std::vector<USBDeviceInstance>>(
+            std::move(instances)));
+        m_changes++;
+        m_mtx.unlock();
+        return;
+    }
+}
+
+void
+USBTracker::m_handle_event(const usb_id& dev, USBEventType type)
+{
+    const USBEvent event{ dev, type, std::chrono::steady_clock::now() };
+    if (m_event_queue.push(event)) {
+        const uint64_t one = 1;
+        (void)!write(m_event_fd, &one, sizeof(one));
+    }
+    m_event_waiters.notify(event);
+
+    // Callbacks run unlocked, so they can use the tracker and the
+    // subscriptions, and only those still subscribed are called.
+    std::unique_lock lock(m_subscription_mtx);
+    const auto subscribers = m_subscribers.find(dev.packed());
+    if (subscribers == m_subscribers.end()) {
+        return;
+    }
+    const auto ids = subscribers->second;
+    const auto thread = std::this_thread::get_id();
+    for (const auto id : ids) {
+        const auto subscription = m_subscriptions.find(id);
+        if (subscription == m_subscriptions.end()) {
+            continue;
+        }
+        const auto callback = subscription->second.callback;
+        m_running_callbacks.emplace_back(id, thread);
+        lock.unlock();
+
+        (*callback)(event);
+
+        lock.lock();
+        m_running_callbacks.erase(std::find(m_running_callbacks.begin(),
+                                            m_running_callbacks.end(),
+                                            std::pair{ id, thread }));
+        m_callback_done.notify_all();
+    }
+}
+
+void
+USBTracker::m_index_subscription(SubscriptionId id)
+{
+    for (const auto& device : m_subscriptions[id].devices) {
+        auto& subscribers = m_subscribers[device.packed()];
+        if (std::find(subscribers.begin(), subscribers.end(), id) ==
+            subscribers.end()) {
+            subscribers.push_back(id);
+        }
+    }
+}
+
+void
+USBTracker::m_unindex_subscription(SubscriptionId id)
+{
+    for (const auto& device : m_subscriptions[id].devices) {
+        auto subscribers = m_subscribers.find(device.packed());
+        if (subscribers == m_subscribers.end()) {
+            continue;
+        }
+        std::erase(subscribers->second, id);
+        if (subscribers->second.empty()) {
+            m_subscribers.erase(subscribers);
+        }
+    }
+}
+
+void
+USBTracker::set_measure(bool enabled)
+{
+    if (enabled) {
+        m_wakeups = 0;
+        m_events = 0;
+        m_total_latency_ns = 0;
+        m_max_latency_ns = 0;
+        m_measure_start = std::chrono::steady_clock::now();
+    }
+    m_measure = enabled;
+}
+
+USBTrackerStats
+USBTracker::stats() const
+{
+    return USBTrackerStats{
+        .wakeups = m_wakeups,
+        .events = m_events,
+        .elapsed = std::chrono::steady_clock::now() - m_measure_start,
+        .total_latency = std::chrono::nanoseconds(m_total_latency_ns),
+        .max_latency = std::chrono::nanoseconds(m_max_latency_ns),
+    };
+}
@@ -0,0 +1,15 @@
+#include "weekschedule.h"
+
+#include <ctime>
+
+std::size_t
+minute_of_week(const std::chrono::system_clock::time_point& now)
+{
+    const auto now_t = std::chrono::system_clock::to_time_t(now);
+    std::tm now_tm{};
+    localtime_r(&now_t, &now_tm);
+
+    return static_cast<std::size_t>(now_tm.tm_wday) * MINUTES_PER_DAY +
+           static_cast<std::size_t>(now_tm.tm_hour) * 60 +
+           static_cast<std::size_t>(now_tm.tm_min);
+}
@@ -1,8 +1,17 @@
 
 #include <cassert>
+#include <client.h>
+#include <daemon.h>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <metrics.h>
+#include <poll.h>
 #include <scheduler.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <thread>
+#include <timerwheel.h>
+#include <udevsource.h>
 
 #define NAME scheduler_test
 
@@ -50,6 +59,62 @@ TEST(NAME, test_parse_bored_periods)
         .count());
 }
 
+TEST(NAME, test_parse_spans_errors)
+{
+    static_assert(parse_span("20:00-24:00").value() ==
+                  MinuteSpan{ 1200, 1440 });
+    static_assert(!parse_span("20:00 24:00").has_value());
+    static_assert(parse_usb_id("dead:BEEF").value() ==
+                  usb_id{ 0xdead, 0xbeef });
+
+    auto spans = parse_spans(" 22:00-02:00 ,8-9:30");
+    ASSERT_TRUE(spans.has_value());
+    ASSERT_EQ(*spans, (std::vector<MinuteSpan>{ { 1320, 120 }, { 480, 570 } }));
+    ASSERT_TRUE(parse_spans("  ")->empty());
+
+    auto missing_dash = parse_spans("20:00-24:00, 10:00 11:00");
+    ASSERT_FALSE(missing_dash.has_value());
+    ASSERT_EQ(missing_dash.error().column, 19);
+
+    ASSERT_EQ(parse_span("25:00-26:00").error().column, 0);
+    ASSERT_EQ(parse_span("20:60-21:00").error().column, 3);
+    ASSERT_EQ(parse_span("20:00-21:00x").error().column, 11);
+    ASSERT_EQ(parse_usb_id("deadbeef").error().column, 4);
+    ASSERT_EQ(parse_usb_id("dead:").error().column, 5);
+
+    auto id = usb_id_from_string("zzzz");
+    ASSERT_EQ(id.vid, 0);
+    ASSERT_EQ(id.pid, 0);
+}
+
+TEST(NAME, test_embedded_schedule)
+{
+    constexpr auto nights = "20:00-24:00, 00:00-06:00"_bored;
+    static_assert(nights.size() == 2);
+    static_assert(nights[1] == MinuteSpan{ 0, 360 });
+
+    constexpr std::array devices{
+        EmbeddedDevice{ "TestDevice",
+                        "dead:beef"_usb,
+                        week_mask("00:00-24:00"_bored, "00:00-24:00"_bored) },
+    };
+    static_assert(devices[0].mask.test(MINUTES_PER_WEEK - 1));
+
+    constexpr auto monday_only =
+      week_mask(""_bored, "10:00-11:00"_bored, ""_bored, ""_bored, ""_bored,
+                ""_bored, "23:00-01:00"_bored);
+    static_assert(monday_only.test(MINUTES_PER_DAY + 10 * 60));
+    static_assert(monday_only.test(30));
+    static_assert(!monday_only.test(2 * MINUTES_PER_DAY + 10 * 60));
+
+    BoredomScheduler sched{ devices };
+    sched.init();
+    ASSERT_TRUE(sched.is_alarm());
+    auto mlist = sched.list_unconnected_devices();
+    ASSERT_EQ(mlist.size(), 1);
+    ASSERT_EQ(mlist[0].name, "TestDevice");
+}
+
 TEST(NAME, test_in_bored_period)
 {
     auto values = parse_bored_periods("04:30-5:45, 06:15-07:30, 08:39-09:00 ");
@@ -79,6 +144,96 @@ TEST(NAME, test_in_bored_period)
     ASSERT_FALSE(is_in_bored_period(in_period_2, values[2]));
 }
 
+TEST(NAME, test_week_mask_cross_midnight)
+{
+    WeekMask mask;
+    add_bored_periods(
+      mask, std::chrono::Friday, parse_bored_periods("22:00-02:00"));
+
+    const auto friday = std::chrono::Friday.c_encoding() * MINUTES_PER_DAY;
+    const auto saturday = std::chrono::Saturday.c_encoding() * MINUTES_PER_DAY;
+
+    ASSERT_FALSE(mask.test(friday + 21 * 60 + 59));
+    ASSERT_TRUE(mask.test(friday + 22 * 60));
+    ASSERT_TRUE(mask.test(saturday + 60 + 59));
+    ASSERT_FALSE(mask.test(saturday + 2 * 60));
+
+    WeekMask wrapping;
+    add_bored_periods(
+      wrapping, std::chrono::Saturday, parse_bored_periods("23:00-01:00"));
+    ASSERT_TRUE(wrapping.test(30));
+    ASSERT_FALSE(wrapping.test(60));
+}
+
+TEST(NAME, test_local_time_cache_dst)
+{
+    const auto old_tz = getenv("TZ");
+    const std::string saved_tz = old_tz ? old_tz : "";
+    setenv("TZ", "Europe/Helsinki", 1);
+    tzset();
+
+    // 2024-03-31 is the start of daylight saving time in Finland.
+    const std::chrono::year_month_day dst_day{ std::chrono::year(2024) /
+                                               std::chrono::March / 30 };
+    const std::chrono::system_clock::time_point start =
+      std::chrono::sys_days{ dst_day };
+    LocalTimeCache cache;
+    for (auto now = start; now < start + std::chrono::days(3);
+         now += std::chrono::minutes(7)) {
+        ASSERT_EQ(cache.minute_of_week(now), minute_of_week(now));
+        ASSERT_EQ(cache.is_weekend(now), is_weekend(now));
+    }
+    ASSERT_EQ(cache.utc_offset(start), std::chrono::hours(2));
+    ASSERT_EQ(cache.utc_offset(start + std::chrono::days(2)),
+              std::chrono::hours(3));
+
+    if (old_tz) {
+        setenv("TZ", saved_tz.c_str(), 1);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+}
+
+TEST(NAME, test_week_mask_next_change)
+{
+    WeekMask mask;
+    ASSERT_EQ(mask.next_change(0), MINUTES_PER_WEEK);
+
+    mask.set_range(100, 200);
+    ASSERT_EQ(mask.next_change(0), 100);
+    ASSERT_EQ(mask.next_change(150), 50);
+    ASSERT_EQ(mask.next_change(200), MINUTES_PER_WEEK - 100);
+
+    WeekMask wrapping;
+    wrapping.set_range(MINUTES_PER_WEEK - 10, 10);
+    ASSERT_EQ(wrapping.next_change(MINUTES_PER_WEEK - 5), 15);
+}
+
+TEST(NAME, test_compile_section_weekday_override)
+{
+    simpleini::INISection section{ "TestDevice",
+                                   { { "usb_id", "dead:beef" },
+                                     { "weekdays", "20:00-24:00" },
+                                     { "weekend", "00:00-24:00" },
+                                     { "wednesday", "10:00-11:00" } } };
+    auto compiled = compile_section("TestDevice", section);
+
+    ASSERT_EQ(compiled.device.id.vid, 0xdead);
+    ASSERT_EQ(compiled.device.id.pid, 0xbeef);
+
+    const auto monday = std::chrono::Monday.c_encoding() * MINUTES_PER_DAY;
+    const auto wednesday =
+      std::chrono::Wednesday.c_encoding() * MINUTES_PER_DAY;
+    const auto sunday = std::chrono::Sunday.c_encoding() * MINUTES_PER_DAY;
+
+    ASSERT_TRUE(compiled.mask.test(monday + 20 * 60));
+    ASSERT_FALSE(compiled.mask.test(monday + 10 * 60));
+    ASSERT_TRUE(compiled.mask.test(wednesday + 10 * 60));
+    ASSERT_FALSE(compiled.mask.test(wednesday + 20 * 60));
+    ASSERT_TRUE(compiled.mask.test(sunday + 12 * 60));
+}
+
 #define TEST_FILE_PATH "/tmp/boredomlock-test.ini"
 void
 create_test_file(usb_id device,
@@ -98,16 +253,56 @@ TEST(NAME, test_boredom_scheduler_is_alarm)
     id.pid = 0xbeef;
 
     create_test_file(id, "00:00-24:00", "00:00-24:00");
+    auto clock = std::make_shared<ManualClock>();
     auto sched = BoredomScheduler{ TEST_FILE_PATH };
     sched.init();
+    sched.set_clock(clock);
     ASSERT_TRUE(sched.is_alarm());
     sched.snooze(std::chrono::seconds(1));
     ASSERT_FALSE(sched.is_alarm());
-    usleep(1200000);
+    clock->advance(std::chrono::milliseconds(1200));
+    ASSERT_TRUE(sched.is_alarm());
+    sched.snooze(id, std::chrono::seconds(1));
+    ASSERT_FALSE(sched.is_alarm());
+    clock->advance(std::chrono::milliseconds(1200));
     ASSERT_TRUE(sched.is_alarm());
     sched.disable();
     ASSERT_FALSE(sched.is_alarm());
     sched.enable();
+    // The snoozes are saved, don't leave them for the next scheduler.
+    sched.set_clock(std::make_shared<SystemClock>());
+    sched.snooze(std::chrono::seconds(0));
+    sched.snooze(id, std::chrono::seconds(0));
+}
+
+TEST(NAME, test_boredom_scheduler_state_change)
+{
+    usb_id id;
+    id.vid = 0xdead;
+    id.pid = 0xbeef;
+
+    create_test_file(id, "00:00-24:00", "00:00-24:00");
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    ASSERT_GE(sched.fd(), 0);
+
+    std::vector<bool> changes;
+    sched.set_state_change_cb([&changes](bool alarm) {
+        changes.push_back(alarm);
+    });
+
+    sched.snooze(std::chrono::seconds(1));
+    ASSERT_LE(sched.next_change(),
+              std::chrono::system_clock::now() + std::chrono::seconds(1));
+
+    pollfd pfd{ sched.fd(), POLLIN, 0 };
+    ASSERT_EQ(poll(&pfd, 1, 1000), 1);
+    sched.handle_events();
+    ASSERT_EQ(changes, std::vector<bool>{ false });
+
+    ASSERT_EQ(poll(&pfd, 1, 2000), 1);
+    sched.handle_events();
+    ASSERT_EQ(changes, (std::vector<bool>{ false, true }));
 }
 
 TEST(NAME, test_boredom_scheduler_no_alarm)
@@ -140,6 +335,1183 @@ TEST(NAME, test_boredom_scheduler_list_unconnected)
     testtracker.stop_tracking();
 }
 
+TEST(NAME, test_list_usb_sysfs)
+{
+    const std::filesystem::path root{ "/tmp/boredomlock-test-sysfs" };
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root / "1-1");
+    std::filesystem::create_directories(root / "1-1:1.0");
+    std::ofstream(root / "1-1" / "idVendor") << "dead\n";
+    std::ofstream(root / "1-1" / "idProduct") << "beef\n";
+
+    std::vector<usb_id> devices;
+    ASSERT_TRUE(list_usb_sysfs(root, devices));
+    ASSERT_EQ(devices.size(), 1);
+    ASSERT_TRUE(devices[0] == (usb_id{ 0xdead, 0xbeef }));
+
+    devices.clear();
+    ASSERT_FALSE(list_usb_sysfs(root / "missing", devices));
+    std::filesystem::remove_all(root);
+}
+
+TEST(NAME, test_connected_set)
+{
+    ConnectedSet set;
+    usb_id first{ 0xdead, 0xbeef };
+    usb_id second{ 0xbabe, 0xcafe };
+
+    set.assign({ first, first });
+    ASSERT_EQ(set.count(first), 2);
+    ASSERT_FALSE(set.contains(second));
+
+    ASSERT_TRUE(set.insert(second));
+    set.erase(first);
+    ASSERT_EQ(set.count(first), 1);
+    ASSERT_TRUE(set.contains(second));
+
+    set.erase_all(first);
+    ASSERT_FALSE(set.contains(first));
+    ASSERT_EQ(set.list().size(), 1);
+
+    const uint16_t fill = ConnectedSet::CAPACITY - 1;
+    for (uint16_t pid = 0; pid < fill; ++pid) {
+        ASSERT_TRUE(set.insert(usb_id{ 0x1234, pid }));
+    }
+    ASSERT_FALSE(set.insert(usb_id{ 0x4321, 0x0001 }));
+    for (uint16_t pid = 0; pid < fill; pid += 2) {
+        set.erase(usb_id{ 0x1234, pid });
+    }
+    for (uint16_t pid = 1; pid < fill; pid += 2) {
+        ASSERT_TRUE(set.contains(usb_id{ 0x1234, pid }));
+    }
+    ASSERT_TRUE(set.contains(second));
+}
+
+TEST(NAME, test_event_queue_overflow)
+{
+    EventQueue<int, 4> queue;
+    for (int i = 0; i < 6; ++i) {
+        queue.push(i);
+    }
+    ASSERT_EQ(queue.dropped(), 2);
+
+    std::vector<int> items;
+    ASSERT_EQ(queue.drain([&items](int item) { items.push_back(item); }, 3), 3);
+    ASSERT_TRUE(queue.push(6));
+    queue.drain([&items](int item) { items.push_back(item); });
+    ASSERT_EQ(items, (std::vector<int>{ 0, 1, 2, 3, 6 }));
+}
+
+TEST(NAME, test_usb_tracker_event_queue)
+{
+    USBTracker tracker;
+    usb_id id{ 0xdead, 0xbeef };
+
+    tracker.handle_device_add_event(id);
+    tracker.handle_device_remove_event(id);
+
+    pollfd pfd{ tracker.event_fd(), POLLIN, 0 };
+    ASSERT_EQ(poll(&pfd, 1, 0), 1);
+
+    std::vector<USBEvent> events;
+    ASSERT_EQ(tracker.drain_events(events), 2);
+    ASSERT_EQ(events[0].type, DEVICE_ARRIVED);
+    ASSERT_EQ(events[1].type, DEVICE_LEFT);
+    ASSERT_TRUE(events[1].id == id);
+    ASSERT_LE(events[0].timestamp, events[1].timestamp);
+    ASSERT_EQ(tracker.dropped_events(), 0);
+    ASSERT_EQ(poll(&pfd, 1, 0), 0);
+}
+
+TEST(NAME, test_create_boredom_period)
+{
+    const usb_id id{ 0xdead, 0xbeef };
+    const usb_id added{ 0xbabe, 0xcafe };
+    create_test_file(id, "00:00-00:00", "00:00-00:00");
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    ASSERT_FALSE(sched.is_alarm());
+
+    sched.create_boredom_period(
+      USBDevice{ added, "Added" }, "00:00-24:00", "00:00-24:00");
+    ASSERT_TRUE(sched.is_alarm());
+    ASSERT_EQ(sched.list_unconnected_devices().size(), 1);
+
+    // Replaces the period of the device.
+    sched.create_boredom_period(
+      USBDevice{ added, "Added" }, "00:00-00:00", "00:00-00:00");
+    ASSERT_FALSE(sched.is_alarm());
+    ASSERT_TRUE(sched.list_unconnected_devices().empty());
+}
+
+TEST(NAME, test_boredom_scheduler_config_reload)
+{
+    usb_id id;
+    id.vid = 0xdead;
+    id.pid = 0xbeef;
+
+    create_test_file(id, "00:00-24:00", "00:00-24:00");
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    ASSERT_TRUE(sched.is_alarm());
+
+    std::vector<bool> changes;
+    sched.set_state_change_cb([&changes](bool alarm) {
+        changes.push_back(alarm);
+    });
+
+    create_test_file(id, "00:00-00:00", "00:00-00:00");
+    pollfd pfd{ sched.fd(), POLLIN, 0 };
+    ASSERT_EQ(poll(&pfd, 1, 1000), 1);
+    sched.handle_events();
+
+    ASSERT_FALSE(sched.is_alarm());
+    ASSERT_EQ(changes, std::vector<bool>{ false });
+}
+
+TEST(NAME, test_usb_tracker_subscriptions)
+{
+    auto tracker = USBTracker::shared();
+    ASSERT_EQ(tracker, USBTracker::shared());
+
+    usb_id first{ 0xdead, 0xbeef };
+    usb_id second{ 0xbabe, 0xcafe };
+    std::vector<usb_id> first_events;
+    std::vector<usb_id> second_events;
+
+    auto first_sub =
+      tracker->subscribe({ first }, [&first_events](const USBEvent& event) {
+          first_events.push_back(event.id);
+      });
+    auto second_sub = tracker->subscribe(
+      { first, second }, [&second_events](const USBEvent& event) {
+          second_events.push_back(event.id);
+      });
+
+    tracker->handle_device_add_event(first);
+    tracker->handle_device_add_event(second);
+    tracker->handle_device_add_event(usb_id{ 0x1234, 0x5678 });
+    ASSERT_EQ(first_events.size(), 1);
+    ASSERT_EQ(second_events.size(), 2);
+
+    tracker->update_subscription(first_sub, { second });
+    tracker->unsubscribe(second_sub);
+    tracker->handle_device_remove_event(second);
+    ASSERT_EQ(first_events.size(), 2);
+    ASSERT_EQ(second_events.size(), 2);
+    tracker->unsubscribe(first_sub);
+
+    std::weak_ptr<USBTracker> released = tracker;
+    tracker.reset();
+    ASSERT_TRUE(released.expired());
+}
+
+/// @brief Device source recording the filter the tracker asks for.
+class FilterRecordingSource : public DeviceSource
+{
+  public:
+    std::vector<usb_id> enumerate() override { return devices; }
+    bool start(USBTracker&) override { return true; }
+    void stop() override {}
+    void join() override {}
+    void set_filter(const std::vector<uint32_t>& wanted,
+                    bool match_any) override
+    {
+        this->wanted = wanted;
+        std::sort(this->wanted.begin(), this->wanted.end());
+        this->match_any = match_any;
+    }
+
+    std::vector<uint32_t> wanted;
+    bool match_any{ false };
+    /// @brief Connected devices, whose events are never delivered.
+    std::vector<usb_id> devices;
+};
+
+TEST(NAME, test_usb_tracker_source_filter)
+{
+    auto owned = std::make_unique<FilterRecordingSource>();
+    auto& source = *owned;
+    USBTracker tracker(std::move(owned));
+    const usb_id first{ 0x1111, 0x0001 };
+    const usb_id second{ 0x2222, 0x0002 };
+    const usb_id third{ 0x3333, 0x0003 };
+
+    // Without subscriptions every event is wanted.
+    tracker.set_match_any(false);
+    ASSERT_TRUE(source.match_any);
+    ASSERT_TRUE(source.wanted.empty());
+
+    const auto a = tracker.subscribe({ first }, [](const USBEvent&) {});
+    ASSERT_FALSE(source.match_any);
+    ASSERT_EQ(source.wanted, std::vector<uint32_t>{ first.packed() });
+    const auto b =
+      tracker.subscribe({ first, second }, [](const USBEvent&) {});
+    ASSERT_EQ(source.wanted,
+              (std::vector<uint32_t>{ first.packed(), second.packed() }));
+
+    tracker.update_subscription(a, { third });
+    ASSERT_EQ(source.wanted,
+              (std::vector<uint32_t>{
+                first.packed(), second.packed(), third.packed() }));
+    tracker.update_subscription(b, { second });
+    ASSERT_EQ(source.wanted,
+              (std::vector<uint32_t>{ second.packed(), third.packed() }));
+
+    tracker.set_match_any(true);
+    ASSERT_TRUE(source.match_any);
+    ASSERT_TRUE(source.wanted.empty());
+    tracker.set_match_any(false);
+    ASSERT_FALSE(source.match_any);
+    ASSERT_EQ(source.wanted,
+              (std::vector<uint32_t>{ second.packed(), third.packed() }));
+
+    tracker.unsubscribe(a);
+    ASSERT_EQ(source.wanted, std::vector<uint32_t>{ second.packed() });
+    tracker.unsubscribe(b);
+    ASSERT_TRUE(source.match_any);
+    ASSERT_TRUE(source.wanted.empty());
+}
+
+TEST(NAME, test_usb_tracker_filtered_devices)
+{
+    auto owned = std::make_unique<FilterRecordingSource>();
+    auto& source = *owned;
+    USBTracker tracker(std::move(owned));
+    const usb_id first{ 0x1111, 0x0001 };
+    const usb_id second{ 0x2222, 0x0002 };
+
+    source.devices = { second };
+    tracker.start_tracking();
+    const auto subscription =
+      tracker.subscribe({ first }, [](const USBEvent&) {});
+    ASSERT_TRUE(tracker.usb_id_is_connected(second));
+
+    // Unplugged and plugged in while filtered out.
+    source.devices = { first };
+    tracker.update_subscription(subscription, { first, second });
+    ASSERT_FALSE(tracker.usb_id_is_connected(second));
+    ASSERT_TRUE(tracker.connected_devices().empty());
+
+    tracker.update_subscription(subscription, { first });
+    source.devices = { second, second };
+    tracker.update_subscription(subscription, { first, second });
+    ASSERT_TRUE(tracker.usb_id_is_connected(second));
+    ASSERT_EQ(tracker.connected_devices().size(), 2);
+    ASSERT_FALSE(tracker.usb_id_is_connected(first));
+
+    // Every id but the subscribed ones is refreshed when all are wanted,
+    // the events of the subscribed ones are up to date.
+    tracker.update_subscription(subscription, { first });
+    source.devices = { first };
+    tracker.set_match_any(true);
+    ASSERT_FALSE(tracker.usb_id_is_connected(second));
+    ASSERT_FALSE(tracker.usb_id_is_connected(first));
+
+    tracker.unsubscribe(subscription);
+    tracker.stop_tracking();
+}
+
+TEST(NAME, test_usb_tracker_reentrant_callbacks)
+{
+    auto tracker = USBTracker::shared();
+    const usb_id id{ 0xdead, 0xbeef };
+
+    // Callbacks change the subscriptions, including their own, and a later
+    // unsubscribed callback isn't called.
+    SubscriptionId first = 0;
+    SubscriptionId second = 0;
+    SubscriptionId added = 0;
+    int second_calls = 0;
+    first = tracker->subscribe({ id }, [&](const USBEvent&) {
+        added = tracker->subscribe({ id }, [](const USBEvent&) {});
+        tracker->unsubscribe(second);
+        tracker->update_subscription(first, {});
+    });
+    second = tracker->subscribe({ id }, [&](const USBEvent&) {
+        second_calls++;
+    });
+    tracker->handle_device_add_event(id);
+    ASSERT_EQ(second_calls, 0);
+    ASSERT_NE(added, 0);
+    tracker->unsubscribe(added);
+    tracker->unsubscribe(first);
+
+    // unsubscribe waits for a callback running on another thread.
+    std::atomic<bool> entered{ false };
+    std::atomic<bool> returned{ false };
+    const auto slow = tracker->subscribe({ id }, [&](const USBEvent&) {
+        entered = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        returned = true;
+    });
+    std::thread source(
+      [&tracker, id] { tracker->handle_device_remove_event(id); });
+    while (!entered) {
+        std::this_thread::yield();
+    }
+    tracker->unsubscribe(slow);
+    ASSERT_TRUE(returned);
+    source.join();
+}
+
+TEST(NAME, test_usb_tracker_idle_wakeups)
+{
+    USBTracker tracker;
+    tracker.set_measure(true);
+    tracker.start_tracking();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto stats = tracker.stats();
+    tracker.stop_tracking();
+
+    ASSERT_LT(stats.wakeups_per_second(), 50.0);
+}
+
+TEST(NAME, test_synthetic_source)
+{
+    usb_id first{ 0xdead, 0xbeef };
+    usb_id second{ 0xbabe, 0xcafe };
+    USBTracker tracker(std::make_unique<SyntheticSource>(
+      std::vector<usb_id>{ first, second }, 10001));
+
+    std::size_t arrived = 0;
+    std::size_t left = 0;
+    auto sub = tracker.subscribe(
+      { first, second }, [&arrived, &left](const USBEvent& event) {
+          (event.type == DEVICE_ARRIVED ? arrived : left)++;
+      });
+    tracker.set_measure(true);
+    tracker.start_tracking();
+    tracker.join_thread();
+    tracker.stop_tracking();
+    tracker.unsubscribe(sub);
+
+    ASSERT_EQ(arrived, 5001);
+    ASSERT_EQ(left, 5000);
+    ASSERT_EQ(tracker.stats().events, 10001);
+    ASSERT_TRUE(tracker.usb_id_is_connected(first));
+    ASSERT_FALSE(tracker.usb_id_is_connected(second));
+}
+
+TEST(NAME, test_trace_replay_source)
+{
+    const auto now = std::chrono::steady_clock::now();
+    const std::vector<USBEvent> recorded{
+        { { 0xdead, 0xbeef }, DEVICE_ARRIVED, now },
+        { { 0xbabe, 0xcafe },
+          DEVICE_ARRIVED,
+          now + std::chrono::milliseconds(20) },
+        { { 0xdead, 0xbeef },
+          DEVICE_LEFT,
+          now + std::chrono::milliseconds(40) },
+    };
+    const auto trace = std::filesystem::temp_directory_path() / "test.trace";
+    ASSERT_TRUE(TraceReplaySource::write_trace(trace, recorded));
+
+    for (auto timing :
+         { TraceReplaySource::ORIGINAL, TraceReplaySource::FAST }) {
+        USBTracker tracker(std::make_unique<TraceReplaySource>(trace, timing));
+        const auto start = std::chrono::steady_clock::now();
+        tracker.start_tracking();
+        tracker.join_thread();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        tracker.stop_tracking();
+
+        std::vector<USBEvent> replayed;
+        ASSERT_EQ(tracker.drain_events(replayed), recorded.size());
+        for (std::size_t i = 0; i < recorded.size(); ++i) {
+            ASSERT_TRUE(replayed[i].id == recorded[i].id);
+            ASSERT_EQ(replayed[i].type, recorded[i].type);
+        }
+        if (timing == TraceReplaySource::ORIGINAL) {
+            ASSERT_GE(elapsed, std::chrono::milliseconds(40));
+        }
+        ASSERT_FALSE(tracker.usb_id_is_connected(recorded[0].id));
+        ASSERT_TRUE(tracker.usb_id_is_connected(recorded[1].id));
+    }
+    std::filesystem::remove(trace);
+}
+
+TEST(NAME, test_state_file)
+{
+    const auto path = std::filesystem::temp_directory_path() / "test.state";
+    std::filesystem::remove(path);
+    const usb_id id{ 0xdead, 0xbeef };
+    const auto now = std::chrono::system_clock::now();
+    {
+        StateFile state;
+        state.set_status(BSchedulerStatus::DISABLED);
+        ASSERT_TRUE(state.open(path));
+        ASSERT_EQ(state.status(), BSchedulerStatus::DISABLED);
+        state.set_snooze_until(now);
+        ASSERT_TRUE(state.set_snooze_until(id, now + std::chrono::minutes(5)));
+        ASSERT_TRUE(state.set_connected(id, true, now));
+    }
+    {
+        StateFile state;
+        ASSERT_TRUE(state.open(path));
+        ASSERT_EQ(state.status(), BSchedulerStatus::DISABLED);
+        ASSERT_EQ(state.snooze_until(), now);
+        ASSERT_EQ(state.snooze_until(id), now + std::chrono::minutes(5));
+        ASSERT_EQ(state.next_snooze_end(now), now + std::chrono::minutes(5));
+        ASSERT_TRUE(state.connected(id));
+        ASSERT_EQ(state.connected_changed(id), now);
+        ASSERT_FALSE(state.connected(usb_id{ 0xbabe, 0xcafe }));
+    }
+
+    // Corrupt a byte, the state starts over from the defaults.
+    {
+        std::fstream file(path, std::ios::in | std::ios::out);
+        file.seekp(24);
+        file.put('\x7f');
+    }
+    StateFile state;
+    ASSERT_FALSE(state.open(path));
+    ASSERT_EQ(state.status(), BSchedulerStatus::ENABLED);
+    ASSERT_FALSE(state.connected(id));
+    std::filesystem::remove(path);
+}
+
+TEST(NAME, test_state_file_killed_writer)
+{
+    const auto path = std::filesystem::temp_directory_path() / "test.state";
+    std::filesystem::remove(path);
+    const usb_id id{ 0xdead, 0xbeef };
+    {
+        StateFile state;
+        ASSERT_TRUE(state.open(path));
+        state.set_status(BSchedulerStatus::DISABLED);
+    }
+    // Keeps writing to its mapping after every killed writer.
+    StateFile live;
+    ASSERT_TRUE(live.open(path));
+
+    // Kill a process in the middle of its updates, leaving some of them
+    // half-applied in the mapping.
+    for (int i = 0; i < 50; ++i) {
+        int ready[2];
+        ASSERT_EQ(pipe(ready), 0);
+        const pid_t child = fork();
+        ASSERT_GE(child, 0);
+        if (child == 0) {
+            StateFile state;
+            state.open(path);
+            (void)!write(ready[1], "x", 1);
+            for (int64_t n = 1;; ++n) {
+                // The change time tells the connection state.
+                state.set_connected(
+                  id, n % 2, std::chrono::system_clock::time_point{} +
+                               std::chrono::nanoseconds(n));
+            }
+        }
+        char byte;
+        ASSERT_EQ(read(ready[0], &byte, 1), 1);
+        close(ready[0]);
+        close(ready[1]);
+        std::this_thread::sleep_for(std::chrono::microseconds(50 * i));
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        live.set_status(BSchedulerStatus::DISABLED);
+
+        StateFile state;
+        ASSERT_TRUE(state.open(path));
+        ASSERT_EQ(state.status(), BSchedulerStatus::DISABLED);
+        const auto changed = state.connected_changed(id).time_since_epoch();
+        ASSERT_EQ(state.connected(id),
+                  std::chrono::nanoseconds(changed).count() % 2 == 1);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(NAME, test_state_file_retain)
+{
+    StateFile state;
+    const auto now = std::chrono::system_clock::time_point{} +
+                     std::chrono::hours(1);
+    std::vector<usb_id> ids;
+    for (uint16_t pid = 1; pid <= StateFile::DEVICES; ++pid) {
+        ids.push_back({ 0x1111, pid });
+        ASSERT_TRUE(state.set_connected(ids.back(), true, now));
+    }
+    const usb_id snoozed = ids[0];
+    ASSERT_TRUE(state.set_snooze_until(snoozed, now + std::chrono::hours(1)));
+    const usb_id added{ 0x2222, 0x0001 };
+    ASSERT_FALSE(state.set_connected(added, false, now));
+    ASSERT_FALSE(state.set_snooze_until(added, now));
+
+    // Only the first two devices stay configured, the snoozed one is kept
+    // until its snooze ends.
+    state.retain({ ids[1], ids[2] }, now);
+    ASSERT_TRUE(state.connected(snoozed));
+    ASSERT_TRUE(state.connected(ids[1]));
+    ASSERT_FALSE(state.connected(ids[3]));
+    ASSERT_EQ(state.connected_changed(ids[3]), StateFile::time_point{});
+
+    // A freed slot doesn't pass on the state of its last device.
+    ASSERT_TRUE(state.set_snooze_until(added, StateFile::time_point{}));
+    ASSERT_FALSE(state.connected(added));
+    ASSERT_EQ(state.connected_changed(added), StateFile::time_point{});
+
+    state.retain({ ids[1], ids[2] }, now + std::chrono::hours(2));
+    ASSERT_FALSE(state.connected(snoozed));
+    ASSERT_EQ(state.device_snoozes(now).size(), 0);
+}
+
+TEST(NAME, test_state_file_shared_writers)
+{
+    const auto path = std::filesystem::temp_directory_path() / "test.state";
+    std::filesystem::remove(path);
+    const auto at = std::chrono::system_clock::time_point{} +
+                    std::chrono::hours(1);
+
+    // Two objects mapping one file, like two schedulers in a process.
+    {
+        StateFile first;
+        StateFile second;
+        ASSERT_TRUE(first.open(path));
+        ASSERT_TRUE(second.open(path));
+        std::atomic<bool> go{ false };
+        std::vector<std::thread> writers;
+        for (auto* state : { &first, &second }) {
+            const uint16_t vid = state == &first ? 0x1111 : 0x2222;
+            writers.emplace_back([state, vid, at, &go] {
+                while (!go) {
+                }
+                for (uint16_t pid = 1; pid <= 20; ++pid) {
+                    for (int i = 0; i < 2000; ++i) {
+                        state->set_connected({ vid, pid }, i % 2, at);
+                        state->set_status(i % 2);
+                    }
+                    state->set_snooze_until({ vid, pid }, at);
+                }
+            });
+        }
+        go = true;
+        for (auto& writer : writers) {
+            writer.join();
+        }
+    }
+
+    StateFile state;
+    ASSERT_TRUE(state.open(path));
+    for (const uint16_t vid : { 0x1111, 0x2222 }) {
+        for (uint16_t pid = 1; pid <= 20; ++pid) {
+            ASSERT_TRUE(state.connected({ vid, pid }));
+            ASSERT_EQ(state.snooze_until({ vid, pid }), at);
+        }
+    }
+    ASSERT_EQ(state.status(), 1);
+    std::filesystem::remove(path);
+}
+
+TEST(NAME, test_transition_index)
+{
+    CompiledSchedule schedule(3);
+    // Friday 22:00 - Saturday 02:00 and Saturday 22:00 - Sunday 02:00.
+    schedule[0].mask.set_range(5 * MINUTES_PER_DAY + 1320,
+                               6 * MINUTES_PER_DAY + 120);
+    schedule[0].mask.set_range(6 * MINUTES_PER_DAY + 1320,
+                               MINUTES_PER_WEEK + 120);
+    schedule[1].mask.set_range(0, MINUTES_PER_WEEK);
+    for (std::size_t day = 0; day < 7; ++day) {
+        schedule[2].mask.set_range(day * MINUTES_PER_DAY + 480,
+                                   day * MINUTES_PER_DAY + 960);
+    }
+
+    TransitionIndex index;
+    for (const auto& device : schedule) {
+        index.add(device);
+    }
+    const TransitionIndex built(schedule);
+
+    for (const auto* checked : { &std::as_const(index), &built }) {
+        for (std::size_t minute = 0; minute < MINUTES_PER_WEEK; minute += 7) {
+            std::vector<uint32_t> required;
+            auto next = MINUTES_PER_WEEK;
+            for (uint32_t device = 0; device < schedule.size(); ++device) {
+                if (schedule[device].mask.test(minute)) {
+                    required.push_back(device);
+                }
+                next = std::min(next,
+                                schedule[device].mask.next_change(minute));
+            }
+            ASSERT_EQ(checked->required_at(minute), required) << minute;
+            ASSERT_EQ(checked->next_transition(minute), next) << minute;
+        }
+    }
+
+    // Sunday 02:00 only ends the period of the first device.
+    const auto ends = built.transitions_at(120);
+    ASSERT_EQ(ends.size(), 1);
+    ASSERT_EQ(ends[0].device, 0);
+    ASSERT_FALSE(ends[0].required);
+    ASSERT_EQ(built.transitions_at(480).size(), 1);
+    ASSERT_TRUE(built.transitions_at(480)[0].required);
+    ASSERT_TRUE(built.any_required(
+      0, [](const DeviceSchedule& item) { return item.mask.test(60); }));
+
+    // Removing a device renumbers the later ones like a rebuilt index.
+    TransitionIndex changed(schedule);
+    changed.remove({ 0 });
+    changed.add(CompiledSchedule{ schedule[0] });
+    const TransitionIndex rebuilt(
+      CompiledSchedule{ schedule[1], schedule[2], schedule[0] });
+    std::vector<uint64_t> bitmap;
+    std::vector<uint64_t> rebuilt_bitmap;
+    for (std::size_t minute = 0; minute < MINUTES_PER_WEEK; minute += 7) {
+        ASSERT_EQ(changed.required_at(minute), rebuilt.required_at(minute));
+        ASSERT_EQ(changed.next_transition(minute),
+                  rebuilt.next_transition(minute));
+        changed.required_bitmap(minute, bitmap);
+        rebuilt.required_bitmap(minute, rebuilt_bitmap);
+        ASSERT_EQ(bitmap, rebuilt_bitmap) << minute;
+    }
+    ASSERT_EQ(changed.transitions_at(120)[0].device, 2);
+    changed.remove({ 0, 1, 2 });
+    ASSERT_TRUE(changed.schedule().empty());
+    ASSERT_TRUE(changed.required_at(600).empty());
+    ASSERT_EQ(changed.next_transition(0), MINUTES_PER_WEEK);
+}
+
+TEST(NAME, test_required_bitmap)
+{
+    // Enough intervals for the vector loops and a scalar tail.
+    CompiledSchedule schedule(131);
+    uint32_t seed = 1;
+    for (auto& device : schedule) {
+        for (int i = 0; i < 3; ++i) {
+            seed = seed * 1103515245 + 12345;
+            const auto begin = seed % MINUTES_PER_WEEK;
+            device.mask.set_range(begin, begin + seed % 600);
+        }
+    }
+    schedule[7].mask.set_range(0, MINUTES_PER_WEEK);
+    const TransitionIndex index(schedule);
+
+    std::vector<uint64_t> bitmap;
+    for (std::size_t minute = 0; minute < MINUTES_PER_WEEK; minute += 13) {
+        index.required_bitmap(minute, bitmap);
+        ASSERT_EQ(bitmap.size(), 3);
+        for (uint32_t device = 0; device < schedule.size(); ++device) {
+            ASSERT_EQ((bitmap[device / 64] >> (device % 64)) & 1,
+                      schedule[device].mask.test(minute))
+              << minute << " " << device;
+        }
+    }
+}
+
+TEST(NAME, test_daemon_client)
+{
+    usb_id id;
+    id.vid = 0xdead;
+    id.pid = 0xbeef;
+
+    create_test_file(id, "00:00-24:00", "00:00-24:00");
+    const std::filesystem::path socket{ "/tmp/boredomlock-test.sock" };
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    BoredomDaemon daemon(sched, socket);
+    ASSERT_TRUE(daemon.listen());
+    std::thread server(&BoredomDaemon::run, &daemon);
+
+    BoredomClient client(socket);
+    ASSERT_TRUE(client.init());
+    ASSERT_TRUE(client.is_alarm());
+    auto devices = client.list_unconnected_devices();
+    ASSERT_EQ(devices.size(), 1);
+    ASSERT_EQ(devices[0].name, "TestDevice");
+    ASSERT_EQ(devices[0].id, id);
+
+    std::vector<bool> changes;
+    client.set_state_change_cb([&changes](bool alarm) {
+        changes.push_back(alarm);
+    });
+    client.snooze(std::chrono::seconds(1));
+    ASSERT_FALSE(client.is_alarm());
+    ASSERT_LE(client.next_change(),
+              std::chrono::system_clock::now() + std::chrono::seconds(1));
+
+    pollfd pfd{ client.fd(), POLLIN, 0 };
+    ASSERT_EQ(poll(&pfd, 1, 1000), 1);
+    client.handle_events();
+    ASSERT_EQ(changes, std::vector<bool>{ false });
+
+    client.disable();
+    ASSERT_FALSE(client.is_alarm());
+    client.enable();
+    client.snooze(std::chrono::seconds(0));
+    ASSERT_TRUE(client.is_alarm());
+
+    // Out of range snoozes are rejected.
+    client.snooze(std::chrono::seconds(-1));
+    client.snooze(id, std::chrono::seconds(-1));
+    client.snooze(std::chrono::seconds(INT64_MAX));
+    client.snooze(id, std::chrono::seconds(protocol::MAX_SNOOZE_SECONDS + 1));
+    ASSERT_TRUE(client.is_alarm());
+
+    daemon.stop();
+    server.join();
+}
+
+TEST(NAME, test_metrics)
+{
+    for (uint64_t value : { 0ull, 3ull, 4ull, 7ull, 1000ull, 123456789ull }) {
+        const auto bucket = histogram_bucket(value);
+        ASSERT_LE(histogram_bucket_start(bucket), value);
+        ASSERT_GE(histogram_bucket_end(bucket), value);
+    }
+    ASSERT_EQ(histogram_bucket(UINT64_MAX), HISTOGRAM_BUCKETS - 1);
+
+    Metrics::reset();
+    Metrics::add(HOTPLUG_EVENTS);
+    ASSERT_EQ(Metrics::snapshot().counters[HOTPLUG_EVENTS], 0);
+
+    Metrics::set_enabled(true);
+    for (int i = 1; i <= 100; ++i) {
+        Metrics::record(LOCK_WAIT, std::chrono::microseconds(i));
+    }
+    std::thread([] { Metrics::add(HOTPLUG_EVENTS, 2); }).join();
+    Metrics::add(HOTPLUG_EVENTS);
+
+    create_test_file({ 0xdead, 0xbeef }, "00:00-24:00", "00:00-24:00");
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    sched.is_alarm();
+
+    const auto snapshot = Metrics::snapshot();
+    Metrics::set_enabled(false);
+    ASSERT_EQ(snapshot.counters[HOTPLUG_EVENTS], 3);
+    ASSERT_GE(snapshot.counters[ALARM_EVALUATIONS], 1);
+    ASSERT_GE(snapshot.counters[CONFIG_RELOADS], 1);
+    ASSERT_GE(snapshot.histograms[EVALUATION_TIME].count, 1);
+
+    const auto& wait = snapshot.histograms[LOCK_WAIT];
+    ASSERT_EQ(wait.count, 100);
+    ASSERT_EQ(wait.sum, 5050000);
+    // Buckets are at most 25% wide.
+    ASSERT_GE(wait.percentile(0.99), std::chrono::microseconds(99));
+    ASSERT_LE(wait.percentile(0.99), std::chrono::microseconds(124));
+    ASSERT_GE(wait.percentile(0.5), std::chrono::microseconds(50));
+    ASSERT_LE(wait.percentile(0.5), std::chrono::microseconds(63));
+
+    const auto text = Metrics::prometheus(snapshot);
+    ASSERT_NE(text.find("boredomlock_hotplug_events_total 3\n"),
+              std::string::npos);
+    ASSERT_NE(text.find("boredomlock_lock_wait_seconds_count 100\n"),
+              std::string::npos);
+    ASSERT_NE(
+      text.find("boredomlock_lock_wait_seconds_bucket{le=\"+Inf\"} 100"),
+      std::string::npos);
+
+    const std::filesystem::path path{ "/tmp/boredomlock-test.prom" };
+    ASSERT_TRUE(Metrics::write_prometheus(path));
+    ASSERT_TRUE(std::filesystem::exists(path));
+    std::filesystem::remove(path);
+    Metrics::reset();
+}
+
+TEST(NAME, test_journal)
+{
+    using namespace std::chrono_literals;
+    const std::filesystem::path path{ "/tmp/boredomlock-test.journal" };
+    std::filesystem::remove(path);
+    const usb_id phone{ 0xdead, 0xbeef };
+    const usb_id other{ 0xbabe, 0xcafe };
+    const std::chrono::system_clock::time_point t0{ 1000h };
+
+    {
+        Journal journal;
+        ASSERT_TRUE(journal.open(path));
+        Journal locked;
+        ASSERT_FALSE(locked.open(path));
+
+        journal.record_device(phone, true, t0);
+        journal.record_device(phone, false, t0 + 1h);
+        journal.record_device(other, false, t0 + 90min);
+        journal.record_alarm(true, t0 + 2h);
+        journal.record_device(phone, true, t0 + 3h);
+        journal.record_alarm(false, t0 + 3h);
+        journal.record_device(phone, false, t0 + 10h);
+        // Arrives late, is kept in order at the time of the last record.
+        journal.record_device(other, true, t0 + 9h);
+    }
+
+    Journal journal;
+    ASSERT_TRUE(journal.open(path));
+    ASSERT_EQ(journal.size(), 8);
+    ASSERT_EQ(journal.range(t0 + 1h, t0 + 3h).size(), 3);
+    ASSERT_EQ(journal.range(t0 + 10h, t0 + 11h).back().key, other.packed());
+
+    ASSERT_EQ(journal.disconnected_time(phone, t0, t0 + 4h), 2h);
+    ASSERT_EQ(journal.disconnected_time(phone, t0 + 2h, t0 + 11h), 2h);
+    ASSERT_EQ(journal.disconnected_time(other, t0, t0 + 2h), 30min);
+    ASSERT_EQ(journal.alarm_time(t0, t0 + 12h), 1h);
+
+    // Folding keeps the state at the end of the folded records.
+    ASSERT_TRUE(journal.compact(t0 + 150min));
+    ASSERT_EQ(journal.size(), 7);
+    ASSERT_EQ(journal.disconnected_time(phone, t0 + 150min, t0 + 4h), 30min);
+    ASSERT_EQ(journal.disconnected_time(other, t0 + 2h, t0 + 4h), 2h);
+    ASSERT_EQ(journal.alarm_time(t0 + 150min, t0 + 12h), 30min);
+
+    std::thread writer([&journal, &phone, t0] {
+        for (int i = 0; i < 1000; ++i) {
+            journal.record_device(phone, i % 2, t0 + 11h);
+        }
+    });
+    for (int i = 0; i < 1000; ++i) {
+        journal.record_alarm(i % 2, t0 + 11h);
+    }
+    writer.join();
+    journal.flush();
+    ASSERT_EQ(journal.size() + journal.dropped(), 2007);
+    std::filesystem::remove(path);
+}
+
+TEST(NAME, test_journal_index)
+{
+    using namespace std::chrono_literals;
+    const std::filesystem::path path{ "/tmp/boredomlock-test.journal" };
+    std::filesystem::remove(path);
+    const std::chrono::system_clock::time_point t0{ 1000h };
+
+    struct Change
+    {
+        std::chrono::system_clock::time_point at;
+        usb_id id;
+        bool connected;
+    };
+    std::vector<Change> changes;
+    // Device 0 counts as connected until its first record.
+    const auto expected = [&changes](const usb_id& id,
+                                     std::chrono::system_clock::time_point from,
+                                     std::chrono::system_clock::time_point to) {
+        bool disconnected = false;
+        auto since = from;
+        std::chrono::nanoseconds total{ 0 };
+        for (const auto& change : changes) {
+            if (change.id != id || change.at >= to) {
+                continue;
+            }
+            if (change.at > from && disconnected) {
+                total += change.at - since;
+            }
+            since = std::max(change.at, from);
+            disconnected = !change.connected;
+        }
+        if (disconnected) {
+            total += to - since;
+        }
+        return total;
+    };
+
+    auto journal = std::make_unique<Journal>();
+    ASSERT_TRUE(journal->open(path));
+    // More records than between two checkpoints, for a few devices.
+    uint32_t random = 1;
+    for (int i = 0; i < 3 * static_cast<int>(Journal::CHECKPOINT_INTERVAL);
+         ++i) {
+        random = random * 1103515245 + 12345;
+        const usb_id id{ 0x1000, static_cast<uint16_t>(random >> 16 & 7) };
+        const bool connected = random >> 8 & 1;
+        changes.push_back({ t0 + i * 1s, id, connected });
+        journal->record_device(id, connected, changes.back().at);
+    }
+
+    const auto check = [&] {
+        for (uint16_t pid = 0; pid < 9; ++pid) {
+            const usb_id id{ 0x1000, pid };
+            for (const auto& [from, to] :
+                 { std::pair{ t0, t0 + 20000s },
+                   std::pair{ t0 + 4000s, t0 + 4200s },
+                   std::pair{ t0 + 4095s, t0 + 8193s },
+                   std::pair{ t0 + 12000s, t0 + 20000s },
+                   std::pair{ t0 - 10s, t0 + 5s } }) {
+                ASSERT_EQ(journal->disconnected_time(id, from, to),
+                          expected(id, from, to))
+                  << pid << " " << (from - t0).count();
+            }
+        }
+    };
+    check();
+    // The index is rebuilt when the file is mapped again.
+    journal = std::make_unique<Journal>();
+    ASSERT_TRUE(journal->open(path));
+    check();
+
+    // Devices beyond the index are scanned.
+    for (uint16_t pid = 1; pid <= Journal::INDEX_SLOTS; ++pid) {
+        const usb_id id{ 0x2000, pid };
+        changes.push_back({ t0 + 20000s + pid * 1s, id, false });
+        journal->record_device(id, false, changes.back().at);
+    }
+    for (const uint16_t pid : { 1, 1024 }) {
+        const usb_id id{ 0x2000, pid };
+        ASSERT_EQ(journal->disconnected_time(id, t0, t0 + 30000s),
+                  expected(id, t0, t0 + 30000s));
+    }
+    check();
+
+    // Compaction keeps the state at the start of later ranges.
+    ASSERT_TRUE(journal->compact(t0 + 10000s));
+    for (uint16_t pid = 0; pid < 8; ++pid) {
+        const usb_id id{ 0x1000, pid };
+        ASSERT_EQ(journal->disconnected_time(id, t0 + 10000s, t0 + 12345s),
+                  expected(id, t0 + 10000s, t0 + 12345s));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(NAME, test_udev_source)
+{
+    usb_id id{};
+    ASSERT_TRUE(usb_id_from_uevent_product("46d/c52b/1201", id));
+    ASSERT_EQ(id, (usb_id{ 0x046d, 0xc52b }));
+    ASSERT_TRUE(usb_id_from_uevent_product("dead/beef", id));
+    ASSERT_EQ(id, (usb_id{ 0xdead, 0xbeef }));
+    ASSERT_FALSE(usb_id_from_uevent_product("46d", id));
+    ASSERT_FALSE(usb_id_from_uevent_product("46d/x", id));
+    ASSERT_FALSE(usb_id_from_uevent_product("12345/1/0", id));
+
+    USBTracker tracker(UDEV_BACKEND);
+    tracker.set_measure(true);
+    tracker.start_tracking();
+    ASSERT_TRUE(tracker.is_running());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto stats = tracker.stats();
+    tracker.stop_tracking();
+
+    ASSERT_LT(stats.wakeups_per_second(), 50.0);
+}
+
+TEST(NAME, test_usb_tracker_instances)
+{
+    const auto port = parse_usb_port("1-1.4");
+    ASSERT_EQ(port.bus, 1);
+    ASSERT_EQ(port.depth, 2);
+    ASSERT_EQ(port.to_string(), "1-1.4");
+    ASSERT_EQ(parse_usb_port("usb2").to_string(), "usb2");
+    ASSERT_TRUE(parse_usb_port("1-1.4:1.0").empty());
+    ASSERT_TRUE(parse_usb_port("1-").empty());
+
+    USBTracker tracker;
+    const usb_id id{ 0xdead, 0xbeef };
+    const USBDeviceInstance first{ id, parse_usb_port("1-1"), "A" };
+    const USBDeviceInstance second{ id, parse_usb_port("1-2"), "B" };
+
+    tracker.handle_device_add_event(first);
+    tracker.handle_device_add_event(second);
+    // Reported by both the enumeration and a hotplug event.
+    tracker.handle_device_add_event(first);
+    ASSERT_EQ(tracker.connected_devices().size(), 2);
+
+    USBDevice pinned{ id, "pinned" };
+    pinned.serial = "A";
+    ASSERT_TRUE(tracker.is_connected(pinned));
+
+    tracker.handle_device_remove_event(USBDeviceInstance{ id, first.port });
+    ASSERT_TRUE(tracker.usb_id_is_connected(id));
+    ASSERT_FALSE(tracker.is_connected(pinned));
+    ASSERT_TRUE(tracker.is_connected(USBDevice{ id, "any" }));
+
+    pinned = USBDevice{ id, "pinned" };
+    pinned.port = second.port;
+    ASSERT_TRUE(tracker.is_connected(pinned));
+
+    tracker.handle_device_remove_event(id);
+    ASSERT_FALSE(tracker.usb_id_is_connected(id));
+    ASSERT_TRUE(tracker.connected_devices().empty());
+}
+
+TEST(NAME, test_unconnected_changes)
+{
+    const usb_id id{ 0xdead, 0xbeef };
+    create_test_file(id, "12:00-13:00", "12:00-13:00");
+
+    const auto today = std::time(nullptr);
+    std::tm local{};
+    localtime_r(&today, &local);
+    // Tomorrow, after the snoozes saved by other tests.
+    local.tm_mday++;
+    local.tm_hour = 11;
+    local.tm_min = 59;
+    local.tm_sec = 30;
+    auto clock = std::make_shared<ManualClock>(
+      std::chrono::system_clock::from_time_t(std::mktime(&local)));
+
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    sched.set_clock(clock);
+    auto changes = sched.unconnected_changes(0);
+    ASSERT_TRUE(changes.unconnected.empty());
+    const auto start = changes.generation;
+
+    // Period boundary.
+    clock->advance(std::chrono::minutes(1));
+    changes = sched.unconnected_changes(start);
+    ASSERT_GT(changes.generation, start);
+    ASSERT_EQ(changes.unconnected.size(), 1);
+    ASSERT_EQ(changes.unconnected[0].name, "TestDevice");
+    const auto unconnected = changes.generation;
+    ASSERT_EQ(sched.unconnected_changes(unconnected).generation, unconnected);
+
+    // Hotplug events, stamped by the scheduler's clock.
+    const std::filesystem::path journal{
+        "/tmp/boredomlock-test-clock.journal"
+    };
+    std::filesystem::remove(journal);
+    ASSERT_TRUE(sched.open_journal(journal));
+    const auto plugged = clock->now();
+    auto tracker = USBTracker::shared();
+    tracker->handle_device_add_event(id);
+    changes = sched.unconnected_changes(unconnected);
+    ASSERT_TRUE(changes.unconnected.empty());
+    ASSERT_EQ(changes.reconnected.size(), 1);
+    clock->advance(std::chrono::seconds(20));
+    tracker->handle_device_remove_event(id);
+    ASSERT_TRUE(sched.list_unconnected_devices().size() == 1);
+    ASSERT_EQ(sched.journal().disconnected_time(
+                id, plugged, plugged + std::chrono::seconds(30)),
+              std::chrono::seconds(10));
+
+    // The changes since unconnected cancel out.
+    changes = sched.unconnected_changes(unconnected);
+    ASSERT_GT(changes.generation, unconnected);
+    ASSERT_TRUE(changes.unconnected.empty());
+    ASSERT_TRUE(changes.reconnected.empty());
+
+    sched.snooze(id, std::chrono::seconds(10));
+    ASSERT_EQ(sched.next_change(), clock->now() + std::chrono::seconds(10));
+    changes = sched.unconnected_changes(changes.generation);
+    ASSERT_EQ(changes.reconnected.size(), 1);
+    clock->advance(std::chrono::seconds(11));
+    changes = sched.unconnected_changes(changes.generation);
+    ASSERT_EQ(changes.unconnected.size(), 1);
+
+    clock->advance(std::chrono::hours(1));
+    changes = sched.unconnected_changes(0);
+    ASSERT_TRUE(changes.unconnected.empty());
+    ASSERT_TRUE(sched.list_unconnected_devices().empty());
+    sched.set_clock(std::make_shared<SystemClock>());
+    sched.snooze(id, std::chrono::seconds(0));
+}
+
+static DetachedTask
+await_event(USBTracker& tracker, usb_id id, std::optional<USBEvent>& result)
+{
+    result = co_await tracker.next_event(id);
+}
+
+static DetachedTask
+await_state(BoredomScheduler& sched, std::vector<bool>& changes)
+{
+    changes.push_back(co_await sched.state_change());
+    changes.push_back(co_await sched.state_change());
+}
+
+TEST(NAME, test_coroutines)
+{
+    USBTracker tracker;
+    const usb_id id{ 0xdead, 0xbeef };
+    std::optional<USBEvent> event;
+    await_event(tracker, id, event);
+    tracker.handle_device_add_event(usb_id{ 0xbabe, 0xcafe });
+    ASSERT_FALSE(event);
+    tracker.handle_device_add_event(id);
+    ASSERT_TRUE(event);
+    ASSERT_EQ(event->id, id);
+    ASSERT_EQ(event->type, DEVICE_ARRIVED);
+
+    // Coroutines are only resumed when the executor runs them.
+    std::vector<std::coroutine_handle<>> posted;
+    tracker.set_executor(
+      [&posted](std::coroutine_handle<> handle) { posted.push_back(handle); });
+    event.reset();
+    await_event(tracker, id, event);
+    tracker.handle_device_remove_event(id);
+    ASSERT_FALSE(event);
+    ASSERT_EQ(posted.size(), 1);
+    posted[0].resume();
+    ASSERT_TRUE(event);
+    ASSERT_EQ(event->type, DEVICE_LEFT);
+
+    create_test_file(id, "00:00-24:00", "00:00-24:00");
+    auto sched = BoredomScheduler{ TEST_FILE_PATH };
+    sched.init();
+    std::vector<bool> changes;
+    await_state(sched, changes);
+    sched.snooze(std::chrono::seconds(60));
+    sched.handle_events();
+    ASSERT_EQ(changes, std::vector<bool>{ false });
+    sched.snooze(std::chrono::seconds(0));
+    sched.handle_events();
+    ASSERT_EQ(changes, (std::vector<bool>{ false, true }));
+}
+
+TEST(NAME, test_timer_wheel)
+{
+    using namespace std::chrono_literals;
+    const auto start = std::chrono::system_clock::from_time_t(1700000000);
+    TimerWheel wheel(start);
+    ASSERT_EQ(wheel.next_expiry(), TimerWheel::time_point::max());
+
+    // One timer per level and one past the last level.
+    const std::vector<std::chrono::milliseconds> delays = {
+        5ms, 100ms, 10s, 10min, 12h, 1000h, 24h * 365 * 10, 24h * 365 * 100
+    };
+    std::vector<TimerId> ids;
+    for (std::size_t i = 0; i < delays.size(); ++i) {
+        ids.push_back(wheel.add(start + delays[i], i));
+    }
+    const auto cancelled = wheel.add(start + 7s, 100);
+    ASSERT_EQ(wheel.size(), delays.size() + 1);
+    ASSERT_EQ(wheel.next_expiry(), start + 5ms);
+    ASSERT_TRUE(wheel.cancel(cancelled));
+    ASSERT_FALSE(wheel.cancel(cancelled));
+
+    std::vector<uint64_t> expired;
+    ASSERT_EQ(wheel.advance(start + 4ms, expired), 0);
+    ASSERT_EQ(wheel.advance(start + 5ms, expired), 1);
+    ASSERT_EQ(wheel.next_expiry(), start + 100ms);
+    ASSERT_FALSE(wheel.cancel(ids[0]));
+
+    // Timers of higher levels move down without expiring early.
+    for (std::size_t i = 1; i < 6; ++i) {
+        ASSERT_EQ(wheel.advance(start + delays[i] - 1ms, expired), 0);
+        ASSERT_EQ(wheel.next_expiry(), start + delays[i]);
+        ASSERT_EQ(wheel.advance(start + delays[i], expired), 1);
+    }
+
+    // A jump expires the rest in order, the last one clamped.
+    ASSERT_TRUE(wheel.cancel(ids[6]));
+    const auto early = wheel.add(start + 2000h, 6);
+    const auto late = wheel.add(start + 3000h, 7);
+    ASSERT_EQ(wheel.advance(start + 24h * 365 * 150, expired), 3);
+    ASSERT_EQ(expired, (std::vector<uint64_t>{ 0, 1, 2, 3, 4, 5, 6, 7, 7 }));
+    ASSERT_EQ(wheel.size(), 0);
+    ASSERT_FALSE(wheel.cancel(early));
+    ASSERT_FALSE(wheel.cancel(late));
+
+    // Restarting at an earlier time drops the timers.
+    wheel.add(wheel.now() + 1s, 8);
+    wheel.reset(start);
+    ASSERT_EQ(wheel.size(), 0);
+    ASSERT_EQ(wheel.now(), start);
+    wheel.add(start - 1s, 9);
+    expired.clear();
+    ASSERT_EQ(wheel.advance(start, expired), 1);
+    ASSERT_EQ(expired[0], 9);
+
+    // The last level wraps around.
+    const TimerWheel::time_point edge(std::chrono::milliseconds(1ull << 42) -
+                                      10ms);
+    wheel.reset(edge);
+    wheel.add(edge + 1h, 10);
+    ASSERT_EQ(wheel.advance(edge + 1h - 1ms, expired), 0);
+    ASSERT_EQ(wheel.next_expiry(), edge + 1h);
+    ASSERT_EQ(wheel.advance(edge + 1h, expired), 1);
+}
+
 int
 main(int argc, char** argv)
 {